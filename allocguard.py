@@ -0,0 +1,158 @@
+#!/usr/bin/env python3
+
+"""Check that the clock path allocates nothing, in every mode of clock.py.
+
+Runs clock.py once per mode with malloc_guard.so preloaded in report mode,
+stops it after a few seconds and reads the guard's summary: how many
+real-time sections (the library calls a pacing loop makes) were entered
+and how many allocations happened inside them. Build liblinkbridge.so and
+the guard first, then:
+
+    gcc -O2 -fPIC -shared -o malloc_guard.so malloc_guard.c
+    python3 allocguard.py
+
+The route mode sends the clock through the kernel's MIDI Through port
+(14:0), which also serves as its loopback; the audio beat mode tracks a
+click track written to a scratch WAV file. The audio clock and the PCM
+queue timer need a capture device, given with --pcm.
+
+The engine's audio clock and beat tracker threads are watched for their
+whole run, from when their setup is done. The Python loop between library
+calls is not watched: the interpreter allocates as it goes.
+
+A mode fails when anything was allocated in a section, when no section was
+entered (the guard was not connected), when clock.py could not turn the
+mode's feature on or when it exited with an error. The backtraces of the
+first allocations are in the output of that mode, printed with --verbose.
+Exits non-zero if any mode failed.
+"""
+
+import argparse
+import os
+import re
+import signal
+import subprocess
+import struct
+import sys
+import tempfile
+import time
+import wave
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+SUMMARY = re.compile(r"malloc_guard: (\d+) real-time sections, (\d+) allocations in them")
+NOT_IN_EFFECT = "[Python] Warning: Failed"
+CLICK_RATE = 48000
+CLICK_BPM = 120
+
+# name, clock.py options; {tmp} is a scratch directory, {wav} a click track in it
+MODES = [
+    ("queue", []),
+    ("wall", ["--pacing", "wall"]),
+    ("direct", ["--dispatch", "direct"]),
+    ("hrtimer", ["--queue-timer", "hrtimer"]),
+    ("outputs", ["--clock-output", "2/1", "--clock-output", "1/2"]),
+    ("mtc", ["--mtc", "25", "--mtc-port"]),
+    ("merge", ["--merge-input", "2"]),
+    ("midi-in", ["--midi-in-fallback"]),
+    ("conditioned", ["--tempo-median", "5", "--tempo-hysteresis", "0.1", "--tempo-snap", "0.2"]),
+    ("flight", ["--flight-recorder", "{tmp}/fr"]),
+    ("standby", ["--shared-state", "/linkbridge-allocguard"]),
+    ("reclock", ["--reclock"]),
+    ("route", ["--route", "14:0,14:0", "--route-interval", "1"]),
+    ("audio-beat", ["--audio-beat", "{wav}"]),
+]
+
+
+def write_click(path, seconds):
+    """A mono 16-bit click track at CLICK_BPM for the beat tracker."""
+    period = CLICK_RATE * 60 // CLICK_BPM
+    frames = bytearray()
+    for i in range(int(seconds * CLICK_RATE)):
+        k = i % period
+        sample = 0 if k >= 240 else 20000 if k % 2 == 0 else -20000  # 5 ms burst on every beat
+        frames += struct.pack("<h", sample)
+    with wave.open(path, "wb") as out:
+        out.setnchannels(1)
+        out.setsampwidth(2)
+        out.setframerate(CLICK_RATE)
+        out.writeframes(bytes(frames))
+
+
+def run(name, options, seconds, guard, verbose):
+    """Run clock.py in one mode.
+
+    Returns ((sections, allocations) or None without a summary, exit code,
+    whether a requested feature failed to turn on)."""
+    env = dict(os.environ, LD_PRELOAD=guard, LINKBRIDGE_GUARD="report")
+    with tempfile.TemporaryDirectory(prefix="allocguard-") as tmp:
+        wav = os.path.join(tmp, "click.wav")
+        if any("{wav}" in o for o in options):
+            write_click(wav, seconds + 5)
+        cmd = [sys.executable, os.path.join(HERE, "clock.py")] + [o.format(tmp=tmp, wav=wav) for o in options]
+        proc = subprocess.Popen(cmd, env=env, stdout=subprocess.PIPE, stderr=subprocess.STDOUT, text=True)
+        time.sleep(seconds)
+        proc.send_signal(signal.SIGINT)
+        try:
+            output, _ = proc.communicate(timeout=10)
+        except subprocess.TimeoutExpired:
+            proc.kill()
+            output, _ = proc.communicate()
+    if verbose:
+        print(f"[Python] --- {name}: {' '.join(cmd[1:])}")
+        print(output)
+    summary = SUMMARY.findall(output)
+    missing = NOT_IN_EFFECT in output
+    if not summary:
+        return None, proc.returncode, missing
+    sections, allocations = (int(v) for v in summary[-1])
+    return (sections, allocations), proc.returncode, missing
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Allocations on the clock path, per clock.py mode")
+    parser.add_argument("--modes", default=",".join(name for name, _ in MODES),
+                        help="comma separated, of: " + ", ".join(name for name, _ in MODES))
+    parser.add_argument("--tempo-map", metavar="LBTM", help="also check playing this compiled tempo map")
+    parser.add_argument("--pcm", metavar="PCM",
+                        help="also check the audio clock and the PCM queue timer on this capture device")
+    parser.add_argument("--seconds", type=float, default=5.0, help="length of each run")
+    parser.add_argument("--guard", default=os.path.join(HERE, "malloc_guard.so"), help="path of the built guard")
+    parser.add_argument("--verbose", action="store_true", help="print the output of every run")
+    args = parser.parse_args()
+
+    modes = dict(MODES)
+    extra = []
+    if args.tempo_map:
+        modes["tempo-map"] = ["--tempo-map", os.path.abspath(args.tempo_map)]
+        extra.append("tempo-map")
+    if args.pcm:
+        modes["audio-clock"] = ["--audio-clock", args.pcm]
+        modes["pcm-timer"] = ["--audio-clock", args.pcm, "--audio-lock"]
+        extra += ["audio-clock", "pcm-timer"]
+    selected = args.modes.split(",") + extra
+    if any(m not in modes for m in selected):
+        parser.error(f"unknown mode in {args.modes}")
+    if not os.path.exists(args.guard):
+        parser.error(f"{args.guard} not found, build it from malloc_guard.c")
+
+    failed = 0
+    for name in selected:
+        result, code, missing = run(name, modes[name], args.seconds, os.path.abspath(args.guard), args.verbose)
+        if result is None:
+            verdict, detail = "FAIL", "no real-time section entered"
+        else:
+            sections, allocations = result
+            verdict = "ok" if allocations == 0 and sections > 0 and code == 0 else "FAIL"
+            detail = f"{sections} sections, {allocations} allocations"
+        if missing:
+            verdict = "FAIL"
+            detail += ", not in effect"
+        if code != 0:
+            detail += f", exit code {code}"
+        failed += verdict != "ok"
+        print(f"[Python] {name:12s} {verdict:4s} {detail}")
+    return 1 if failed else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,160 @@
+#!/usr/bin/env python3
+
+"""Measure the audio beat tracker against annotated audio.
+
+Each input is a 16-bit PCM WAV file with a matching annotation file that
+lists one beat time in seconds per line (further columns, such as the bar
+position of .beats files, are ignored):
+
+    python3 beatbench.py song.wav song.beats [more.wav more.beats ...]
+
+The tracker runs offline (as fast as it can) unless --realtime is given.
+Reported per file and overall:
+
+- F-measure, precision and recall of the reported beats within +-70 ms
+- tempo accuracy: median reported tempo within 4% of the annotated one,
+  also allowing double/half/triple/third tempo (acc2)
+- time to lock: when the first of 4 consecutive correct beats occurred
+- reporting latency: how long after a beat the tracker reported it
+- processing cost per hop of audio
+"""
+
+import argparse
+import ctypes
+import json
+import os
+import statistics
+import sys
+import time
+
+TOLERANCE_S = 0.07
+TEMPO_TOLERANCE = 0.04
+LOCK_BEATS = 4
+POLL_INTERVAL = 0.001
+
+
+def load_lib():
+    lib_path = os.path.join(os.path.dirname(os.path.abspath(__file__)), 'liblinkbridge.so')
+    lib = ctypes.CDLL(lib_path)
+    lib.midi_beat_open.restype = ctypes.c_int
+    lib.midi_beat_open.argtypes = [ctypes.c_char_p, ctypes.c_uint, ctypes.c_int]
+    lib.midi_beat_close.restype = None
+    lib.midi_beat_next.restype = ctypes.c_int
+    lib.midi_beat_next.argtypes = [ctypes.POINTER(ctypes.c_double)] * 3
+    lib.midi_beat_stats.restype = None
+    lib.midi_beat_stats.argtypes = [ctypes.POINTER(ctypes.c_double)] * 2 + [ctypes.POINTER(ctypes.c_ulong)]
+    return lib
+
+
+def load_annotations(path):
+    beats = []
+    with open(path) as f:
+        for line in f:
+            fields = line.split()
+            if fields and not fields[0].startswith("#"):
+                beats.append(float(fields[0]))
+    return sorted(beats)
+
+
+def track(lib, wav, realtime):
+    if lib.midi_beat_open(wav.encode(), 0, int(realtime)) < 0:
+        raise RuntimeError(f"cannot track {wav}")
+    beat, detected, bpm = ctypes.c_double(), ctypes.c_double(), ctypes.c_double()
+    reported = []
+    try:
+        while True:
+            result = lib.midi_beat_next(ctypes.byref(beat), ctypes.byref(detected), ctypes.byref(bpm))
+            if result < 0:
+                break
+            if result == 0:
+                time.sleep(POLL_INTERVAL)
+                continue
+            reported.append((beat.value, detected.value, bpm.value))
+        mean_us, max_us, dropped = ctypes.c_double(), ctypes.c_double(), ctypes.c_ulong()
+        lib.midi_beat_stats(ctypes.byref(mean_us), ctypes.byref(max_us), ctypes.byref(dropped))
+    finally:
+        lib.midi_beat_close()
+    return reported, mean_us.value, max_us.value, dropped.value
+
+
+def evaluate(reported, annotated):
+    matched, used = [], set()
+    for i, (t, _, _) in enumerate(reported):
+        nearest = min(range(len(annotated)), key=lambda j: abs(annotated[j] - t), default=None)
+        if nearest is not None and nearest not in used and abs(annotated[nearest] - t) <= TOLERANCE_S:
+            used.add(nearest)
+            matched.append(i)
+    precision = len(matched) / len(reported) if reported else 0.0
+    recall = len(matched) / len(annotated) if annotated else 0.0
+    f_measure = 2 * precision * recall / (precision + recall) if precision + recall else 0.0
+
+    true_bpm = 60.0 / statistics.median(b - a for a, b in zip(annotated, annotated[1:]))
+    tracked_bpm = statistics.median(bpm for _, _, bpm in reported) if reported else 0.0
+    ratio = tracked_bpm / true_bpm
+    acc1 = abs(ratio - 1.0) <= TEMPO_TOLERANCE
+    acc2 = any(abs(ratio / m - 1.0) <= TEMPO_TOLERANCE for m in (1.0, 2.0, 0.5, 3.0, 1.0 / 3.0))
+
+    lock_s = None
+    hits = set(matched)
+    for i in range(len(reported) - LOCK_BEATS + 1):
+        if all(i + k in hits for k in range(LOCK_BEATS)):
+            lock_s = reported[i][0]
+            break
+    latency_ms = [(d - t) * 1000.0 for t, d, _ in reported]
+    return {
+        "f_measure": f_measure,
+        "precision": precision,
+        "recall": recall,
+        "true_bpm": true_bpm,
+        "tracked_bpm": tracked_bpm,
+        "acc1": acc1,
+        "acc2": acc2,
+        "lock_s": lock_s,
+        "latency_ms_mean": statistics.mean(latency_ms) if latency_ms else None,
+        "latency_ms_max": max(latency_ms) if latency_ms else None,
+    }
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Audio beat tracker benchmark")
+    parser.add_argument("pairs", nargs="+", metavar="WAV BEATS")
+    parser.add_argument("--realtime", action="store_true", help="feed the audio at its own pace")
+    parser.add_argument("--json", metavar="PATH", help="also write the results as JSON")
+    args = parser.parse_args()
+    if len(args.pairs) % 2:
+        parser.error("expected pairs of WAV and annotation files")
+
+    lib = load_lib()
+    results = []
+    for wav, annotation in zip(args.pairs[::2], args.pairs[1::2]):
+        reported, mean_us, max_us, dropped = track(lib, wav, args.realtime)
+        result = evaluate(reported, load_annotations(annotation))
+        result.update(file=wav, beats=len(reported), dropped=dropped,
+                      process_us_mean=mean_us, process_us_max=max_us)
+        results.append(result)
+        lock = f"{result['lock_s']:.2f} s" if result["lock_s"] is not None else "never"
+        latency = (f"{result['latency_ms_mean']:.1f} ms (max {result['latency_ms_max']:.1f})"
+                   if result["latency_ms_mean"] is not None else "-")
+        print(f"{wav}: F {result['f_measure']:.3f} (P {result['precision']:.3f} R {result['recall']:.3f})"
+              f" | {result['tracked_bpm']:.2f} / {result['true_bpm']:.2f} BPM"
+              f" acc1 {'yes' if result['acc1'] else 'no'} acc2 {'yes' if result['acc2'] else 'no'}"
+              f" | lock {lock} | latency {latency}"
+              f" | {mean_us:.1f} us/hop (max {max_us:.1f})"
+              + (f" | {dropped} beats dropped" if dropped else ""))
+
+    summary = {
+        "files": len(results),
+        "f_measure": statistics.mean(r["f_measure"] for r in results),
+        "acc1": sum(r["acc1"] for r in results) / len(results),
+        "acc2": sum(r["acc2"] for r in results) / len(results),
+    }
+    print(f"Overall: F {summary['f_measure']:.3f}, acc1 {summary['acc1']:.0%}, acc2 {summary['acc2']:.0%}"
+          f" over {summary['files']} files")
+    if args.json:
+        with open(args.json, "w") as f:
+            json.dump({"summary": summary, "files": results}, f, indent=2)
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -1,5 +1,6 @@
 #!/usr/bin/env python3
 
+import argparse
 import ctypes
 import time
 import signal
@@ -12,37 +13,48 @@ from aalink import Link
 # Constants
 BPM = 120
 PPQN = 24  # Pulses Per Quarter Note
+MAP_SERVICE_INTERVAL = 0.01  # seconds between tempo map refills
+MTC_RATES = {"24": 0, "25": 1, "29.97df": 2, "30": 3}
+MTC_LOOKAHEAD_MS = 100
+QUEUE_TIMERS = {"system": 0, "hrtimer": 1}
+AUDIO_PERIOD_FRAMES = 256
+DRIFT_REPORT_BEATS = 32  # how often the audio clock drift is printed
+RECLOCK_FLYWHEEL_MS = 2000
+RECLOCK_SERVICE_INTERVAL = 0.002
+RECLOCK_REPORT_INTERVAL = 2.0
+SOURCE_SERVICE_CLOCKS = 6  # tempo source arbitration runs every 16th note
+SOURCE_NAMES = ["Link", "MIDI clock-in", "audio", "internal"]
+STANDBY_WAITING = 2  # role returned by midi_standby_open
+STANDBY_POLL_INTERVAL = 0.001
+DIN_BYTES_PER_SEC = 3125
 
 # Global state
 running = True
 midi_lib = None
 tick_interval = None
+# latest Link reading (tempo, beat, monotonic ns, peers), written by the Link thread
+link_state = None
 
 # use float BPM with 0.1 precision
 current_bpm = float(BPM)
 
-def change_tempo(new_bpm):
-    """Change the tempo of the MIDI clock (applies to the C library).
+def follow_tempo_source():
+    """Hand the latest Link reading to the C library and let it steer the tempo.
 
-    This function updates the C library tempo (if available) and recalculates
-    the Python tick interval to keep timing in sync.
+    The library arbitrates between Link, MIDI clock-in and its own clock; the
+    Python tick interval follows whatever tempo it settles on.
     """
-    global midi_lib, current_bpm, tick_interval
-    # new_bpm can be fractional (float). We send tempo to C in tenths (int)
-    bpm10 = int(round(float(new_bpm) * 10.0))
-    if midi_lib is None:
-        # library not ready yet — just update local tempo so main loop picks it up
-        current_bpm = float(new_bpm)
-        tick_interval = calculate_tick_interval(current_bpm)
-        print(f"[Python] Tempo updated locally -> {current_bpm:.1f} BPM (C lib not ready)")
+    global current_bpm, tick_interval
+    if link_state is not None:
+        midi_lib.midi_source_link_update(*link_state)
+    if midi_lib.midi_source_service() < 0:
+        print("[Python] Warning: Failed to service tempo source")
         return
-
-    if midi_lib.midi_set_tempo(bpm10) < 0:
-        print(f"[Python] Warning: Failed to set tempo to {float(new_bpm):.1f} BPM in C library")
-    else:
-        current_bpm = float(new_bpm)
-        tick_interval = calculate_tick_interval(current_bpm)
-        print(f"[Python] Tempo changed -> {current_bpm:.1f} BPM")
+    bpm = midi_lib.midi_get_tempo()
+    if abs(bpm - current_bpm) >= 0.1:
+        print(f"[Python] Tempo changed -> {bpm:.1f} BPM")
+        current_bpm = bpm
+    tick_interval = calculate_tick_interval(bpm)
 
 
 def signal_handler(sig, frame):
@@ -56,8 +68,149 @@ def calculate_tick_interval(bpm):
     ticks_per_second = (bpm / 60.0) * PPQN
     return 1.0 / ticks_per_second
 
+def run_tempo_map(args):
+    """Play a compiled setlist (see tempomap.py) instead of following Link.
+
+    The C library streams clocks and tempo changes from the map; this loop
+    only keeps it serviced.
+    """
+    if midi_lib.midi_map_load(args.tempo_map.encode()) < 0:
+        print(f"[Python] Error: Failed to load tempo map {args.tempo_map}")
+        return 1
+    if midi_lib.midi_map_play(args.song, args.lookahead_ms) < 0:
+        print(f"[Python] Error: Failed to play song {args.song}")
+        return 1
+
+    while running and midi_lib.midi_map_get_song() >= 0:
+        if midi_lib.midi_map_service() < 0:
+            print("[Python] Error: Failed to service tempo map")
+            break
+        time.sleep(MAP_SERVICE_INTERVAL)
+    return 0
+
+def run_reclock(args):
+    """Re-emit a jittery incoming clock as a clean one instead of following Link."""
+    in_port = midi_lib.midi_reclock_enable(args.lookahead_ms, RECLOCK_FLYWHEEL_MS)
+    if in_port < 0:
+        print("[Python] Error: Failed to enable reclocking")
+        return 1
+    print(f"[Python] Connect the clock source with: aconnect <source> {midi_lib.midi_get_client_id()}:{in_port}")
+
+    next_report = time.monotonic() + RECLOCK_REPORT_INTERVAL
+    while running:
+        if midi_lib.midi_reclock_service() < 0:
+            print("[Python] Error: Failed to service reclocker")
+            break
+        if time.monotonic() >= next_report:
+            next_report += RECLOCK_REPORT_INTERVAL
+            in_jitter, out_jitter, bpm = ctypes.c_double(), ctypes.c_double(), ctypes.c_double()
+            dropped, flywheeled = ctypes.c_ulong(), ctypes.c_ulong()
+            midi_lib.midi_reclock_stats(ctypes.byref(in_jitter), ctypes.byref(out_jitter), ctypes.byref(bpm),
+                                        ctypes.byref(dropped), ctypes.byref(flywheeled))
+            print(f"[Python] Reclock {bpm.value:6.2f} BPM | jitter in {in_jitter.value:7.1f} us"
+                  f" out {out_jitter.value:6.1f} us | dropped {dropped.value} flywheeled {flywheeled.value}")
+        time.sleep(RECLOCK_SERVICE_INTERVAL)
+    return 0
+
+def wait_for_takeover():
+    """Stand by until the active instance goes away, then continue its clock.
+
+    Returns 1 if its clock was running, 2 if it was stopped, None when
+    interrupted or on error.
+    """
+    print("[Python] Standing by for the active instance")
+    while running:
+        result = midi_lib.midi_standby_service()
+        if result < 0:
+            print("[Python] Error: Failed to watch the active instance")
+            return None
+        if result > 0:
+            print("[Python] Took over from the active instance")
+            return result
+        time.sleep(STANDBY_POLL_INTERVAL)
+    return None
+
 def main():
     global running, midi_lib, tick_interval, current_bpm
+
+    parser = argparse.ArgumentParser(description="Ableton Link to MIDI clock bridge")
+    parser.add_argument("--tempo-map", help="play a compiled setlist instead of following Link")
+    parser.add_argument("--song", type=int, default=0, help="setlist song to start with")
+    parser.add_argument("--lookahead-ms", type=int, default=200,
+                        help="how far ahead the tempo map is queued (or the reclocker delays)")
+    parser.add_argument("--mtc", choices=list(MTC_RATES),
+                        help="also send MIDI Time Code at this frame rate")
+    parser.add_argument("--mtc-port", action="store_true",
+                        help="send MTC on its own port instead of the clock port")
+    parser.add_argument("--clock-output", action="append", default=[], metavar="NUM/DEN",
+                        help="extra clock port at NUM/DEN times 24 PPQN (e.g. 2/1, 1/2, 3/2)")
+    parser.add_argument("--reclock", action="store_true",
+                        help="re-emit a clock received on the input port instead of following Link")
+    parser.add_argument("--queue-timer", choices=list(QUEUE_TIMERS),
+                        help="timer driving the ALSA queue")
+    parser.add_argument("--audio-clock", metavar="PCM",
+                        help="capture device whose sample clock the MIDI clock is measured against")
+    parser.add_argument("--audio-rate", type=int, default=48000, help="sample rate of the audio clock and beat tracker devices")
+    parser.add_argument("--audio-lock", action="store_true",
+                        help="drive the queue from the audio clock's period timer")
+    parser.add_argument("--midi-in-fallback", action="store_true",
+                        help="follow clock received on the input port when Link is gone")
+    parser.add_argument("--max-slew", type=float, default=5.0,
+                        help="fastest tempo change when following a source (BPM per second)")
+    parser.add_argument("--max-phase-rate", type=float, default=0.05,
+                        help="fastest phase correction when following a source (beats per second)")
+    parser.add_argument("--tempo-median", type=int, default=1, metavar="N",
+                        help="follow the median of the last N source tempo readings")
+    parser.add_argument("--tempo-hysteresis", type=float, default=0.0, metavar="BPM",
+                        help="ignore source tempo changes smaller than this")
+    parser.add_argument("--tempo-quantum", type=float, default=0.0, metavar="BPM",
+                        help="round the source tempo to multiples of this (0: off)")
+    parser.add_argument("--tempo-snap", type=float, default=0.0, metavar="BPM",
+                        help="snap the source tempo to whole BPM when this close (0: off)")
+    parser.add_argument("--audio-beat", metavar="PCM",
+                        help="track the beat of this capture device (or .wav file) as a tempo source")
+    parser.add_argument("--merge-input", type=int, default=0, metavar="N",
+                        help="add N input ports whose events are merged into the clock output")
+    parser.add_argument("--wire-rate", type=int, default=DIN_BYTES_PER_SEC,
+                        help="bytes/s of the output link merged events are fitted around clocks on (0: USB, no fitting);"
+                             " also the wire time taken out of route latency probes")
+    parser.add_argument("--dispatch", choices=["queue", "direct"], default="queue",
+                        help="send clocks through the ALSA queue, or unqueued on deadlines kept by the library"
+                             " (direct: Link and MIDI clock-in following only)")
+    parser.add_argument("--pacing", choices=["queue", "wall"], default="queue",
+                        help="send clocks as the ALSA queue needs them (queue) or on a wall clock timer (wall)")
+    parser.add_argument("--queue-low-ms", type=float, default=10.0,
+                        help="send the next clock when the queue holds less than this")
+    parser.add_argument("--queue-high-ms", type=float, default=40.0,
+                        help="count queue depths above this as a backlog")
+    parser.add_argument("--route", action="append", default=[], metavar="DEST,LOOPBACK",
+                        help="send the clock to DEST early by its latency, measured through the LOOPBACK input"
+                             " that echoes what DEST receives (client:port addresses)")
+    parser.add_argument("--route-share", type=float, default=0.5,
+                        help="part of the loopback round trip that is output latency")
+    parser.add_argument("--route-interval", type=int, default=60,
+                        help="seconds between route latency measurements")
+    parser.add_argument("--flight-recorder", metavar="PREFIX",
+                        help="keep recent timing records and dump them to PREFIX-<date>-<reason>.txt"
+                             " on anomalies or SIGUSR1")
+    parser.add_argument("--flight-seconds", type=int, default=30, help="seconds of history per dump")
+    parser.add_argument("--flight-late-ms", type=float, default=5.0,
+                        help="dump when a wakeup is this late (0: never)")
+    parser.add_argument("--flight-phase", type=float, default=0.05,
+                        help="dump when the followed source is this many beats out of phase (0: never)")
+    parser.add_argument("--trace", metavar="FILE",
+                        help="record engine activity and write it to FILE as Chrome trace JSON at exit"
+                             " (library built with -DLINKBRIDGE_TRACE)")
+    parser.add_argument("--shared-state", metavar="NAME",
+                        help="share the timeline in shared memory NAME (e.g. /linkbridge) for a hot standby;"
+                             " the second instance started with the same NAME stands by")
+    parser.add_argument("--standby", action="store_true",
+                        help="always start as the standby instance")
+    parser.add_argument("--standby-timeout-ms", type=int, default=250,
+                        help="heartbeat age at which the standby takes over")
+    parser.add_argument("--lock-memory", action="store_true",
+                        help="lock the process in memory once set up, so the clock path takes no page faults")
+    args = parser.parse_args()
     
     # Setup signal handler
     signal.signal(signal.SIGINT, signal_handler)
@@ -69,7 +222,7 @@ def main():
     if not os.path.exists(lib_path):
         print(f"Error: Library not found at {lib_path}")
         print("Please compile the library first:")
-        print("  gcc -shared -fPIC -o liblinkbridge.so midi_clock_lib.c -lasound")
+        print("  gcc -shared -fPIC -o liblinkbridge.so midi_clock_lib.c -lasound -lpthread -lrt -lm")
         return 1
     
     try:
@@ -91,23 +244,136 @@ def main():
     # Expose tempo setter from C library
     midi_lib.midi_set_tempo.restype = ctypes.c_int
     midi_lib.midi_set_tempo.argtypes = [ctypes.c_int]
+    midi_lib.midi_set_tempo_ubpm.restype = ctypes.c_int
+    midi_lib.midi_set_tempo_ubpm.argtypes = [ctypes.c_longlong]
+    # Tempo map playback
+    midi_lib.midi_map_load.restype = ctypes.c_int
+    midi_lib.midi_map_load.argtypes = [ctypes.c_char_p]
+    midi_lib.midi_map_play.restype = ctypes.c_int
+    midi_lib.midi_map_play.argtypes = [ctypes.c_int, ctypes.c_int]
+    midi_lib.midi_map_service.restype = ctypes.c_int
+    midi_lib.midi_map_get_song.restype = ctypes.c_int
+    # MIDI Time Code
+    midi_lib.midi_mtc_enable.restype = ctypes.c_int
+    midi_lib.midi_mtc_enable.argtypes = [ctypes.c_int, ctypes.c_int, ctypes.c_int]
+    midi_lib.midi_mtc_get_port_id.restype = ctypes.c_int
+    # Derived clock outputs
+    midi_lib.midi_add_clock_output.restype = ctypes.c_int
+    midi_lib.midi_add_clock_output.argtypes = [ctypes.c_char_p, ctypes.c_int, ctypes.c_int]
+    # Queue timer and audio clock
+    midi_lib.midi_set_queue_timer.restype = ctypes.c_int
+    midi_lib.midi_set_queue_timer.argtypes = [ctypes.c_int] * 4
+    midi_lib.midi_audio_clock_open.restype = ctypes.c_int
+    midi_lib.midi_audio_clock_open.argtypes = [ctypes.c_char_p, ctypes.c_uint, ctypes.c_uint, ctypes.c_int]
+    midi_lib.midi_audio_clock_drift.restype = ctypes.c_int
+    midi_lib.midi_audio_clock_drift.argtypes = [ctypes.POINTER(ctypes.c_double)] * 2
+    # Reclocker
+    midi_lib.midi_reclock_enable.restype = ctypes.c_int
+    midi_lib.midi_reclock_enable.argtypes = [ctypes.c_int, ctypes.c_int]
+    midi_lib.midi_reclock_service.restype = ctypes.c_int
+    midi_lib.midi_reclock_stats.restype = ctypes.c_int
+    midi_lib.midi_reclock_stats.argtypes = [ctypes.POINTER(ctypes.c_double)] * 3 + [ctypes.POINTER(ctypes.c_ulong)] * 2
+    # Tempo source arbitration
+    midi_lib.midi_source_enable.restype = ctypes.c_int
+    midi_lib.midi_source_enable.argtypes = [ctypes.c_double, ctypes.c_double]
+    midi_lib.midi_source_enable_midi_in.restype = ctypes.c_int
+    midi_lib.midi_source_link_update.restype = None
+    midi_lib.midi_source_link_update.argtypes = [ctypes.c_double, ctypes.c_double, ctypes.c_longlong, ctypes.c_int]
+    midi_lib.midi_source_service.restype = ctypes.c_int
+    midi_lib.midi_source_get_active.restype = ctypes.c_int
+    midi_lib.midi_get_tempo.restype = ctypes.c_double
+    midi_lib.midi_condition_set.restype = ctypes.c_int
+    midi_lib.midi_condition_set.argtypes = [ctypes.c_int, ctypes.c_double, ctypes.c_double, ctypes.c_double]
+    midi_lib.midi_condition_stats.restype = None
+    midi_lib.midi_condition_stats.argtypes = [ctypes.POINTER(ctypes.c_ulong)] * 3
+    # Audio beat tracker
+    midi_lib.midi_beat_open.restype = ctypes.c_int
+    midi_lib.midi_beat_open.argtypes = [ctypes.c_char_p, ctypes.c_uint, ctypes.c_int]
+    # MIDI merge
+    midi_lib.midi_merge_add_input.restype = ctypes.c_int
+    midi_lib.midi_merge_add_input.argtypes = [ctypes.c_char_p]
+    midi_lib.midi_merge_set_wire_rate.restype = ctypes.c_int
+    midi_lib.midi_merge_set_wire_rate.argtypes = [ctypes.c_int]
+    midi_lib.midi_merge_stats.restype = None
+    midi_lib.midi_merge_stats.argtypes = [ctypes.POINTER(ctypes.c_ulong)] * 3 + [ctypes.POINTER(ctypes.c_double)] * 2
+    midi_lib.midi_wait.restype = ctypes.c_int
+    midi_lib.midi_wait.argtypes = [ctypes.c_longlong]
+    # Direct dispatch
+    midi_lib.midi_set_dispatch.restype = ctypes.c_int
+    midi_lib.midi_set_dispatch.argtypes = [ctypes.c_int]
+    midi_lib.midi_direct_stats.restype = None
+    midi_lib.midi_direct_stats.argtypes = [ctypes.POINTER(ctypes.c_double)] * 2 + [ctypes.POINTER(ctypes.c_ulong)]
+    # Route latency compensation
+    midi_lib.midi_route_add.restype = ctypes.c_int
+    midi_lib.midi_route_add.argtypes = [ctypes.c_char_p, ctypes.c_char_p, ctypes.c_double, ctypes.c_int]
+    midi_lib.midi_route_service.restype = ctypes.c_int
+    # Queue occupancy
+    midi_lib.midi_occupancy_set_band.restype = ctypes.c_int
+    midi_lib.midi_occupancy_set_band.argtypes = [ctypes.c_int, ctypes.c_int]
+    midi_lib.midi_occupancy_wait_us.restype = ctypes.c_longlong
+    midi_lib.midi_occupancy_stats.restype = None
+    midi_lib.midi_occupancy_stats.argtypes = [ctypes.POINTER(ctypes.c_double)] * 3 + [ctypes.POINTER(ctypes.c_ulong)] * 2
+    # Flight recorder
+    midi_lib.midi_flight_enable.restype = ctypes.c_int
+    midi_lib.midi_flight_enable.argtypes = [ctypes.c_char_p, ctypes.c_int, ctypes.c_double, ctypes.c_double]
+    # Tracing
+    midi_lib.midi_trace_start.restype = ctypes.c_int
+    midi_lib.midi_trace_stop.restype = ctypes.c_int
+    midi_lib.midi_trace_stop.argtypes = [ctypes.c_char_p]
+    # Hot standby
+    midi_lib.midi_standby_open.restype = ctypes.c_int
+    midi_lib.midi_standby_open.argtypes = [ctypes.c_char_p, ctypes.c_int, ctypes.c_int]
+    midi_lib.midi_standby_service.restype = ctypes.c_int
+    midi_lib.midi_lock_memory.restype = ctypes.c_int
     
     print("[Python] Python MIDI Clock Generator")
     print("[Python] ============================")
     print(f"[Python] BPM: {BPM}, PPQN: {PPQN}")
     print()
     
+    if args.dispatch == "direct":
+        queued_only = [name for name, used in (("--tempo-map", args.tempo_map), ("--reclock", args.reclock),
+                                               ("--mtc", args.mtc), ("--clock-output", args.clock_output),
+                                               ("--route", args.route), ("--merge-input", args.merge_input),
+                                               ("--shared-state", args.shared_state)) if used]
+        if queued_only:
+            print(f"[Python] Error: {', '.join(queued_only)} need the queue, not --dispatch direct")
+            return 1
+        midi_lib.midi_set_dispatch(1)
+        # midi_send_clock waits for each clock's deadline itself
+        args.pacing = "native"
+
     # Initialize MIDI
     print("[Python] Initializing ALSA MIDI...")
     if midi_lib.midi_init() < 0:
         print("[Python] Error: Failed to initialize MIDI")
         return 1
 
-    # Set tempo in the C queue to match Python BPM (send tenths as int)
-    if midi_lib.midi_set_tempo(int(round(current_bpm * 10.0))) < 0:
+    if args.flight_recorder and midi_lib.midi_flight_enable(args.flight_recorder.encode(), args.flight_seconds,
+                                                            args.flight_late_ms, args.flight_phase) < 0:
+        print("[Python] Warning: Failed to start the flight recorder")
+    if args.trace and midi_lib.midi_trace_start() < 0:
+        print("[Python] Warning: Tracing is not available in this build")
+        args.trace = None
+
+    # The queue timer can only be chosen before the queue starts
+    if args.queue_timer is not None and midi_lib.midi_set_queue_timer(QUEUE_TIMERS[args.queue_timer], -1, 0, 0) < 0:
+        print(f"[Python] Warning: Failed to select the {args.queue_timer} queue timer")
+    if args.audio_clock is not None:
+        if midi_lib.midi_audio_clock_open(args.audio_clock.encode(), args.audio_rate,
+                                          AUDIO_PERIOD_FRAMES, int(args.audio_lock)) < 0:
+            print(f"[Python] Warning: Failed to open audio clock {args.audio_clock}")
+            args.audio_clock = None
+
+    # Set tempo in the C queue to match Python BPM (in millionths of a BPM)
+    if midi_lib.midi_set_tempo_ubpm(int(round(current_bpm * 1e6))) < 0:
         print(f"[Python] Warning: Failed to set tempo to {current_bpm:.1f} BPM in C library")
     # initialize tick interval from current_bpm
     tick_interval = calculate_tick_interval(current_bpm)
+    if args.pacing == "queue" and midi_lib.midi_occupancy_set_band(int(args.queue_low_ms * 1000),
+                                                                   int(args.queue_high_ms * 1000)) < 0:
+        print("[Python] Warning: Invalid queue band, pacing on the wall clock")
+        args.pacing = "wall"
     
     client_id = midi_lib.midi_get_client_id()
     port_id = midi_lib.midi_get_port_id()
@@ -121,8 +387,94 @@ def main():
     print("[Python] Press Ctrl+C to stop")
     print()
     
-    # Send MIDI Start
-    if midi_lib.midi_send_start() < 0:
+    if args.mtc is not None:
+        if midi_lib.midi_mtc_enable(MTC_RATES[args.mtc], int(args.mtc_port), MTC_LOOKAHEAD_MS) < 0:
+            print("[Python] Warning: Failed to enable MTC")
+        else:
+            print(f"[Python] MTC {args.mtc} fps on port {midi_lib.midi_mtc_get_port_id()}")
+
+    for ratio in args.clock_output:
+        num, _, den = ratio.partition("/")
+        try:
+            num, den = int(num), int(den or 1)
+        except ValueError:
+            print(f"[Python] Warning: Bad clock output ratio {ratio}")
+            continue
+        port = midi_lib.midi_add_clock_output(f"MIDI Clock {num}/{den}".encode(), num, den)
+        if port < 0:
+            print(f"[Python] Warning: Failed to add clock output {ratio}")
+        else:
+            print(f"[Python] Clock output {ratio} on port {port}")
+
+    if args.merge_input or args.route:
+        midi_lib.midi_merge_set_wire_rate(args.wire_rate)
+    for n in range(args.merge_input):
+        port = midi_lib.midi_merge_add_input(f"Merge In {n + 1}".encode())
+        if port < 0:
+            print(f"[Python] Warning: Failed to add merge input {n + 1}")
+        else:
+            print(f"[Python] Merge input {n + 1}: aconnect <source> {client_id}:{port}")
+
+    if args.reclock:
+        result = run_reclock(args)
+        midi_lib.midi_cleanup()
+        print("[Python] Shutdown complete")
+        return result
+
+    if args.tempo_map:
+        result = run_tempo_map(args)
+        if midi_lib.midi_map_get_song() >= 0:
+            midi_lib.midi_send_stop()
+            time.sleep(0.1)
+        midi_lib.midi_cleanup()
+        print("[Python] Shutdown complete")
+        return result
+
+    took_over = False
+    if args.shared_state:
+        role = midi_lib.midi_standby_open(args.shared_state.encode(), 1 if args.standby else -1,
+                                          args.standby_timeout_ms)
+        if role < 0:
+            print(f"[Python] Warning: Failed to share state in {args.shared_state}")
+            args.shared_state = None
+        elif role == STANDBY_WAITING:
+            result = wait_for_takeover()
+            if result is None:
+                midi_lib.midi_cleanup()
+                print("[Python] Shutdown complete")
+                return 0
+            took_over = result == 1
+
+    if args.audio_beat is not None and midi_lib.midi_beat_open(args.audio_beat.encode(), args.audio_rate, 1) < 0:
+        print(f"[Python] Warning: Failed to track the beat of {args.audio_beat}")
+
+    # after a takeover this picks up the tempo inherited from the active instance
+    if midi_lib.midi_source_enable(args.max_slew, args.max_phase_rate) < 0:
+        midi_lib.midi_cleanup()
+        return 1
+    if (args.tempo_median > 1 or args.tempo_hysteresis or args.tempo_quantum or args.tempo_snap) and \
+            midi_lib.midi_condition_set(args.tempo_median, args.tempo_hysteresis,
+                                        args.tempo_quantum, args.tempo_snap) < 0:
+        midi_lib.midi_cleanup()
+        return 1
+    if args.midi_in_fallback:
+        in_port = midi_lib.midi_source_enable_midi_in()
+        if in_port < 0:
+            print("[Python] Warning: Failed to enable the MIDI clock-in fallback")
+        else:
+            print(f"[Python] Fallback clock: aconnect <source> {client_id}:{in_port}")
+
+    for spec in args.route:
+        dest, _, loopback = spec.partition(",")
+        if not loopback or midi_lib.midi_route_add(dest.encode(), loopback.encode(), args.route_share,
+                                                   args.route_interval) < 0:
+            print(f"[Python] Warning: Failed to add route {spec}")
+
+    if args.lock_memory and midi_lib.midi_lock_memory() < 0:
+        print("[Python] Warning: Failed to lock memory")
+
+    # Send MIDI Start (a taken-over clock is already running)
+    if not took_over and midi_lib.midi_send_start() < 0:
         print("[Python] Error: Failed to send MIDI START")
         midi_lib.midi_cleanup()
         return 1
@@ -137,7 +489,7 @@ def main():
             link.enabled = True
             link.start_stop_sync_enabled = True
             link.quantum = 4
-            last_tempo = float(current_bpm)
+            global link_state
             while running:
                 try:
                     await link.sync(1)
@@ -146,13 +498,12 @@ def main():
                     await asyncio.sleep(0.1)
                     continue
 
-                # Always check tempo (Link can advertise tempo even when not playing)
+                # Always report tempo (Link can advertise tempo even when not playing);
+                # the main loop passes it on and the C library decides whether to follow
                 tempo = link.tempo
                 if tempo is not None:
-                    # update only on meaningful change to avoid noisy updates
-                    if abs(float(tempo) - last_tempo) >= 0.01:
-                        change_tempo(float(tempo))
-                        last_tempo = float(tempo)
+                    link_state = (float(tempo), float(link.beat), time.monotonic_ns(),
+                                  int(getattr(link, "num_peers", 1)))
 
                 # small sleep to yield and avoid busy-looping
                 await asyncio.sleep(0.01)
@@ -168,30 +519,59 @@ def main():
     # Get start time for accurate timing
     next_tick_time = time.monotonic()
     tick_count = 0
+    superseded = False
     beat_count = 0
     
     # Main loop - send MIDI clock ticks
     try:
         while running:
+            if args.pacing == "queue":
+                # Wait until the queue is about to run out of clocks
+                wait_us = midi_lib.midi_occupancy_wait_us()
+                if wait_us < 0:
+                    print("[Python] Error: Failed to read the queue position")
+                    break
+                if wait_us > 0:
+                    midi_lib.midi_wait(wait_us)
+                    continue
+
             # Send MIDI Clock
             if midi_lib.midi_send_clock() < 0:
                 print("[Python] Error: Failed to send MIDI CLOCK")
                 break
             
             tick_count += 1
+            if args.shared_state and midi_lib.midi_standby_service() < 0:
+                print("[Python] Error: Lost the shared state to another instance")
+                superseded = True
+                break
+            if tick_count % SOURCE_SERVICE_CLOCKS == 0:
+                follow_tempo_source()
+                if args.route and midi_lib.midi_route_service() < 0:
+                    print("[Python] Warning: Failed to measure route latency")
             
             # Print status every quarter note (24 ticks = 1 beat)
             if tick_count % PPQN == 0:
                 beat_count += 1
                 queue_tick = midi_lib.midi_get_tick_count()
-                print(f"[Python] Beat {beat_count:4d} | MIDI Tick {tick_count:6d} | Queue Tick {queue_tick:6d}")
+                active = midi_lib.midi_source_get_active()
+                print(f"[Python] Beat {beat_count:4d} | MIDI Tick {tick_count:6d} | Queue Tick {queue_tick:6d}"
+                      f" | {current_bpm:6.2f} BPM from {SOURCE_NAMES[active]}")
+                if args.audio_clock is not None and beat_count % DRIFT_REPORT_BEATS == 0:
+                    ppm, offset_ms = ctypes.c_double(), ctypes.c_double()
+                    if midi_lib.midi_audio_clock_drift(ctypes.byref(ppm), ctypes.byref(offset_ms)) == 0:
+                        print(f"[Python] Audio clock drift: {ppm.value:+.2f} ppm, offset {offset_ms.value:+.3f} ms")
             
+            if args.pacing != "wall":
+                continue
+
             # Sleep until next tick using absolute time to prevent drift
             next_tick_time += tick_interval
             sleep_time = next_tick_time - time.monotonic()
             
             if sleep_time > 0:
-                time.sleep(sleep_time)
+                # handles merged input while waiting
+                midi_lib.midi_wait(int(sleep_time * 1e6))
             else:
                 # We're running behind - don't sleep, just continue
                 # Reset next_tick_time to current time to resync
@@ -205,17 +585,44 @@ def main():
     print()
     print("[Python] Stopping MIDI clock...")
     
-    # Send MIDI Stop
-    midi_lib.midi_send_stop()
+    # Send MIDI Stop, unless another instance carries the clock on now
+    if not superseded:
+        midi_lib.midi_send_stop()
     
     # Small delay to let the stop message be delivered
     time.sleep(0.1)
     
+    if args.trace:
+        midi_lib.midi_trace_stop(args.trace.encode())
+    
     # Cleanup ALSA resources
     midi_lib.midi_cleanup()
     
     print(f"[Python] Total ticks sent: {tick_count}")
     print(f"[Python] Total beats: {beat_count}")
+    readings, changes, tempo_events = ctypes.c_ulong(), ctypes.c_ulong(), ctypes.c_ulong()
+    midi_lib.midi_condition_stats(ctypes.byref(readings), ctypes.byref(changes), ctypes.byref(tempo_events))
+    print(f"[Python] Tempo: {readings.value} source readings, {changes.value} conditioned changes,"
+          f" {tempo_events.value} tempo events")
+    if args.pacing == "queue":
+        mean_ms, min_ms, max_ms = ctypes.c_double(), ctypes.c_double(), ctypes.c_double()
+        underruns, above = ctypes.c_ulong(), ctypes.c_ulong()
+        midi_lib.midi_occupancy_stats(ctypes.byref(mean_ms), ctypes.byref(min_ms), ctypes.byref(max_ms),
+                                      ctypes.byref(underruns), ctypes.byref(above))
+        print(f"[Python] Queue depth {mean_ms.value:.1f} ms mean ({min_ms.value:.1f} .. {max_ms.value:.1f} ms),"
+              f" {underruns.value} underruns, {above.value} readings above the band")
+    if args.dispatch == "direct":
+        mean_us, max_us, late = ctypes.c_double(), ctypes.c_double(), ctypes.c_ulong()
+        midi_lib.midi_direct_stats(ctypes.byref(mean_us), ctypes.byref(max_us), ctypes.byref(late))
+        print(f"[Python] Direct clocks late by {mean_us.value:.0f} us mean, {max_us.value:.0f} us max,"
+              f" {late.value} more than a clock late")
+    if args.merge_input:
+        forwarded, deferred, dropped = ctypes.c_ulong(), ctypes.c_ulong(), ctypes.c_ulong()
+        mean_us, max_us = ctypes.c_double(), ctypes.c_double()
+        midi_lib.midi_merge_stats(ctypes.byref(forwarded), ctypes.byref(deferred), ctypes.byref(dropped),
+                                  ctypes.byref(mean_us), ctypes.byref(max_us))
+        print(f"[Python] Merged {forwarded.value} events ({deferred.value} held for clocks,"
+              f" {dropped.value} dropped), added latency {mean_us.value:.0f} us mean, {max_us.value:.0f} us max")
     print("[Python] Shutdown complete")
     
     return 0
@@ -37,7 +37,7 @@ def main():
     if not os.path.exists(lib_path):
         print(f"Error: Library not found at {lib_path}")
         print("Please compile the library first:")
-        print("  gcc -shared -fPIC -o liblinkbridge.so midi_clock_lib.c -lasound")
+        print("  gcc -shared -fPIC -o liblinkbridge.so midi_clock_lib.c -lasound -lpthread -lrt -lm")
         return 1
     
     try:
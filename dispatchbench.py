@@ -0,0 +1,217 @@
+#!/usr/bin/env python3
+
+"""Compare queued and direct clock dispatch: jitter at the receiver and CPU.
+
+Runs the C library at a fixed tempo once per dispatch mode while monitor.c
+receives the clock with kernel arrival timestamps (-k) and logs every event
+(-o). Build liblinkbridge.so and monitor first, then:
+
+    python3 dispatchbench.py --json stock.json
+
+Dispatch modes:
+
+- queue:  clocks scheduled on the ALSA queue, paced by the queue occupancy
+          as clock.py does by default
+- direct: clocks sent unqueued by midi_send_clock on the library's own
+          absolute deadlines
+
+Reported per mode, from the clock intervals the monitor saw:
+
+- jitter: standard deviation of the interval around the nominal period
+- p99 / max: 99th percentile and largest deviation from the period
+- CPU: process CPU time (user + system) per clock; the queue's own work in
+  the kernel timer is not charged to the process
+- send: thread CPU time spent inside midi_send_clock per clock, the cost of
+  building and writing the events without the pacing around it. In direct
+  mode midi_send_clock also waits for the clock's deadline and handles input
+  meanwhile; that part is reported apart as wait and left out of send
+
+The kernel is recorded with the report. Run it on a stock and a PREEMPT_RT
+kernel and put them side by side with --compare OTHER.json. --rt-priority
+runs the pacing thread with SCHED_FIFO, as a real-time setup would.
+"""
+
+import argparse
+import ctypes
+import json
+import os
+import platform
+import signal
+import statistics
+import subprocess
+import sys
+import tempfile
+import time
+
+from stepbench import git_version, read_clocks, start_monitor
+
+PPQN = 24
+MODES = ("queue", "direct")
+WARMUP_CLOCKS = PPQN  # intervals of the first beat are not counted
+
+
+def load_lib():
+    lib_path = os.path.join(os.path.dirname(os.path.abspath(__file__)), 'liblinkbridge.so')
+    lib = ctypes.CDLL(lib_path)
+    for name in ("midi_init", "midi_send_start", "midi_send_clock", "midi_send_stop", "midi_get_client_id",
+                 "midi_get_port_id"):
+        getattr(lib, name).restype = ctypes.c_int
+    lib.midi_cleanup.restype = None
+    lib.midi_set_dispatch.argtypes = [ctypes.c_int]
+    lib.midi_set_tempo_ubpm.argtypes = [ctypes.c_longlong]
+    lib.midi_occupancy_wait_us.restype = ctypes.c_longlong
+    lib.midi_wait.argtypes = [ctypes.c_longlong]
+    lib.midi_direct_wait_cpu_s.restype = ctypes.c_double
+    return lib
+
+
+def kernel():
+    """Kernel release and whether it is PREEMPT_RT."""
+    rt = False
+    try:
+        with open("/sys/kernel/realtime") as f:
+            rt = f.read().strip() == "1"
+    except OSError:
+        pass
+    version = platform.uname().version
+    return {"release": platform.release(), "version": version, "preempt_rt": rt or "PREEMPT_RT" in version}
+
+
+def run(lib, mode, monitor_addr, bpm, seconds):
+    """Clock for `seconds` in one mode; returns (start, end, clocks sent, CPU seconds, send CPU seconds,
+    direct wait CPU seconds or None)."""
+    lib.midi_set_dispatch(1 if mode == "direct" else 0)
+    if lib.midi_init() < 0:
+        raise RuntimeError("cannot initialise MIDI")
+    try:
+        source = f"{lib.midi_get_client_id()}:{lib.midi_get_port_id()}"
+        subprocess.run(["aconnect", source, monitor_addr], check=True)
+        lib.midi_set_tempo_ubpm(int(round(bpm * 1e6)))
+
+        cpu_start = time.process_time()
+        start = time.monotonic_ns()
+        end = start + int(seconds * 1e9)
+        lib.midi_send_start()
+        sent = 0
+        send_ns = 0
+        while time.monotonic_ns() < end:
+            if mode == "queue":
+                wait_us = lib.midi_occupancy_wait_us()
+                if wait_us < 0:
+                    raise RuntimeError("cannot read the queue position")
+                if wait_us > 0:
+                    lib.midi_wait(wait_us)
+                    continue
+            send_start = time.thread_time_ns()
+            err = lib.midi_send_clock()
+            send_ns += time.thread_time_ns() - send_start
+            if err < 0:
+                raise RuntimeError("failed to send clock")
+            sent += 1
+        cpu = time.process_time() - cpu_start
+        wait_cpu = lib.midi_direct_wait_cpu_s() if mode == "direct" else None
+        lib.midi_send_stop()
+        time.sleep(0.2)
+        send_cpu = send_ns / 1e9 - (wait_cpu or 0.0)
+        return start, time.monotonic_ns(), sent, cpu, send_cpu, wait_cpu
+    finally:
+        lib.midi_cleanup()
+
+
+def analyse(clocks, bpm, sent, cpu, send_cpu, wait_cpu):
+    period_us = 60e6 / (bpm * PPQN)
+    intervals = [(b - a) / 1e3 for a, b in zip(clocks, clocks[1:])][WARMUP_CLOCKS:]
+    deviations = sorted(abs(i - period_us) for i in intervals)
+    if not deviations:
+        return {"clocks": len(clocks)}
+    return {
+        "clocks": len(clocks),
+        "period_us": period_us,
+        "mean_interval_us": statistics.mean(intervals),
+        "jitter_us": statistics.pstdev(intervals, period_us),
+        "p99_us": deviations[min(len(deviations) - 1, int(len(deviations) * 0.99))],
+        "max_us": deviations[-1],
+        "cpu_us_per_clock": cpu * 1e6 / sent if sent else None,
+        "send_us_per_clock": send_cpu * 1e6 / sent if sent else None,
+        "wait_us_per_clock": wait_cpu * 1e6 / sent if sent and wait_cpu is not None else None,
+    }
+
+
+def fmt(value, unit=" us"):
+    return f"{value:.1f}{unit}" if value is not None else "-"
+
+
+def compare(report, path):
+    with open(path) as f:
+        old = json.load(f)
+    k = old.get("kernel", {})
+    print(f"\nAgainst {path} ({k.get('release', '?')}{', PREEMPT_RT' if k.get('preempt_rt') else ''}):")
+    for mode, data in report["modes"].items():
+        before = old.get("modes", {}).get(mode)
+        if before is None:
+            continue
+        deltas = [f"{key} {data[key] - before[key]:+.1f}" for key in ("jitter_us", "p99_us", "max_us",
+                                                                       "cpu_us_per_clock", "send_us_per_clock",
+                                                                       "wait_us_per_clock")
+                  if data.get(key) is not None and before.get(key) is not None]
+        print(f"  {mode:6s} " + " | ".join(deltas))
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Queued against direct clock dispatch")
+    parser.add_argument("--modes", default=",".join(MODES), help="comma separated, of: " + ", ".join(MODES))
+    parser.add_argument("--bpm", type=float, default=120.0, help="tempo to clock at")
+    parser.add_argument("--seconds", type=float, default=30.0, help="length of each run")
+    parser.add_argument("--rt-priority", type=int, help="run with SCHED_FIFO at this priority")
+    parser.add_argument("--monitor", default=os.path.join(os.path.dirname(os.path.abspath(__file__)), "monitor"),
+                        help="path of the built monitor")
+    parser.add_argument("--json", metavar="PATH", help="write the report as JSON")
+    parser.add_argument("--compare", metavar="PATH", help="print differences to an earlier JSON report")
+    args = parser.parse_args()
+    modes = args.modes.split(",")
+    if any(m not in MODES for m in modes):
+        parser.error(f"unknown mode in {args.modes}")
+
+    if args.rt_priority is not None:
+        try:
+            os.sched_setscheduler(0, os.SCHED_FIFO, os.sched_param(args.rt_priority))
+        except OSError as e:
+            print(f"[Python] Warning: Cannot use SCHED_FIFO: {e}")
+
+    lib = load_lib()
+    log_fd, log_path = tempfile.mkstemp(prefix="dispatchbench-", suffix=".log")
+    os.close(log_fd)
+    monitor, monitor_addr = start_monitor(args.monitor, log_path)
+    runs = {}
+    try:
+        for mode in modes:
+            print(f"[Python] Mode {mode}")
+            runs[mode] = run(lib, mode, monitor_addr, args.bpm, args.seconds)
+    finally:
+        monitor.send_signal(signal.SIGINT)
+        monitor.wait()
+
+    report = {"version": git_version(), "kernel": kernel(), "settings": vars(args), "modes": {}}
+    k = report["kernel"]
+    print(f"\nKernel {k['release']}{' (PREEMPT_RT)' if k['preempt_rt'] else ''}, {args.bpm:.1f} BPM")
+    for mode, (start, end, sent, cpu, send_cpu, wait_cpu) in runs.items():
+        result = analyse(read_clocks(log_path, start, end), args.bpm, sent, cpu, send_cpu, wait_cpu)
+        report["modes"][mode] = result
+        print(f"  {mode:6s} {result['clocks']:6d} clocks | jitter {fmt(result.get('jitter_us'))}"
+              f" | p99 {fmt(result.get('p99_us'))} | max {fmt(result.get('max_us'))}"
+              f" | CPU {fmt(result.get('cpu_us_per_clock'))} per clock"
+              f" (send {fmt(result.get('send_us_per_clock'))}"
+              + (f", wait {fmt(result['wait_us_per_clock'])}" if result.get('wait_us_per_clock') is not None
+                 else "") + ")")
+    os.unlink(log_path)
+
+    if args.json:
+        with open(args.json, "w") as f:
+            json.dump(report, f, indent=2)
+    if args.compare:
+        compare(report, args.compare)
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,120 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <execinfo.h>
+
+/*
+ * Allocation guard for the bridge's clock path.
+ *
+ * Preloaded into a process that uses liblinkbridge.so, it defines the
+ * library's real-time section hooks and interposes the allocator. Any
+ * allocation or free made by a thread inside a section (a midi_send_clock,
+ * midi_wait, midi_source_service, ... call, or the whole run of the audio
+ * clock and beat tracker threads) is reported with a backtrace. What the
+ * caller does between library calls is not watched.
+ * By default the process is aborted on the first one; with
+ * LINKBRIDGE_GUARD=report they are counted. The number of sections and of
+ * allocations in them is printed at exit.
+ *
+ *   gcc -O2 -fPIC -shared -o malloc_guard.so malloc_guard.c
+ *   LD_PRELOAD=./malloc_guard.so python3 clock.py
+ */
+
+#define MAX_REPORTS 16  // backtraces printed in report mode
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+extern void __libc_free(void *ptr);
+
+static __thread int depth __attribute__((tls_model("initial-exec")));
+static __thread int reporting __attribute__((tls_model("initial-exec")));
+static int report_only;
+static unsigned long sections, violations;
+
+void linkbridge_rt_enter(void) {
+    if (depth++ == 0) __atomic_fetch_add(&sections, 1, __ATOMIC_RELAXED);
+}
+
+void linkbridge_rt_leave(void) {
+    depth--;
+}
+
+static void say(const char *msg) {
+    ssize_t ignored = write(STDERR_FILENO, msg, strlen(msg));
+    (void)ignored;
+}
+
+static void check(const char *what, size_t size) {
+    if (depth <= 0 || reporting) return;
+    unsigned long n = __atomic_add_fetch(&violations, 1, __ATOMIC_RELAXED);
+    if (report_only && n > MAX_REPORTS) return;
+
+    /* backtrace() was primed at load, so it does not allocate in here */
+    reporting = 1;
+    char msg[128];
+    void *frames[32];
+    snprintf(msg, sizeof(msg), "malloc_guard: %s(%zu) in a real-time section\n", what, size);
+    say(msg);
+    backtrace_symbols_fd(frames, backtrace(frames, 32), STDERR_FILENO);
+    reporting = 0;
+    if (!report_only) abort();
+}
+
+void *malloc(size_t size) {
+    check("malloc", size);
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size) {
+    check("calloc", n * size);
+    return __libc_calloc(n, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+    check("realloc", size);
+    return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr) {
+    if (ptr) check("free", 0);
+    __libc_free(ptr);
+}
+
+int posix_memalign(void **out, size_t alignment, size_t size) {
+    check("posix_memalign", size);
+    void *p = __libc_memalign(alignment, size);
+    if (p == NULL) return ENOMEM;
+    *out = p;
+    return 0;
+}
+
+void *aligned_alloc(size_t alignment, size_t size) {
+    check("aligned_alloc", size);
+    return __libc_memalign(alignment, size);
+}
+
+void *memalign(size_t alignment, size_t size) {
+    check("memalign", size);
+    return __libc_memalign(alignment, size);
+}
+
+__attribute__((constructor)) static void guard_init(void) {
+    const char *mode = getenv("LINKBRIDGE_GUARD");
+    report_only = mode != NULL && !strcmp(mode, "report");
+    void *frame;
+    backtrace(&frame, 1);
+}
+
+// Summary, from processes that used the library (not from aconnect & co.)
+__attribute__((destructor)) static void guard_fini(void) {
+    if (__atomic_load_n(&sections, __ATOMIC_RELAXED) == 0) return;
+    char msg[128];
+    snprintf(msg, sizeof(msg), "malloc_guard: %lu real-time sections, %lu allocations in them\n",
+             __atomic_load_n(&sections, __ATOMIC_RELAXED), __atomic_load_n(&violations, __ATOMIC_RELAXED));
+    say(msg);
+}
@@ -0,0 +1,176 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <alsa/asoundlib.h>
+
+/*
+ * Stress benchmark for the bridge's MIDI merge.
+ *
+ * Sends a flood of notes into a merge input of the bridge and listens to its
+ * clock output, first without load and then with it. Reports the clock
+ * interval jitter in both phases and the latency the merge adds to notes.
+ *
+ *   merge_bench <merge input client:port> <clock output client:port> [notes/s] [seconds]
+ */
+
+#define NOTE_IDS (128 * 127)  // note number and velocity 1..127 carry an id
+#define MAX_FDS 4
+
+static volatile int running = 1;
+
+static void signal_handler(int sig) {
+    (void)sig;
+    running = 0;
+}
+
+static long long monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+struct stats {
+    unsigned long n;
+    double sum, sum_sq, min, max;
+};
+
+static void stats_add(struct stats *s, double x) {
+    if (s->n == 0 || x < s->min) s->min = x;
+    if (s->n == 0 || x > s->max) s->max = x;
+    s->n++;
+    s->sum += x;
+    s->sum_sq += x * x;
+}
+
+static double stats_mean(const struct stats *s) {
+    return s->n ? s->sum / s->n : 0.0;
+}
+
+static double stats_std(const struct stats *s) {
+    if (s->n < 2) return 0.0;
+    double mean = stats_mean(s);
+    double var = s->sum_sq / s->n - mean * mean;
+    return var > 0.0 ? sqrt(var) : 0.0;
+}
+
+static void print_clock(const char *phase, const struct stats *s) {
+    printf("%-10s %6lu clocks | interval %8.1f us | jitter (std) %7.1f us | range %8.1f .. %8.1f us\n",
+           phase, s->n, stats_mean(s), stats_std(s), s->min, s->max);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 3) {
+        fprintf(stderr, "Usage: %s <merge input client:port> <clock output client:port> [notes/s] [seconds]\n",
+                argv[0]);
+        return 1;
+    }
+    double rate = argc > 3 ? atof(argv[3]) : 1000.0;
+    double seconds = argc > 4 ? atof(argv[4]) : 20.0;
+    if (rate <= 0.0 || seconds <= 0.0) {
+        fprintf(stderr, "Error: notes/s and seconds must be positive\n");
+        return 1;
+    }
+
+    snd_seq_t *seq;
+    int err = snd_seq_open(&seq, "default", SND_SEQ_OPEN_DUPLEX, SND_SEQ_NONBLOCK);
+    if (err < 0) {
+        fprintf(stderr, "Error opening ALSA sequencer: %s\n", snd_strerror(err));
+        return 1;
+    }
+    snd_seq_set_client_name(seq, "Merge Bench");
+    int out_port = snd_seq_create_simple_port(seq, "Notes Out", SND_SEQ_PORT_CAP_READ | SND_SEQ_PORT_CAP_SUBS_READ,
+                                              SND_SEQ_PORT_TYPE_MIDI_GENERIC | SND_SEQ_PORT_TYPE_APPLICATION);
+    int in_port = snd_seq_create_simple_port(seq, "Clock In", SND_SEQ_PORT_CAP_WRITE | SND_SEQ_PORT_CAP_SUBS_WRITE,
+                                             SND_SEQ_PORT_TYPE_MIDI_GENERIC | SND_SEQ_PORT_TYPE_APPLICATION);
+    snd_seq_addr_t merge_in, clock_out;
+    if (out_port < 0 || in_port < 0 ||
+        snd_seq_parse_address(seq, &merge_in, argv[1]) < 0 ||
+        snd_seq_parse_address(seq, &clock_out, argv[2]) < 0 ||
+        snd_seq_connect_to(seq, out_port, merge_in.client, merge_in.port) < 0 ||
+        snd_seq_connect_from(seq, in_port, clock_out.client, clock_out.port) < 0) {
+        fprintf(stderr, "Error connecting to %s and %s\n", argv[1], argv[2]);
+        snd_seq_close(seq);
+        return 1;
+    }
+
+    signal(SIGINT, signal_handler);
+    signal(SIGTERM, signal_handler);
+
+    long long *sent_ns = calloc(NOTE_IDS, sizeof(long long));
+    if (sent_ns == NULL) {
+        snd_seq_close(seq);
+        return 1;
+    }
+    struct stats idle = { 0 }, loaded = { 0 }, latency = { 0 };
+    struct pollfd fds[MAX_FDS];
+    int nfds = snd_seq_poll_descriptors(seq, fds, MAX_FDS, POLLIN);
+
+    long long start = monotonic_ns();
+    long long load_from = start + (long long)(seconds * 0.5e9);
+    long long end = start + (long long)(seconds * 1e9);
+    long long interval = (long long)(1e9 / rate);
+    long long next_send = load_from;
+    long long last_clock = 0;
+    unsigned int id = 0;
+    unsigned long lost = 0;
+
+    printf("Idle for %.1f s, then %.0f notes/s for %.1f s\n", seconds / 2, rate, seconds / 2);
+    while (running) {
+        long long now = monotonic_ns();
+        if (now >= end) break;
+
+        /* keep to the note schedule; a late loop sends what it owes */
+        while (now >= next_send) {
+            snd_seq_event_t ev;
+            snd_seq_ev_clear(&ev);
+            snd_seq_ev_set_source(&ev, out_port);
+            snd_seq_ev_set_subs(&ev);
+            snd_seq_ev_set_direct(&ev);
+            unsigned int note_id = id++ % NOTE_IDS;
+            snd_seq_ev_set_noteon(&ev, 0, note_id & 0x7f, 1 + (note_id >> 7));
+            sent_ns[note_id] = monotonic_ns();
+            snd_seq_event_output(seq, &ev);
+            snd_seq_ev_set_noteoff(&ev, 0, note_id & 0x7f, 0);
+            snd_seq_event_output(seq, &ev);
+            next_send += interval;
+        }
+        snd_seq_drain_output(seq);
+
+        long long wait = (now < load_from ? load_from : next_send) - now;
+        if (end - now < wait) wait = end - now;
+        struct timespec ts = { .tv_sec = wait / 1000000000LL, .tv_nsec = wait % 1000000000LL };
+        ppoll(fds, nfds, &ts, NULL);
+
+        snd_seq_event_t *ev;
+        while (snd_seq_event_input(seq, &ev) >= 0) {
+            long long t = monotonic_ns();
+            if (ev->type == SND_SEQ_EVENT_CLOCK) {
+                if (last_clock) stats_add(t < load_from ? &idle : &loaded, (t - last_clock) / 1000.0);
+                last_clock = t;
+            } else if (ev->type == SND_SEQ_EVENT_NOTEON && ev->data.note.velocity > 0) {
+                unsigned int note_id = ev->data.note.note | (ev->data.note.velocity - 1) << 7;
+                if (sent_ns[note_id]) {
+                    stats_add(&latency, (t - sent_ns[note_id]) / 1000.0);
+                    sent_ns[note_id] = 0;
+                }
+            }
+        }
+    }
+    for (unsigned int i = 0; i < NOTE_IDS; i++) lost += sent_ns[i] != 0;
+
+    printf("\n");
+    print_clock("idle", &idle);
+    print_clock("loaded", &loaded);
+    printf("notes      %6lu received of %u | added latency mean %8.1f us | std %7.1f us | max %8.1f us\n",
+           latency.n, id, stats_mean(&latency), stats_std(&latency), latency.max);
+    if (lost) printf("notes      %6lu still in flight or dropped at the end\n", lost);
+
+    free(sent_ns);
+    snd_seq_close(seq);
+    return 0;
+}
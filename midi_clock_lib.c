@@ -1,19 +1,87 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
+#include <string.h>
+#include <time.h>
+#include <math.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <poll.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <alsa/asoundlib.h>
 
 #define BPM 120
 #define PPQN 24
-#define QUEUE_TEMPO_PPQ 96
+/* 120 queue ticks per MIDI clock, so the clocks of every derived output
+   (see "Derived clock outputs") fall on whole ticks */
+#define QUEUE_TEMPO_PPQ 2880
+#define CLOCK_STEP (QUEUE_TEMPO_PPQ / PPQN)
+
+/* events carrying this tag were placed at an explicit target time by one of
+   the *_at_* calls; the playhead retraction in midi_set_tempo leaves them be */
+#define TAG_TIMED 1
+/* copies of the clock sent straight to a calibrated route, stamped on the
+   real-time axis ahead by the route's latency */
+#define TAG_ROUTE 2
+/* MTC full-frame SysEx, told apart from probes and merged SysEx */
+#define TAG_MTC 3
+#define MAX_PENDING_TEMPO 256
+/* events our client may have in the kernel at once (its maximum); the handle
+   is nonblocking, so a full pool would fail a drain instead of waiting */
+#define SEQ_OUTPUT_POOL 2000
+
+/* A point on the queue's tempo timeline: from (tick, queue_ns) on, the queue
+   runs at us_per_beat. Points created with by_time were targeted on the real
+   time axis and their tick is derived, the others the other way round.
+   Points with carry are the per-beat steps of an exact tempo. */
+struct tempo_point {
+    double tick;
+    long long queue_ns;
+    unsigned int us_per_beat;
+    int by_time;
+    int carry;
+};
 
 // Global handles
 static snd_seq_t *seq_handle = NULL;
 static int port_id = -1;
 static int queue_id = -1;
+static int queue_running = 0;
 static snd_seq_tick_time_t current_queue_tick = 0;
-/* highest tick we've scheduled so far (used to place tempo changes after all
-    previously queued events) */
+/* highest tick we've scheduled so far */
 static snd_seq_tick_time_t max_scheduled_tick = 0;
+/* tick of the MIDI START the current clock run is aligned to */
+static snd_seq_tick_time_t clock_origin_tick = 0;
+/* once armed, no clock is scheduled at or after stop_tick */
+static int stop_armed = 0;
+static snd_seq_tick_time_t stop_tick = 0;
+
+/* tempo currently in effect and the tempo changes still ahead of the
+   playhead, sorted by position */
+static struct tempo_point tempo_anchor;
+static struct tempo_point pending_tempo[MAX_PENDING_TEMPO];
+static int pending_tempo_count = 0;
+
+/* the main port's clock, built once; per clock only its tick is filled in */
+static snd_seq_event_t clock_event;
+
+// Build the clock event template of a port
+static void clock_event_init(snd_seq_event_t *ev, int port) {
+    snd_seq_ev_clear(ev);
+    snd_seq_ev_set_source(ev, port);
+    snd_seq_ev_set_subs(ev);
+    ev->type = SND_SEQ_EVENT_CLOCK;
+    /* ahead of anything else due at the same time, merged events included */
+    snd_seq_ev_set_priority(ev, 1);
+    snd_seq_ev_schedule_tick(ev, queue_id, 0, 0);
+}
 
 // Initialize ALSA sequencer, create port and queue
 // Returns 0 on success, -1 on error
@@ -22,11 +90,16 @@ int midi_init(void) {
     snd_seq_queue_tempo_t *queue_tempo;
     
     // Open ALSA sequencer
-    err = snd_seq_open(&seq_handle, "default", SND_SEQ_OPEN_OUTPUT, 0);
+    err = snd_seq_open(&seq_handle, "default", SND_SEQ_OPEN_DUPLEX, 0);
     if (err < 0) {
         fprintf(stderr, "Error opening ALSA sequencer: %s\n", snd_strerror(err));
         return -1;
     }
+    /* input is drained between clocks and must never block the caller */
+    snd_seq_nonblock(seq_handle, 1);
+    err = snd_seq_set_client_pool_output(seq_handle, SEQ_OUTPUT_POOL);
+    if (err < 0)
+        fprintf(stderr, "Warning: cannot enlarge the output pool: %s\n", snd_strerror(err));
     
     // Set client name
     snd_seq_set_client_name(seq_handle, "Python MIDI Clock");
@@ -69,140 +142,4844 @@ int midi_init(void) {
            snd_seq_client_id(seq_handle), port_id, queue_id);
     
     current_queue_tick = 0;
+    max_scheduled_tick = 0;
+    clock_origin_tick = 0;
+    stop_armed = 0;
+    queue_running = 0;
+    tempo_anchor.tick = 0.0;
+    tempo_anchor.queue_ns = 0;
+    tempo_anchor.us_per_beat = init_us_per_beat;
+    tempo_anchor.by_time = 0;
+    tempo_anchor.carry = 0;
+    pending_tempo_count = 0;
+    clock_event_init(&clock_event, port_id);
     
     return 0;
 }
 
-// Update the queue tempo using BPM value
+static long long monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static long long thread_cpu_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*
+ * Flight recorder
+ *
+ * Recent timing records (clocks scheduled, ALSA call durations, wakeups,
+ * tempo commands, Link updates, phase errors) go into a fixed ring that is
+ * always overwritten, without locks: a writer claims a slot with one atomic
+ * add and publishes it with its index, so a reader can tell a slot that was
+ * overwritten while it copied it. On an anomaly (a late wakeup, a large
+ * phase error, an ALSA error) or on SIGUSR1, a background thread waits a
+ * moment for the aftermath and writes the last seconds of records to a
+ * file. Nothing but the record itself happens on the caller's thread.
+ */
+#define FLIGHT_RECORDS 65536            /* power of two; minutes of history */
+#define FLIGHT_AFTERMATH_NS 500000000LL /* records after the trigger in a dump */
+#define FLIGHT_MIN_INTERVAL_NS 5000000000LL
+
+enum {
+    FLIGHT_CLOCK = 1,   /* tick: clock scheduled */
+    FLIGHT_ALSA,        /* a: drain duration ns, b: its result */
+    FLIGHT_ERROR,       /* a: ALSA error code */
+    FLIGHT_TEMPO,       /* a: us per beat from tick on */
+    FLIGHT_LINK,        /* a: millionths of a BPM, b: millionths of a beat */
+    FLIGHT_PHASE,       /* a: millionths of a beat the source is ahead */
+    FLIGHT_WAKE,        /* a: ns late, b: timeout asked for in us */
+    FLIGHT_START,
+    FLIGHT_STOP,
+    FLIGHT_TRIGGER,
+};
+
+struct flight_record {
+    unsigned long long index;   /* slot's position in the stream, published last */
+    long long mono_ns;
+    long long a, b;
+    unsigned int tick;
+    unsigned int kind;
+};
+
+static struct {
+    int enabled;
+    char prefix[256];
+    long long window_ns;
+    long long late_ns;          /* wakeup lateness that triggers a dump */
+    double phase_beats;         /* phase error that triggers a dump */
+
+    unsigned long long next;
+    struct flight_record ring[FLIGHT_RECORDS];
+
+    pthread_t thread;
+    sem_t wake;
+    volatile int running;
+    int pending;                /* a dump has been triggered and not written */
+    const char *volatile reason;
+    volatile long long trigger_ns;
+    long long last_dump_ns;
+    unsigned long dumps;
+    struct sigaction old_usr1;
+} flight;
+
+static void flight_record(unsigned int kind, unsigned int tick, long long a, long long b) {
+    if (!flight.enabled) return;
+    unsigned long long i = __atomic_fetch_add(&flight.next, 1, __ATOMIC_RELAXED);
+    struct flight_record *r = &flight.ring[i & (FLIGHT_RECORDS - 1)];
+    __atomic_store_n(&r->index, ~0ULL, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    r->mono_ns = monotonic_ns();
+    r->a = a;
+    r->b = b;
+    r->tick = tick;
+    r->kind = kind;
+    __atomic_store_n(&r->index, i, __ATOMIC_RELEASE);
+}
+
+// Ask for a dump; async-signal-safe, so the SIGUSR1 handler uses it too
+static void flight_trigger(const char *reason) {
+    if (!flight.enabled || __atomic_exchange_n(&flight.pending, 1, __ATOMIC_ACQ_REL)) return;
+    flight_record(FLIGHT_TRIGGER, 0, 0, 0);
+    flight.reason = reason;
+    flight.trigger_ns = monotonic_ns();
+    sem_post(&flight.wake);
+}
+
+static void flight_sigusr1(int sig) {
+    (void)sig;
+    flight_trigger("SIGUSR1");
+}
+
+static const char *const flight_names[] = {
+    "?", "clock", "alsa", "error", "tempo", "link", "phase", "wake", "start", "stop", "trigger"
+};
+
+static void flight_write(FILE *f, const struct flight_record *r, long long t0) {
+    fprintf(f, "%+12.6f %-7s %10u", (r->mono_ns - t0) / 1e9,
+            r->kind <= FLIGHT_TRIGGER ? flight_names[r->kind] : "?", r->tick);
+    switch (r->kind) {
+    case FLIGHT_ALSA:  fprintf(f, "  drain %lld ns, result %lld\n", r->a, r->b); break;
+    case FLIGHT_ERROR: fprintf(f, "  %s\n", snd_strerror((int)r->a)); break;
+    case FLIGHT_TEMPO: fprintf(f, "  %lld us/beat (%.4f BPM)\n", r->a, 60e6 / r->a); break;
+    case FLIGHT_LINK:  fprintf(f, "  %.6f BPM, beat %.6f\n", r->a / 1e6, r->b / 1e6); break;
+    case FLIGHT_PHASE: fprintf(f, "  source ahead by %+.6f beats\n", r->a / 1e6); break;
+    case FLIGHT_WAKE:  fprintf(f, "  %lld us late after a %lld us wait\n", r->a / 1000, r->b); break;
+    default:           fprintf(f, "\n"); break;
+    }
+}
+
+// Write the records of the window around the trigger, oldest first
+static void flight_dump(const char *reason, long long trigger_ns) {
+    char stamp[32], path[sizeof(flight.prefix) + 64];
+    time_t now = time(NULL);
+    struct tm tm;
+    strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", localtime_r(&now, &tm));
+    snprintf(path, sizeof(path), "%s-%s-%s.txt", flight.prefix, stamp, reason);
+    FILE *f = fopen(path, "w");
+    if (f == NULL) {
+        fprintf(stderr, "Error writing flight recorder dump %s: %s\n", path, strerror(errno));
+        return;
+    }
+
+    /* walk back from the newest record to the start of the window */
+    unsigned long long end = __atomic_load_n(&flight.next, __ATOMIC_ACQUIRE);
+    unsigned long long first = end;
+    while (first > 0 && end - first < FLIGHT_RECORDS) {
+        const struct flight_record *r = &flight.ring[(first - 1) & (FLIGHT_RECORDS - 1)];
+        if (__atomic_load_n(&r->index, __ATOMIC_ACQUIRE) != first - 1 ||
+            r->mono_ns < trigger_ns - flight.window_ns) break;
+        first--;
+    }
+
+    fprintf(f, "# flight recorder: %s, %llu records, time relative to the trigger (s)\n",
+            reason, end - first);
+    unsigned long torn = 0;
+    for (unsigned long long i = first; i < end; i++) {
+        const struct flight_record *slot = &flight.ring[i & (FLIGHT_RECORDS - 1)];
+        struct flight_record r = *slot;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (r.index != i || __atomic_load_n(&slot->index, __ATOMIC_RELAXED) != i) {
+            torn++;
+            continue;
+        }
+        flight_write(f, &r, trigger_ns);
+    }
+    if (torn) fprintf(f, "# %lu records overwritten while dumping\n", torn);
+    fclose(f);
+    flight.dumps++;
+    printf("[C] Flight recorder: %s, wrote %s\n", reason, path);
+}
+
+static void *flight_thread(void *arg) {
+    (void)arg;
+    while (flight.running) {
+        if (sem_wait(&flight.wake) < 0) continue;
+        if (!flight.running) break;
+        const char *reason = flight.reason;
+        long long trigger_ns = flight.trigger_ns;
+
+        if (flight.last_dump_ns == 0 || trigger_ns - flight.last_dump_ns >= FLIGHT_MIN_INTERVAL_NS) {
+            /* let the aftermath get recorded too */
+            long long wait = trigger_ns + FLIGHT_AFTERMATH_NS - monotonic_ns();
+            if (wait > 0) {
+                struct timespec ts = { .tv_sec = wait / 1000000000LL, .tv_nsec = wait % 1000000000LL };
+                nanosleep(&ts, NULL);
+            }
+            flight_dump(reason, trigger_ns);
+            flight.last_dump_ns = trigger_ns;
+        }
+        __atomic_store_n(&flight.pending, 0, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+// Keep a flight recorder of the last timing records and dump the last
+// `seconds` of them to <prefix>-<date>-<reason>.txt on SIGUSR1, when a
+// wakeup is more than late_ms late, when a source's phase error exceeds
+// phase_beats (0 for either: no such trigger) or on an ALSA error
 // Returns 0 on success, -1 on error
-// Update the queue tempo using BPM value expressed in tenths (e.g. 1200 = 120.0 BPM)
+int midi_flight_enable(const char *prefix, int seconds, double late_ms, double phase_beats) {
+    if (flight.enabled) {
+        fprintf(stderr, "Error: flight recorder already running\n");
+        return -1;
+    }
+    if (prefix == NULL || strlen(prefix) >= sizeof(flight.prefix) || seconds <= 0 ||
+        late_ms < 0.0 || phase_beats < 0.0) {
+        fprintf(stderr, "Error: invalid flight recorder settings\n");
+        return -1;
+    }
+    strcpy(flight.prefix, prefix);
+    flight.window_ns = seconds * 1000000000LL;
+    flight.late_ns = (long long)(late_ms * 1e6);
+    flight.phase_beats = phase_beats;
+    flight.pending = 0;
+    flight.last_dump_ns = 0;
+    if (sem_init(&flight.wake, 0, 0) < 0) {
+        fprintf(stderr, "Error creating flight recorder semaphore: %s\n", strerror(errno));
+        return -1;
+    }
+    flight.running = 1;
+    if (pthread_create(&flight.thread, NULL, flight_thread, NULL) != 0) {
+        fprintf(stderr, "Error starting flight recorder thread\n");
+        flight.running = 0;
+        sem_destroy(&flight.wake);
+        return -1;
+    }
+    flight.enabled = 1;
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = flight_sigusr1;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGUSR1, &sa, &flight.old_usr1);
+
+    printf("[C] Flight recorder on: %d s per dump to %s-*.txt, kill -USR1 %d to dump\n",
+           seconds, prefix, (int)getpid());
+    return 0;
+}
+
+// Dump the flight recorder now, as with SIGUSR1
+// Returns 0 on success, -1 if the recorder is off
+int midi_flight_dump(void) {
+    if (!flight.enabled) return -1;
+    flight_trigger("request");
+    return 0;
+}
+
+// Stop the flight recorder (a dump in progress is finished first)
+void midi_flight_disable(void) {
+    if (!flight.enabled) return;
+    flight.enabled = 0;
+    sigaction(SIGUSR1, &flight.old_usr1, NULL);
+    flight.running = 0;
+    sem_post(&flight.wake);
+    pthread_join(flight.thread, NULL);
+    sem_destroy(&flight.wake);
+}
+
+/*
+ * Tracing
+ *
+ * Built with -DLINKBRIDGE_TRACE, the engine records spans (clock
+ * scheduling, drains, tempo changes, source service, waits) and instants
+ * (Link updates, start, stop) into one ring per thread, so writers never
+ * share a cache line or take a lock. midi_trace_stop() writes them as
+ * Chrome trace JSON, which chrome://tracing and ui.perfetto.dev open.
+ * Without the define the TRACE_* macros are empty and the API reports -1.
+ */
+#ifdef LINKBRIDGE_TRACE
+#include <sys/syscall.h>
+
+#define TRACE_THREADS 16
+#define TRACE_EVENTS 16384      /* per thread, power of two */
+
+struct trace_event {
+    long long ts_ns;
+    long long dur_ns;           /* spans only */
+    long long arg;
+    const char *name;
+    const char *arg_name;
+    char phase;                 /* 'X' span, 'i' instant */
+};
+
+struct trace_ring {
+    unsigned long long next;    /* events written, published after each one */
+    int tid;
+    char thread_name[16];
+    struct trace_event events[TRACE_EVENTS];
+};
+
+static struct {
+    volatile int enabled;
+    int started;
+    int threads;
+    struct trace_ring rings[TRACE_THREADS];
+} trace;
+
+static __thread struct trace_ring *trace_self;
+static __thread int trace_full;     /* no ring left for this thread */
+
+static struct trace_ring *trace_ring_for_thread(void) {
+    if (trace_self) return trace_self;
+    if (trace_full) return NULL;
+    int i = __atomic_fetch_add(&trace.threads, 1, __ATOMIC_RELAXED);
+    if (i >= TRACE_THREADS) {
+        trace_full = 1;
+        return NULL;
+    }
+    struct trace_ring *r = &trace.rings[i];
+    r->tid = (int)syscall(SYS_gettid);
+    pthread_getname_np(pthread_self(), r->thread_name, sizeof(r->thread_name));
+    trace_self = r;
+    return r;
+}
+
+static void trace_event(const char *name, char phase, long long ts_ns, const char *arg_name, long long arg) {
+    struct trace_ring *r = trace_ring_for_thread();
+    if (r == NULL) return;
+    long long now = monotonic_ns();
+    unsigned long long i = r->next;
+    struct trace_event *e = &r->events[i & (TRACE_EVENTS - 1)];
+    e->ts_ns = phase == 'X' ? ts_ns : now;
+    e->dur_ns = phase == 'X' ? now - ts_ns : 0;
+    e->arg = arg;
+    e->name = name;
+    e->arg_name = arg_name;
+    e->phase = phase;
+    __atomic_store_n(&r->next, i + 1, __ATOMIC_RELEASE);
+}
+
+#define TRACE_BEGIN(var) long long var = trace.enabled ? monotonic_ns() : 0
+#define TRACE_END(var, name, arg_name, arg) \
+    do { if (var && trace.enabled) trace_event(name, 'X', var, arg_name, arg); } while (0)
+#define TRACE_INSTANT(name, arg_name, arg) \
+    do { if (trace.enabled) trace_event(name, 'i', 0, arg_name, arg); } while (0)
+
+// Start recording trace events, dropping any earlier ones
 // Returns 0 on success, -1 on error
-int midi_set_tempo(int bpm10) {
-    if (seq_handle == NULL) {
-        fprintf(stderr, "Error: MIDI not initialized\n");
+int midi_trace_start(void) {
+    if (trace.enabled) return 0;
+    trace.started = 1;
+    for (int i = 0; i < TRACE_THREADS; i++) __atomic_store_n(&trace.rings[i].next, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&trace.enabled, 1, __ATOMIC_RELEASE);
+    printf("[C] Tracing on: %d events per thread\n", TRACE_EVENTS);
+    return 0;
+}
+
+// Stop recording and write the trace to path as Chrome trace JSON
+// Returns the number of events written, or -1 on error
+int midi_trace_stop(const char *path) {
+    if (!trace.started) {
+        fprintf(stderr, "Error: tracing was not started\n");
         return -1;
     }
-    if (bpm10 <= 0) {
-        fprintf(stderr, "Error: invalid BPM (tenths) %d\n", bpm10);
+    __atomic_store_n(&trace.enabled, 0, __ATOMIC_RELEASE);
+    FILE *f = fopen(path, "w");
+    if (f == NULL) {
+        fprintf(stderr, "Error writing trace %s: %s\n", path, strerror(errno));
         return -1;
     }
 
-    /* bpm10 is BPM * 10. To compute microseconds per beat:
-     * us_per_beat = 60000000 / BPM = 60000000 / (bpm10 / 10) = 600000000 / bpm10
-     */
-    unsigned int us_per_beat = 600000000U / (unsigned int)bpm10;
+    int pid = (int)getpid(), written = 0;
+    int threads = trace.threads < TRACE_THREADS ? trace.threads : TRACE_THREADS;
+    fprintf(f, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    fprintf(f, "{\"ph\":\"M\",\"name\":\"process_name\",\"pid\":%d,\"args\":{\"name\":\"linkbridge\"}}", pid);
+    for (int t = 0; t < threads; t++) {
+        const struct trace_ring *r = &trace.rings[t];
+        fprintf(f, ",\n{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+                pid, r->tid, r->thread_name);
+        /* the oldest slot may still be taking a write that began before
+           tracing was switched off */
+        unsigned long long end = __atomic_load_n(&r->next, __ATOMIC_ACQUIRE);
+        unsigned long long first = end > TRACE_EVENTS - 1 ? end - (TRACE_EVENTS - 1) : 0;
+        for (unsigned long long i = first; i < end; i++) {
+            const struct trace_event *e = &r->events[i & (TRACE_EVENTS - 1)];
+            fprintf(f, ",\n{\"ph\":\"%c\",\"name\":\"%s\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f",
+                    e->phase, e->name, pid, r->tid, e->ts_ns / 1e3);
+            if (e->phase == 'X') fprintf(f, ",\"dur\":%.3f", e->dur_ns / 1e3);
+            else fprintf(f, ",\"s\":\"t\"");
+            if (e->arg_name) fprintf(f, ",\"args\":{\"%s\":%lld}", e->arg_name, e->arg);
+            fprintf(f, "}");
+            written++;
+        }
+    }
+    fprintf(f, "\n]}\n");
+    fclose(f);
+    printf("[C] Trace: %d events from %d threads written to %s\n", written, threads, path);
+    return written;
+}
+#else
+#define TRACE_BEGIN(var)
+#define TRACE_END(var, name, arg_name, arg)
+#define TRACE_INSTANT(name, arg_name, arg)
 
-    /*
-     * Instead of applying the tempo immediately (which would change the
-     * tick->time mapping for all remaining queued tick events), enqueue a
-     * queue-tempo event scheduled at a future tick. Events already enqueued
-     * at earlier ticks will keep their original timing.
-     */
-    snd_seq_event_t ev;
-    snd_seq_ev_clear(&ev);
-    snd_seq_ev_set_source(&ev, port_id);
-    snd_seq_ev_set_subs(&ev);
+int midi_trace_start(void) {
+    fprintf(stderr, "Error: built without LINKBRIDGE_TRACE\n");
+    return -1;
+}
 
+int midi_trace_stop(const char *path) {
+    (void)path;
+    return -1;
+}
+#endif
 
-     /* attach the tempo (microseconds per beat) to the event using ALSA
-         helper macro. The macro expects the tempo value (not a pointer). */
-     snd_seq_ev_set_queue_tempo(&ev, queue_id, us_per_beat);
+/*
+ * Static probes
+ *
+ * USDT probes (provider "linkbridge") for perf and bpftrace. An unattached
+ * probe is a single nop; spans are a pair of probes and the tracer takes
+ * the time, so nothing is measured here. See bpftrace/ for scripts. Where
+ * <sys/sdt.h> is missing (or with -DLINKBRIDGE_NO_SDT) they compile away.
+ *
+ *   clock(tick, us_per_beat)           clock scheduled
+ *   drain_start(tick), drain_done(tick, result)
+ *   tempo(tick, us_per_beat)           tempo change placed at tick
+ *   start(tick), stop(tick)            clock run starts / STOP at tick
+ *   wait_start(timeout_us), wait_done(late_ns, timeout_us)
+ *   alsa_error(tick, err)              a sequencer call failed
+ *   underrun(tick, late_ns)            the queue ran out of clocks
+ */
+#if !defined(LINKBRIDGE_NO_SDT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#endif
+#endif
 
-     /* schedule the tempo change at the next tick after the highest tick
-         we've already scheduled. This ensures earlier enqueued events keep
-         their original timing. */
-     snd_seq_tick_time_t target_tick = max_scheduled_tick + 1;
-    snd_seq_ev_schedule_tick(&ev, queue_id, 0, target_tick);
+#ifdef STAP_PROBE2
+#define USDT1(name, a) STAP_PROBE1(linkbridge, name, a)
+#define USDT2(name, a, b) STAP_PROBE2(linkbridge, name, a, b)
+#else
+#define USDT1(name, a) do { } while (0)
+#define USDT2(name, a, b) do { } while (0)
+#endif
 
-    int err = snd_seq_event_output(seq_handle, &ev);
+/*
+ * Allocation guard
+ *
+ * Nothing on the clock path allocates: engine state lives in static storage
+ * sized at build time, and what ALSA needs is set up by the calls that open
+ * things. The public calls a pacing loop makes are marked as real-time
+ * sections, and so is the whole run of the engine's audio reader threads
+ * once their setup is done. malloc_guard.so (see malloc_guard.c) defines
+ * the two hooks and,
+ * preloaded, fails every allocation made inside a section; without it the
+ * hooks are unresolved weak symbols and a section costs a test and a branch.
+ */
+extern void linkbridge_rt_enter(void) __attribute__((weak));
+extern void linkbridge_rt_leave(void) __attribute__((weak));
+
+static inline int rt_section_enter(void) {
+    if (linkbridge_rt_enter) linkbridge_rt_enter();
+    return 0;
+}
+
+static inline void rt_section_leave(int *unused) {
+    (void)unused;
+    if (linkbridge_rt_leave) linkbridge_rt_leave();
+}
+
+/* marks the rest of the enclosing function, up to whichever return leaves it */
+#define RT_SECTION() \
+    int rt_section_ __attribute__((cleanup(rt_section_leave), unused)) = rt_section_enter()
+
+// Lock the process's memory, present and future, so that the clock path does
+// not take page faults either. Needs CAP_IPC_LOCK or a high enough memlock
+// limit. Returns 0 on success, -1 on error
+int midi_lock_memory(void) {
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0) {
+        fprintf(stderr, "Error locking memory: %s\n", strerror(errno));
+        return -1;
+    }
+    printf("[C] Memory locked\n");
+    return 0;
+}
+
+/*
+ * Direct dispatch
+ *
+ * Selected with midi_set_dispatch() before midi_init(), the clock bypasses
+ * the queue: midi_send_clock() waits for the clock's deadline on
+ * CLOCK_MONOTONIC itself (handling input until just before it, then an
+ * absolute clock_nanosleep) and sends the event unqueued with
+ * snd_seq_ev_set_direct. Deadlines advance by the clock period in
+ * picoseconds, so they never drift from the tempo. START, STOP and tempo
+ * changes take effect on the spot; anything that needs the queue's timeline
+ * (timed calls, tempo maps, MTC, derived outputs, routes, merge, reclock,
+ * hot standby) is refused.
+ */
+#define DIRECT_POLL_MARGIN_NS 300000LL  /* input is handled until this close */
+
+static struct {
+    int enabled;
+    int running;                /* between START and STOP */
+    long long period_ps;        /* clock period at the tempo in effect */
+    long long next_ns;          /* deadline of the next clock */
+    long long next_frac_ps;
+    unsigned long clocks, late;
+    double late_sum_ns, late_max_ns;
+    long long wait_cpu_ns;      /* thread CPU spent in direct_wait_until */
+    snd_seq_event_t clock_ev;   /* built at START, sent as is */
+} direct;
+
+static void poll_input(void);
+
+static int direct_refuse(const char *what) {
+    fprintf(stderr, "Error: direct dispatch does not support %s\n", what);
+    return -1;
+}
+
+static void direct_event_init(snd_seq_event_t *ev, int type) {
+    snd_seq_ev_clear(ev);
+    snd_seq_ev_set_source(ev, port_id);
+    snd_seq_ev_set_subs(ev);
+    snd_seq_ev_set_direct(ev);
+    ev->type = type;
+}
+
+// Send an unqueued event to the subscribers now, bypassing the output buffer
+static int direct_output(snd_seq_event_t *ev) {
+    int err = snd_seq_event_output_direct(seq_handle, ev);
     if (err < 0) {
-        fprintf(stderr, "Error enqueuing tempo event: %s\n", snd_strerror(err));
+        USDT2(alsa_error, current_queue_tick, err);
+        flight_record(FLIGHT_ERROR, current_queue_tick, err, 0);
+        flight_trigger("alsa-error");
+    }
+    return err;
+}
+
+static int direct_send(int type) {
+    snd_seq_event_t ev;
+    direct_event_init(&ev, type);
+    return direct_output(&ev);
+}
+
+// Wait for an absolute CLOCK_MONOTONIC deadline, taking input as it comes
+static void direct_wait_until(long long deadline_ns) {
+    struct pollfd fds[4];
+    int nfds = snd_seq_poll_descriptors(seq_handle, fds, 4, POLLIN);
+    for (;;) {
+        poll_input();
+        snd_seq_drain_output(seq_handle);
+        long long left = deadline_ns - monotonic_ns() - DIRECT_POLL_MARGIN_NS;
+        if (left <= 0) break;
+        /* events already read into the input buffer do not wake ppoll */
+        if (snd_seq_event_input_pending(seq_handle, 0) > 0) continue;
+        struct timespec ts = { .tv_sec = left / 1000000000LL, .tv_nsec = left % 1000000000LL };
+        if (ppoll(fds, nfds, &ts, NULL) < 0 && errno != EINTR) break;
+    }
+    struct timespec at = { .tv_sec = deadline_ns / 1000000000LL, .tv_nsec = deadline_ns % 1000000000LL };
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &at, NULL) == EINTR)
+        ;
+}
+
+// Wait for the next clock's deadline and send it
+// Returns 0 on success, -1 on error
+static int direct_clock(void) {
+    if (!direct.running) return 0;
+    long long cpu0 = thread_cpu_ns();
+    direct_wait_until(direct.next_ns);
+    direct.wait_cpu_ns += thread_cpu_ns() - cpu0;
+    int err = direct_output(&direct.clock_ev);
+    long long late = monotonic_ns() - direct.next_ns;
+    flight_record(FLIGHT_CLOCK, current_queue_tick, 0, 0);
+    USDT2(clock, current_queue_tick, tempo_anchor.us_per_beat);
+
+    direct.clocks++;
+    direct.late_sum_ns += late;
+    if (late > direct.late_max_ns) direct.late_max_ns = late;
+    current_queue_tick += CLOCK_STEP;
+    direct.next_frac_ps += direct.period_ps % 1000;
+    direct.next_ns += direct.period_ps / 1000 + direct.next_frac_ps / 1000;
+    direct.next_frac_ps %= 1000;
+    /* a clock more than a period late starts a fresh grid */
+    if (late > direct.period_ps / 1000) {
+        direct.late++;
+        direct.next_ns = monotonic_ns() + direct.period_ps / 1000;
+        direct.next_frac_ps = 0;
+    }
+    return err < 0 ? -1 : 0;
+}
+
+// Beats since the START of the run at CLOCK_MONOTONIC time now_ns
+static double direct_beat(long long now_ns) {
+    double clocks = (current_queue_tick - clock_origin_tick) / (double)CLOCK_STEP;
+    return (clocks - (direct.next_ns - now_ns) * 1000.0 / direct.period_ps) / PPQN;
+}
+
+// Choose how the clock is sent: 0 on the ALSA queue (default), 1 unqueued
+// on deadlines kept by the library. Call before midi_init().
+// Returns 0 on success, -1 on error
+int midi_set_dispatch(int direct_dispatch) {
+    if (seq_handle != NULL) {
+        fprintf(stderr, "Error: dispatch can only be chosen before midi_init\n");
         return -1;
     }
-    snd_seq_drain_output(seq_handle);
+    direct.enabled = direct_dispatch != 0;
+    direct.period_ps = 0;
+    direct.clocks = direct.late = 0;
+    direct.late_sum_ns = direct.late_max_ns = 0.0;
+    direct.wait_cpu_ns = 0;
+    if (direct.enabled) printf("[C] Direct dispatch: clocks are sent unqueued on their deadlines\n");
+    return 0;
+}
 
-        printf("[C] MIDI tempo (queued) set to %.1f BPM ( %u us/beat ) at tick %lu\n",
-            bpm10 / 10.0, us_per_beat, (unsigned long)target_tick);
+// Lateness of directly dispatched clocks against their deadlines (mean and
+// max in us) and the number that were more than a period late
+void midi_direct_stats(double *mean_us, double *max_us, unsigned long *late) {
+    if (mean_us) *mean_us = direct.clocks ? direct.late_sum_ns / direct.clocks / 1e3 : 0.0;
+    if (max_us) *max_us = direct.late_max_ns / 1e3;
+    if (late) *late = direct.late;
+}
+
+// Thread CPU time midi_send_clock has spent waiting for direct clock
+// deadlines, input handling included, in seconds
+double midi_direct_wait_cpu_s(void) {
+    return direct.wait_cpu_ns / 1e9;
+}
+
+// Convert tenths of a BPM to the queue's microseconds per beat
+// Returns 0 on success, -1 on error
+static int bpm10_to_us_per_beat(int bpm10, unsigned int *us_per_beat) {
+    if (bpm10 <= 0) {
+        fprintf(stderr, "Error: invalid BPM (tenths) %d\n", bpm10);
+        return -1;
+    }
+    /* bpm10 is BPM * 10. To compute microseconds per beat:
+     * us_per_beat = 60000000 / BPM = 60000000 / (bpm10 / 10) = 600000000 / bpm10,
+     * rounded to the nearest microsecond rather than always down
+     */
+    *us_per_beat = (600000000U + (unsigned int)bpm10 / 2) / (unsigned int)bpm10;
     return 0;
 }
 
-// Send MIDI Start message
+// Read the queue playhead through a sequencer handle: the tick it is
+// playing and its real time in ns, together with the CLOCK_MONOTONIC time
+// the reading was taken at
 // Returns 0 on success, -1 on error
-int midi_send_start(void) {
-    if (seq_handle == NULL) {
-        fprintf(stderr, "Error: MIDI not initialized\n");
+static int queue_snapshot_on(snd_seq_t *handle, snd_seq_tick_time_t *tick, long long *queue_ns,
+                             long long *mono_ns) {
+    snd_seq_queue_status_t *status;
+    snd_seq_queue_status_alloca(&status);
+    int err = snd_seq_get_queue_status(handle, queue_id, status);
+    if (err < 0) {
+        fprintf(stderr, "Error reading queue status: %s\n", snd_strerror(err));
         return -1;
     }
-    
-    snd_seq_event_t ev;
-    snd_seq_ev_clear(&ev);
-    snd_seq_ev_set_source(&ev, port_id);
-    snd_seq_ev_set_subs(&ev);
-    ev.type = SND_SEQ_EVENT_START;
-    
-    snd_seq_ev_schedule_tick(&ev, queue_id, 0, 0);
-    snd_seq_event_output(seq_handle, &ev);
-    snd_seq_drain_output(seq_handle);
-    
-    // Start the queue
+    if (mono_ns) *mono_ns = monotonic_ns();
+    if (tick) *tick = snd_seq_queue_status_get_tick_time(status);
+    if (queue_ns) {
+        const snd_seq_real_time_t *rt = snd_seq_queue_status_get_real_time(status);
+        *queue_ns = (long long)rt->tv_sec * 1000000000LL + rt->tv_nsec;
+    }
+    return 0;
+}
+
+// Read the queue playhead through the engine's own handle
+static int queue_snapshot(snd_seq_tick_time_t *tick, long long *queue_ns, long long *mono_ns) {
+    return queue_snapshot_on(seq_handle, tick, queue_ns, mono_ns);
+}
+
+// Queue real time of a time in ns, held at the queue's start
+static snd_seq_real_time_t queue_real_time(long long ns) {
+    if (ns < 0) ns = 0;
+    snd_seq_real_time_t rt = { .tv_sec = (unsigned int)(ns / 1000000000LL),
+                               .tv_nsec = (unsigned int)(ns % 1000000000LL) };
+    return rt;
+}
+
+// The kernel runs the queue at a whole number of ns per tick, rounded down
+static double ns_per_tick(unsigned int us_per_beat) {
+    return (double)((unsigned long long)us_per_beat * 1000 / QUEUE_TEMPO_PPQ);
+}
+
+// Fill in the coordinate of next that follows from the tempo set at prev
+static void resolve_tempo_point(const struct tempo_point *prev, struct tempo_point *next) {
+    if (next->by_time)
+        next->tick = prev->tick + (next->queue_ns - prev->queue_ns) / ns_per_tick(prev->us_per_beat);
+    else
+        next->queue_ns = prev->queue_ns +
+                         (long long)((next->tick - prev->tick) * ns_per_tick(prev->us_per_beat));
+}
+
+// Recompute derived coordinates of every pending tempo change
+static void resolve_pending_tempo(void) {
+    const struct tempo_point *prev = &tempo_anchor;
+    for (int i = 0; i < pending_tempo_count; i++) {
+        resolve_tempo_point(prev, &pending_tempo[i]);
+        prev = &pending_tempo[i];
+    }
+}
+
+// Promote pending tempo changes the queue has already reached to the anchor
+static void settle_pending_tempo(long long now_queue_ns) {
+    int done = 0;
+    while (done < pending_tempo_count && pending_tempo[done].queue_ns <= now_queue_ns)
+        tempo_anchor = pending_tempo[done++];
+    if (done == 0) return;
+    pending_tempo_count -= done;
+    memmove(pending_tempo, pending_tempo + done, pending_tempo_count * sizeof(pending_tempo[0]));
+}
+
+// Queue position (fractional tick) at the given queue real time
+static double tick_at_queue_ns(long long queue_ns) {
+    const struct tempo_point *p = &tempo_anchor;
+    for (int i = 0; i < pending_tempo_count && pending_tempo[i].queue_ns <= queue_ns; i++)
+        p = &pending_tempo[i];
+    return p->tick + (queue_ns - p->queue_ns) / ns_per_tick(p->us_per_beat);
+}
+
+// Queue real time at which the queue reaches a (fractional) tick
+static long long queue_ns_at_tick(double tick) {
+    const struct tempo_point *p = &tempo_anchor;
+    for (int i = 0; i < pending_tempo_count && pending_tempo[i].tick <= tick; i++)
+        p = &pending_tempo[i];
+    return p->queue_ns + (long long)((tick - p->tick) * ns_per_tick(p->us_per_beat));
+}
+
+// Move the anchor to now, running at a new tempo
+static void anchor_tempo_now(long long now_queue_ns, unsigned int us_per_beat) {
+    settle_pending_tempo(now_queue_ns);
+    tempo_anchor.tick = tick_at_queue_ns(now_queue_ns);
+    tempo_anchor.queue_ns = now_queue_ns;
+    tempo_anchor.us_per_beat = us_per_beat;
+    tempo_anchor.by_time = 1;
+    tempo_anchor.carry = 0;
+    resolve_pending_tempo();
+}
+
+// Record a future tempo change, keeping the pending list in timeline order
+// Returns 0 on success, -1 if the list is full
+static int add_pending_tempo(const struct tempo_point *point) {
+    if (pending_tempo_count == MAX_PENDING_TEMPO) {
+        fprintf(stderr, "Error: too many pending tempo changes (max %d)\n", MAX_PENDING_TEMPO);
+        return -1;
+    }
+    int i = pending_tempo_count;
+    while (i > 0 && (point->by_time ? pending_tempo[i - 1].queue_ns > point->queue_ns
+                                    : pending_tempo[i - 1].tick > point->tick)) {
+        pending_tempo[i] = pending_tempo[i - 1];
+        i--;
+    }
+    pending_tempo[i] = *point;
+    pending_tempo_count++;
+    resolve_pending_tempo();
+    return 0;
+}
+
+// Forget the exact tempo's per-beat steps at or after a tick
+static void drop_carry_tempo(double from_tick) {
+    int n = 0;
+    for (int i = 0; i < pending_tempo_count; i++)
+        if (!pending_tempo[i].carry || pending_tempo[i].tick < from_tick) pending_tempo[n++] = pending_tempo[i];
+    pending_tempo_count = n;
+    resolve_pending_tempo();
+}
+
+// Start the queue if it is not running yet; the timeline starts at tick 0
+static void ensure_queue_running(void) {
+    if (queue_running) return;
     snd_seq_start_queue(seq_handle, queue_id, NULL);
     snd_seq_drain_output(seq_handle);
-    
-    printf("[C] MIDI START sent, queue started\n");
-    
-    if (0 > max_scheduled_tick) max_scheduled_tick = 0;
+    queue_running = 1;
+    printf("[C] Queue started\n");
+}
 
+// Map a CLOCK_MONOTONIC timestamp to the queue's real time axis.
+// Starts the queue if needed so that the mapping is meaningful.
+// Returns 0 on success, -1 on error
+static int monotonic_to_queue_ns(long long mono_target_ns, long long *queue_ns) {
+    long long now_queue_ns, now_mono_ns;
+    ensure_queue_running();
+    if (queue_snapshot(NULL, &now_queue_ns, &now_mono_ns) < 0) return -1;
+    settle_pending_tempo(now_queue_ns);
+    *queue_ns = now_queue_ns + (mono_target_ns - now_mono_ns);
+    if (*queue_ns < now_queue_ns) {
+        printf("[C] Warning: target time is %.3f ms in the past, applying now\n",
+               (now_queue_ns - *queue_ns) / 1e6);
+    }
     return 0;
 }
 
-// Send MIDI Clock message
-// Returns 0 on success, -1 on error
-int midi_send_clock(void) {
-    if (seq_handle == NULL) {
-        fprintf(stderr, "Error: MIDI not initialized\n");
-        return -1;
+// Enqueue a port's clock template at the given queue tick (not drained)
+static int schedule_clock_from(snd_seq_event_t *clock_ev, snd_seq_tick_time_t tick) {
+    clock_ev->time.tick = tick;
+    return snd_seq_event_output(seq_handle, clock_ev);
+}
+
+static int routes_active(void);
+static int routes_clock(snd_seq_tick_time_t tick);
+static int routes_retract(snd_seq_tick_time_t from);
+static int routes_transport(const snd_seq_event_t *ev, snd_seq_tick_time_t tick, const long long *queue_ns);
+static void routes_refill(snd_seq_tick_time_t from);
+static int route_input(const snd_seq_event_t *ev);
+
+// Enqueue one MIDI clock event on the main port and its calibrated routes
+// (not drained)
+static int schedule_clock(snd_seq_tick_time_t tick) {
+    int err = schedule_clock_from(&clock_event, tick);
+    return err < 0 ? err : routes_clock(tick);
+}
+
+static int outputs_transport(snd_seq_event_t *ev);
+
+// Enqueue a START/STOP event on every clock port at a queue tick, or at a
+// queue real time when queue_ns is given (not drained)
+static int schedule_transport(int type, snd_seq_tick_time_t tick, const long long *queue_ns) {
+    snd_seq_event_t ev;
+    snd_seq_ev_clear(&ev);
+    snd_seq_ev_set_source(&ev, port_id);
+    snd_seq_ev_set_subs(&ev);
+    ev.type = type;
+
+    if (queue_ns) {
+        snd_seq_real_time_t rt = queue_real_time(*queue_ns);
+        snd_seq_ev_set_tag(&ev, TAG_TIMED);
+        snd_seq_ev_schedule_real(&ev, queue_id, 0, &rt);
+    } else {
+        snd_seq_ev_schedule_tick(&ev, queue_id, 0, tick);
     }
-    
+    int err = snd_seq_event_output(seq_handle, &ev);
+    if (err >= 0) err = routes_transport(&ev, tick, queue_ns);
+    return err < 0 ? err : outputs_transport(&ev);
+}
+
+// Enqueue a song position pointer (song_tick in queue ticks from the top of
+// the song) on every clock port at a queue tick, ahead of a CONTINUE (not
+// drained)
+static int schedule_songpos(uint32_t song_tick, snd_seq_tick_time_t tick) {
     snd_seq_event_t ev;
     snd_seq_ev_clear(&ev);
     snd_seq_ev_set_source(&ev, port_id);
     snd_seq_ev_set_subs(&ev);
-    ev.type = SND_SEQ_EVENT_CLOCK;
-    
-    snd_seq_ev_schedule_tick(&ev, queue_id, 0, current_queue_tick);
-    snd_seq_event_output(seq_handle, &ev);
-    snd_seq_drain_output(seq_handle);
-    
-    // Advance queue tick by ratio (96 PPQ / 24 PPQN = 4 ticks per MIDI clock)
-    current_queue_tick += (QUEUE_TEMPO_PPQ / PPQN);
-    if (current_queue_tick > max_scheduled_tick) max_scheduled_tick = current_queue_tick;
-    
+    ev.type = SND_SEQ_EVENT_SONGPOS;
+    unsigned int sixteenths = song_tick / (QUEUE_TEMPO_PPQ / 4);
+    ev.data.control.value = sixteenths > 0x3fff ? 0x3fff : (int)sixteenths;
+    snd_seq_ev_schedule_tick(&ev, queue_id, 0, tick);
+    int err = snd_seq_event_output(seq_handle, &ev);
+    if (err >= 0) err = routes_transport(&ev, tick, NULL);
+    return err < 0 ? err : outputs_transport(&ev);
+}
+
+// Remove every undelivered event of the given type and tag scheduled at or
+// after from_tick on our queue, both from the local output buffer and from
+// the kernel scheduler
+static int retract_events(int type, int tag, snd_seq_tick_time_t from_tick) {
+    snd_seq_remove_events_t *rm;
+    snd_seq_timestamp_t ts;
+
+    snd_seq_remove_events_alloca(&rm);
+    ts.tick = from_tick;
+    snd_seq_remove_events_set_condition(rm, SND_SEQ_REMOVE_OUTPUT |
+                                            SND_SEQ_REMOVE_TIME_AFTER |
+                                            SND_SEQ_REMOVE_TIME_TICK |
+                                            SND_SEQ_REMOVE_EVENT_TYPE |
+                                            SND_SEQ_REMOVE_TAG_MATCH);
+    snd_seq_remove_events_set_queue(rm, queue_id);
+    snd_seq_remove_events_set_time(rm, &ts);
+    snd_seq_remove_events_set_event_type(rm, type);
+    snd_seq_remove_events_set_tag(rm, tag);
+    return snd_seq_remove_events(seq_handle, rm);
+}
+
+// Remove every undelivered event of the given type and tag stamped on the
+// queue's real-time axis at or after queue_ns
+static int retract_events_after_ns(int type, int tag, long long queue_ns) {
+    snd_seq_remove_events_t *rm;
+    snd_seq_timestamp_t ts;
+
+    snd_seq_remove_events_alloca(&rm);
+    ts.time = queue_real_time(queue_ns);
+    snd_seq_remove_events_set_condition(rm, SND_SEQ_REMOVE_OUTPUT |
+                                            SND_SEQ_REMOVE_TIME_AFTER |
+                                            SND_SEQ_REMOVE_EVENT_TYPE |
+                                            SND_SEQ_REMOVE_TAG_MATCH);
+    snd_seq_remove_events_set_queue(rm, queue_id);
+    snd_seq_remove_events_set_time(rm, &ts);
+    snd_seq_remove_events_set_event_type(rm, type);
+    snd_seq_remove_events_set_tag(rm, tag);
+    return snd_seq_remove_events(seq_handle, rm);
+}
+
+/*
+ * Derived clock outputs
+ *
+ * Each extra output port sends clock at a rational multiple num/den of the
+ * main 24 PPQN clock. Output clock k sits on queue tick
+ * origin + k * CLOCK_STEP * den / num, computed in integers from k, so the
+ * outputs never drift from the main clock or from each other. Only ratios
+ * whose reduced numerator divides CLOCK_STEP are accepted, which makes every
+ * period a whole number of queue ticks: each derived clock is exactly on
+ * time, with no rounding at all.
+ */
+#define MAX_CLOCK_OUTPUTS 8
+#define MAX_OUTPUT_PPQN 96
+
+static struct clock_output {
+    int port;
+    snd_seq_event_t clock_ev;
+    unsigned int num, den;      /* rate = PPQN * num / den */
+    unsigned long long next;    /* index of the next clock to schedule */
+} clock_outputs[MAX_CLOCK_OUTPUTS];
+static int clock_output_count = 0;
+
+static snd_seq_tick_time_t output_clock_tick(const struct clock_output *out, unsigned long long k) {
+    return clock_origin_tick + (snd_seq_tick_time_t)(k * CLOCK_STEP * out->den / out->num);
+}
+
+// Schedule every derived clock before tick `upto` (the main clock's next
+// tick), in the same pass that scheduled the main clock (not drained)
+static void outputs_fill(snd_seq_tick_time_t upto) {
+    for (int i = 0; i < clock_output_count; i++) {
+        struct clock_output *out = &clock_outputs[i];
+        for (snd_seq_tick_time_t tick = output_clock_tick(out, out->next); tick < upto;
+             tick = output_clock_tick(out, out->next)) {
+            if (schedule_clock_from(&out->clock_ev, tick) < 0) {
+                fprintf(stderr, "Error enqueuing clock on port %d\n", out->port);
+                break;
+            }
+            out->next++;
+        }
+    }
+}
+
+// Rewind the outputs so that clocks from `from` on get scheduled again
+static void outputs_rewind(snd_seq_tick_time_t from) {
+    for (int i = 0; i < clock_output_count; i++) {
+        struct clock_output *out = &clock_outputs[i];
+        unsigned long long k = 0;
+        if (from > clock_origin_tick) {
+            unsigned long long span = (unsigned long long)(from - clock_origin_tick) * out->num;
+            unsigned long long period = (unsigned long long)CLOCK_STEP * out->den;
+            k = (span + period - 1) / period;
+        }
+        if (k < out->next) out->next = k;
+    }
+}
+
+// Retract undelivered clocks on all ports from a tick on
+static int retract_clocks(snd_seq_tick_time_t from) {
+    int err = retract_events(SND_SEQ_EVENT_CLOCK, 0, from);
+    if (err >= 0) err = routes_retract(from);
+    if (err >= 0) outputs_rewind(from);
+    return err;
+}
+
+static unsigned int gcd(unsigned int a, unsigned int b) {
+    while (b) {
+        unsigned int t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+// Copy a START/STOP event to every clock output (not drained)
+static int outputs_transport(snd_seq_event_t *ev) {
+    for (int i = 0; i < clock_output_count; i++) {
+        snd_seq_ev_set_source(ev, clock_outputs[i].port);
+        int err = snd_seq_event_output(seq_handle, ev);
+        if (err < 0) return err;
+    }
     return 0;
 }
 
-// Send MIDI Stop message
-// Returns 0 on success, -1 on error
-int midi_send_stop(void) {
+// Add an output port sending clock at num/den times the main clock rate
+// (2/1 = 48 PPQN, 1/2 = half time, 4/1 = 96 PPQN, 3/2 ...). It shares the
+// main clock's START/STOP and phase.
+// Returns the new port id on success, -1 on error
+int midi_add_clock_output(const char *name, int num, int den) {
     if (seq_handle == NULL) {
         fprintf(stderr, "Error: MIDI not initialized\n");
         return -1;
     }
-    
-    snd_seq_event_t ev;
-    snd_seq_ev_clear(&ev);
+    if (direct.enabled) return direct_refuse("derived clock outputs");
+    if (num <= 0 || den <= 0 || num > MAX_OUTPUT_PPQN || den > MAX_OUTPUT_PPQN ||
+        num * PPQN > MAX_OUTPUT_PPQN * den) {
+        fprintf(stderr, "Error: invalid clock ratio %d/%d (at most %d PPQN)\n",
+                num, den, MAX_OUTPUT_PPQN);
+        return -1;
+    }
+    unsigned int g = gcd((unsigned int)num, (unsigned int)den);
+    if (CLOCK_STEP % ((unsigned int)num / g) != 0) {
+        fprintf(stderr, "Error: clock ratio %d/%d is not on the queue grid "
+                "(the reduced numerator must divide %d)\n", num, den, CLOCK_STEP);
+        return -1;
+    }
+    if (clock_output_count == MAX_CLOCK_OUTPUTS) {
+        fprintf(stderr, "Error: too many clock outputs (max %d)\n", MAX_CLOCK_OUTPUTS);
+        return -1;
+    }
+
+    int port = snd_seq_create_simple_port(seq_handle, name,
+                                          SND_SEQ_PORT_CAP_READ | SND_SEQ_PORT_CAP_SUBS_READ,
+                                          SND_SEQ_PORT_TYPE_MIDI_GENERIC | SND_SEQ_PORT_TYPE_APPLICATION);
+    if (port < 0) {
+        fprintf(stderr, "Error creating port: %s\n", snd_strerror(port));
+        return -1;
+    }
+
+    struct clock_output *out = &clock_outputs[clock_output_count++];
+    out->port = port;
+    clock_event_init(&out->clock_ev, port);
+    out->num = (unsigned int)num / g;
+    out->den = (unsigned int)den / g;
+    out->next = 0;
+    /* join a running clock on its next master tick */
+    outputs_rewind(current_queue_tick);
+    while (output_clock_tick(out, out->next) < current_queue_tick) out->next++;
+
+    printf("[C] Clock output '%s' on port %d: %u/%u x %d PPQN\n",
+           name, port, out->num, out->den, PPQN);
+    return port;
+}
+
+// Remove a clock output added with midi_add_clock_output
+// Returns 0 on success, -1 on error
+int midi_remove_clock_output(int port) {
+    if (seq_handle == NULL) {
+        fprintf(stderr, "Error: MIDI not initialized\n");
+        return -1;
+    }
+    for (int i = 0; i < clock_output_count; i++) {
+        if (clock_outputs[i].port != port) continue;
+        snd_seq_delete_simple_port(seq_handle, port);
+        clock_outputs[i] = clock_outputs[--clock_output_count];
+        return 0;
+    }
+    fprintf(stderr, "Error: port %d is not a clock output\n", port);
+    return -1;
+}
+
+/*
+ * MIDI Time Code
+ *
+ * Quarter frames are stamped on the queue's real-time axis, so they run off
+ * the same timer as the clocks and stay frame-locked to them. Time code
+ * zero (plus an optional offset) is the MIDI START of the current clock run.
+ */
+enum mtc_rate { MTC_24 = 0, MTC_25 = 1, MTC_2997_DF = 2, MTC_30 = 3 };
+
+static struct {
+    int enabled;
+    int running;
+    int rate;                   /* enum mtc_rate, also the rate bits sent */
+    int port;                   /* source port of MTC events */
+    int own_port;               /* port created for MTC only */
+    long long fps_num, fps_den; /* frame rate as a fraction */
+    long long lookahead_ns;
+    long long origin_ns;        /* queue real time of frame 0 */
+    long long offset_frames;    /* time code at frame 0 */
+    long long next_qf;          /* next quarter frame to schedule */
+    unsigned char pieces[8];    /* time code latched every 8 quarter frames */
+} mtc = { .port = -1, .own_port = -1 };
+
+// Queue real time of a quarter frame, computed from the index every time so
+// no rounding error builds up
+static long long mtc_qf_queue_ns(long long qf) {
+    return mtc.origin_ns + qf * 1000000000LL * mtc.fps_den / (mtc.fps_num * 4);
+}
+
+// Split a frame count into hh:mm:ss:ff, applying drop-frame numbering for
+// 29.97 fps (frames 0 and 1 skipped each minute except every tenth)
+static void mtc_frame_to_time(long long frame, int *hh, int *mm, int *ss, int *ff) {
+    int nominal = (int)((mtc.fps_num + mtc.fps_den - 1) / mtc.fps_den);
+    if (mtc.rate == MTC_2997_DF) {
+        long long tens = frame / 17982, rest = frame % 17982;
+        frame += 18 * tens + (rest > 2 ? 2 * ((rest - 2) / 1798) : 0);
+    }
+    *ff = (int)(frame % nominal);
+    *ss = (int)(frame / nominal % 60);
+    *mm = (int)(frame / (nominal * 60LL) % 60);
+    *hh = (int)(frame / (nominal * 3600LL) % 24);
+}
+
+// Latch the time code for the 8 quarter frames starting at frame `frame`
+static void mtc_latch(long long frame) {
+    int hh, mm, ss, ff;
+    mtc_frame_to_time(frame + mtc.offset_frames, &hh, &mm, &ss, &ff);
+    mtc.pieces[0] = ff & 0x0f;
+    mtc.pieces[1] = ff >> 4;
+    mtc.pieces[2] = ss & 0x0f;
+    mtc.pieces[3] = ss >> 4;
+    mtc.pieces[4] = mm & 0x0f;
+    mtc.pieces[5] = mm >> 4;
+    mtc.pieces[6] = hh & 0x0f;
+    mtc.pieces[7] = (unsigned char)((mtc.rate << 1) | (hh >> 4));
+}
+
+// Enqueue a full-frame message (used when time code starts or relocates)
+static int mtc_full_frame(long long frame, long long queue_ns) {
+    int hh, mm, ss, ff;
+    mtc_frame_to_time(frame + mtc.offset_frames, &hh, &mm, &ss, &ff);
+    unsigned char sysex[10] = { 0xf0, 0x7f, 0x7f, 0x01, 0x01,
+                                (unsigned char)((mtc.rate << 5) | hh),
+                                (unsigned char)mm, (unsigned char)ss, (unsigned char)ff, 0xf7 };
+    snd_seq_event_t ev;
+    snd_seq_real_time_t rt;
+    snd_seq_ev_clear(&ev);
+    snd_seq_ev_set_source(&ev, mtc.port);
+    snd_seq_ev_set_subs(&ev);
+    snd_seq_ev_set_sysex(&ev, sizeof(sysex), sysex);
+    snd_seq_ev_set_tag(&ev, TAG_MTC);
+    rt = queue_real_time(queue_ns);
+    snd_seq_ev_schedule_real(&ev, queue_id, 0, &rt);
+    return snd_seq_event_output(seq_handle, &ev);
+}
+
+// Queue quarter frames up to the lookahead horizon
+static int mtc_service(void) {
+    if (!mtc.running) return 0;
+
+    long long now_queue_ns;
+    if (queue_snapshot(NULL, &now_queue_ns, NULL) < 0) return -1;
+    long long horizon = now_queue_ns + mtc.lookahead_ns;
+
+    int queued = 0;
+    for (long long t = mtc_qf_queue_ns(mtc.next_qf); t <= horizon; t = mtc_qf_queue_ns(mtc.next_qf)) {
+        int piece = (int)(mtc.next_qf % 8);
+        if (piece == 0) mtc_latch(mtc.next_qf / 4);
+
+        snd_seq_event_t ev;
+        snd_seq_real_time_t rt;
+        snd_seq_ev_clear(&ev);
+        snd_seq_ev_set_source(&ev, mtc.port);
+        snd_seq_ev_set_subs(&ev);
+        ev.type = SND_SEQ_EVENT_QFRAME;
+        ev.data.control.value = (piece << 4) | mtc.pieces[piece];
+        rt = queue_real_time(t);
+        snd_seq_ev_schedule_real(&ev, queue_id, 0, &rt);
+        int err = snd_seq_event_output(seq_handle, &ev);
+        if (err < 0) {
+            fprintf(stderr, "Error enqueuing MTC quarter frame: %s\n", snd_strerror(err));
+            return -1;
+        }
+        mtc.next_qf++;
+        queued++;
+    }
+    return queued;
+}
+
+// Start time code at a queue real time (frame 0 of the run)
+static void mtc_start(long long queue_ns) {
+    if (!mtc.enabled) return;
+    mtc.origin_ns = queue_ns;
+    mtc.next_qf = 0;
+    mtc.running = 1;
+    if (mtc_full_frame(0, queue_ns) < 0)
+        fprintf(stderr, "Error enqueuing MTC full frame\n");
+    mtc_service();
+}
+
+// Stop time code at a queue real time; quarter frames and full frames past
+// it are retracted
+static void mtc_stop(long long queue_ns) {
+    if (!mtc.running) return;
+    mtc.running = 0;
+
+    retract_events_after_ns(SND_SEQ_EVENT_QFRAME, 0, queue_ns);
+    retract_events_after_ns(SND_SEQ_EVENT_SYSEX, TAG_MTC, queue_ns);
+}
+
+// Enable MTC output. rate: 0 = 24, 1 = 25, 2 = 29.97 drop-frame, 3 = 30 fps.
+// With dedicated_port set, MTC goes out on its own "MTC Out" port instead of
+// the clock port. Quarter frames are kept lookahead_ms ahead of the playhead.
+// Returns 0 on success, -1 on error
+int midi_mtc_enable(int rate, int dedicated_port, int lookahead_ms) {
+    static const long long num[] = { 24, 25, 30000, 30 };
+    static const long long den[] = { 1, 1, 1001, 1 };
+
+    if (seq_handle == NULL) {
+        fprintf(stderr, "Error: MIDI not initialized\n");
+        return -1;
+    }
+    if (direct.enabled) return direct_refuse("MTC");
+    if (rate < MTC_24 || rate > MTC_30 || lookahead_ms <= 0) {
+        fprintf(stderr, "Error: invalid MTC rate %d / lookahead %d ms\n", rate, lookahead_ms);
+        return -1;
+    }
+
+    if (dedicated_port && mtc.own_port < 0) {
+        mtc.own_port = snd_seq_create_simple_port(seq_handle, "MTC Out",
+                                                  SND_SEQ_PORT_CAP_READ | SND_SEQ_PORT_CAP_SUBS_READ,
+                                                  SND_SEQ_PORT_TYPE_MIDI_GENERIC | SND_SEQ_PORT_TYPE_APPLICATION);
+        if (mtc.own_port < 0) {
+            fprintf(stderr, "Error creating MTC port: %s\n", snd_strerror(mtc.own_port));
+            return -1;
+        }
+    }
+    mtc.port = dedicated_port ? mtc.own_port : port_id;
+    mtc.rate = rate;
+    mtc.fps_num = num[rate];
+    mtc.fps_den = den[rate];
+    mtc.lookahead_ns = lookahead_ms * 1000000LL;
+    mtc.enabled = 1;
+
+    printf("[C] MTC enabled: %s fps on port %d\n",
+           (const char *[]){ "24", "25", "29.97df", "30" }[rate], mtc.port);
+    return 0;
+}
+
+// Time code shown at MIDI START (defaults to 00:00:00:00), in the frame
+// numbering of the rate MTC was enabled with
+// Returns 0 on success, -1 on error
+int midi_mtc_set_offset(int hh, int mm, int ss, int ff) {
+    if (!mtc.enabled) {
+        fprintf(stderr, "Error: MTC not enabled\n");
+        return -1;
+    }
+    long long nominal = (mtc.fps_num + mtc.fps_den - 1) / mtc.fps_den;
+    /* drop-frame numbering skips frames 0 and 1 at the start of every
+       minute except every tenth */
+    int dropped = mtc.rate == MTC_2997_DF && ss == 0 && ff < 2 && mm % 10 != 0;
+    if (hh < 0 || hh > 23 || mm < 0 || mm > 59 || ss < 0 || ss > 59 || ff < 0 || ff >= nominal ||
+        dropped) {
+        fprintf(stderr, "Error: invalid MTC offset %02d:%02d:%02d:%02d\n", hh, mm, ss, ff);
+        return -1;
+    }
+    long long frames = ((hh * 60LL + mm) * 60 + ss) * nominal + ff;
+    if (mtc.rate == MTC_2997_DF) {
+        /* invert the drop-frame numbering */
+        long long minutes = hh * 60LL + mm;
+        frames -= 2 * (minutes - minutes / 10);
+    }
+    mtc.offset_frames = frames;
+    return 0;
+}
+
+// Disable MTC output (the dedicated port, if any, is kept for re-enabling)
+void midi_mtc_disable(void) {
+    if (mtc.running && seq_handle != NULL) {
+        long long now_queue_ns;
+        if (queue_snapshot(NULL, &now_queue_ns, NULL) == 0) mtc_stop(now_queue_ns);
+        snd_seq_drain_output(seq_handle);
+    }
+    mtc.running = 0;
+    mtc.enabled = 0;
+}
+
+// Port MTC is sent from, -1 if disabled
+int midi_mtc_get_port_id(void) {
+    return mtc.enabled ? mtc.port : -1;
+}
+
+/*
+ * Exact tempo
+ *
+ * The queue runs at a whole number of microseconds per beat, which cannot
+ * express most tempos exactly (123.45 BPM is 486026.73 us). A tempo given in
+ * millionths of a BPM is kept exactly instead: every beat gets the queue
+ * tempo that brings the queue back onto the exact timeline, with the
+ * rounding error carried into the next beat. The kernel plays a whole
+ * number of ns per tick, so a beat lasts a multiple of QUEUE_TEMPO_PPQ ns
+ * and the queue never strays by more than half of that (1.44 us). All of it
+ * is 64-bit integer arithmetic, so every platform plays the same ticks at
+ * the same times.
+ */
+#define UBPM_PER_BPM 1000000LL
+#define NS_PER_MINUTE_UBPM (60000000000LL * UBPM_PER_BPM)   /* beat length in ns = this / ubpm */
+#define MAX_UBPM (1000LL * UBPM_PER_BPM)
+
+static struct {
+    long long ubpm;             /* exact tempo, 0 while not in use */
+    long long frac;             /* remainder of the beat length, in 1/ubpm ns */
+    long long carry_ns;         /* rounding error carried into the next beat */
+    unsigned int queued_us;     /* tempo of the last tempo event queued */
+    snd_seq_tick_time_t last_beat_tick;
+} exact;
+
+// Queue tempo for the next beat of the exact tempo, carrying the error on
+static unsigned int exact_next_beat_us(void) {
+    long long num = NS_PER_MINUTE_UBPM + exact.frac;
+    long long want_ns = num / exact.ubpm + exact.carry_ns;
+    exact.frac = num % exact.ubpm;
+    /* nearest beat length the queue can play, and the tempo that plays it */
+    long long tick_ns = (want_ns + QUEUE_TEMPO_PPQ / 2) / QUEUE_TEMPO_PPQ;
+    long long us = (tick_ns * QUEUE_TEMPO_PPQ + 999) / 1000;
+    exact.carry_ns = want_ns - tick_ns * QUEUE_TEMPO_PPQ;
+    return (unsigned int)us;
+}
+
+// Queue the tempo for the beat starting at tick when it is a beat of the
+// running exact tempo (not drained)
+static void exact_beat(snd_seq_tick_time_t tick) {
+    if (exact.ubpm == 0) return;
+    /* scheduled tempo changes ahead own the timeline */
+    for (int i = 0; i < pending_tempo_count; i++)
+        if (!pending_tempo[i].carry) return;
+    if (tick < clock_origin_tick || (tick - clock_origin_tick) % QUEUE_TEMPO_PPQ != 0) return;
+    if (tick <= exact.last_beat_tick) return;
+    exact.last_beat_tick = tick;
+
+    unsigned int us_per_beat = exact_next_beat_us();
+    if (us_per_beat == exact.queued_us) return;
+    /* the step goes on the timeline too, so queue times follow the carry */
+    struct tempo_point point = { .tick = tick, .us_per_beat = us_per_beat, .carry = 1 };
+    if (add_pending_tempo(&point) < 0) return;
+    snd_seq_event_t ev;
+    snd_seq_ev_clear(&ev);
+    snd_seq_ev_set_source(&ev, port_id);
+    snd_seq_ev_set_queue_tempo(&ev, queue_id, us_per_beat);
+    snd_seq_ev_schedule_tick(&ev, queue_id, 0, tick);
+    if (snd_seq_event_output(seq_handle, &ev) < 0) {
+        fprintf(stderr, "Error enqueuing tempo event at tick %lu\n", (unsigned long)tick);
+        drop_carry_tempo(tick);
+        return;
+    }
+    exact.queued_us = us_per_beat;
+}
+
+// Change the queue tempo at the playhead (not printed). The playhead tick
+// is returned through the pointer.
+// Returns 0 on success, -1 on error
+static int set_tempo_now(unsigned int us_per_beat, snd_seq_tick_time_t *at_tick) {
+    /*
+     * The tempo change takes effect at the current playhead. Clocks are
+     * stamped in ticks, so a tempo event at the playhead retimes every clock
+     * queued after it, however far ahead; only tempo changes still pending
+     * from an earlier call are retracted. Route clocks sit on the real-time
+     * axis and are sent again on the new timeline.
+     */
+    if (direct.enabled) {
+        /* the next deadline is kept, the ones after it use the new period */
+        tempo_anchor.us_per_beat = us_per_beat;
+        exact.ubpm = 0;
+        direct.period_ps = us_per_beat * 1000000LL / PPQN;
+        flight_record(FLIGHT_TEMPO, current_queue_tick, us_per_beat, 0);
+        USDT2(tempo, current_queue_tick, us_per_beat);
+        if (at_tick) *at_tick = current_queue_tick;
+        return 0;
+    }
+    TRACE_BEGIN(trace_from);
+    snd_seq_tick_time_t playhead;
+    long long now_queue_ns;
+    if (queue_snapshot(&playhead, &now_queue_ns, NULL) < 0) return -1;
+    snd_seq_tick_time_t retract_from = playhead + 1;
+    exact.ubpm = 0;
+
+    int err = retract_events(SND_SEQ_EVENT_TEMPO, 0, retract_from);
+    if (err >= 0) err = routes_retract(retract_from);
+    if (err < 0) {
+        USDT2(alsa_error, playhead, err);
+        fprintf(stderr, "Error retracting queued events: %s\n", snd_strerror(err));
+        return -1;
+    }
+    drop_carry_tempo(retract_from);
+
+    snd_seq_event_t ev;
+    snd_seq_ev_clear(&ev);
     snd_seq_ev_set_source(&ev, port_id);
     snd_seq_ev_set_subs(&ev);
-    ev.type = SND_SEQ_EVENT_STOP;
-    
-    snd_seq_ev_schedule_tick(&ev, queue_id, 0, current_queue_tick);
-    snd_seq_event_output(seq_handle, &ev);
+
+     /* attach the tempo (microseconds per beat) to the event using ALSA
+         helper macro. The macro expects the tempo value (not a pointer). */
+     snd_seq_ev_set_queue_tempo(&ev, queue_id, us_per_beat);
+    snd_seq_ev_schedule_tick(&ev, queue_id, 0, playhead);
+
+    err = snd_seq_event_output(seq_handle, &ev);
+    if (err < 0) {
+        USDT2(alsa_error, playhead, err);
+        fprintf(stderr, "Error enqueuing tempo event: %s\n", snd_strerror(err));
+        return -1;
+    }
+    anchor_tempo_now(now_queue_ns, us_per_beat);
+    flight_record(FLIGHT_TEMPO, playhead, us_per_beat, 0);
+    USDT2(tempo, playhead, us_per_beat);
+    routes_refill(retract_from);
+    snd_seq_drain_output(seq_handle);
+    TRACE_END(trace_from, "set_tempo", "us_per_beat", us_per_beat);
+
+    if (at_tick) *at_tick = playhead;
+    return 0;
+}
+
+// Change to an exact tempo at the playhead; the first beat's queue tempo
+// and the playhead tick are returned through the pointers
+// Returns 0 on success, -1 on error
+static int set_tempo_ubpm_now(long long ubpm, unsigned int *us_per_beat, snd_seq_tick_time_t *at_tick) {
+    /* up to the first beat boundary the queue runs at the rounded tempo */
+    unsigned int us = (unsigned int)((NS_PER_MINUTE_UBPM / ubpm + 500) / 1000);
+    if (set_tempo_now(us, at_tick) < 0) return -1;
+    if (us_per_beat) *us_per_beat = us;
+
+    if (direct.enabled) {
+        /* 60 s in ps per minute over 24 clocks per beat */
+        direct.period_ps = 2500000000000000000LL / ubpm;
+        exact.ubpm = ubpm;
+        return 0;
+    }
+
+    /* the sequence starts on the first beat boundary after the playhead;
+       beats already queued get their tempo here, later ones as their clock
+       is sent */
+    exact.ubpm = ubpm;
+    exact.frac = 0;
+    exact.carry_ns = 0;
+    exact.queued_us = us;
+    exact.last_beat_tick = *at_tick;
+    snd_seq_tick_time_t beat = clock_origin_tick;
+    if (*at_tick >= clock_origin_tick)
+        beat += ((*at_tick - clock_origin_tick) / QUEUE_TEMPO_PPQ + 1) * QUEUE_TEMPO_PPQ;
+    if (beat >= current_queue_tick) return 0;
+    for (; beat < current_queue_tick; beat += QUEUE_TEMPO_PPQ) exact_beat(beat);
+    /* route clocks were stamped before the steps were on the timeline */
+    if (routes_retract(*at_tick + 1) < 0) return -1;
+    routes_refill(*at_tick + 1);
+    snd_seq_drain_output(seq_handle);
+    return 0;
+}
+
+// Update the queue tempo using BPM value expressed in tenths (e.g. 1200 = 120.0 BPM)
+// Returns 0 on success, -1 on error
+int midi_set_tempo(int bpm10) {
+    RT_SECTION();
+    if (seq_handle == NULL) {
+        fprintf(stderr, "Error: MIDI not initialized\n");
+        return -1;
+    }
+    if (bpm10 <= 0 || bpm10 * (UBPM_PER_BPM / 10) > MAX_UBPM) {
+        fprintf(stderr, "Error: invalid BPM (tenths) %d\n", bpm10);
+        return -1;
+    }
+
+    unsigned int us_per_beat;
+    snd_seq_tick_time_t playhead;
+    if (set_tempo_ubpm_now(bpm10 * (UBPM_PER_BPM / 10), &us_per_beat, &playhead) < 0) return -1;
+
+    printf("[C] MIDI tempo set to %.1f BPM ( %u us/beat ) at tick %lu\n",
+           bpm10 / 10.0, us_per_beat, (unsigned long)playhead);
+    return 0;
+}
+
+// Update the queue tempo in millionths of a BPM (120000000 = 120 BPM). The
+// tempo is kept exactly over any length of time, see "Exact tempo".
+// Returns 0 on success, -1 on error
+int midi_set_tempo_ubpm(long long ubpm) {
+    RT_SECTION();
+    if (seq_handle == NULL) {
+        fprintf(stderr, "Error: MIDI not initialized\n");
+        return -1;
+    }
+    if (ubpm <= 0 || ubpm > MAX_UBPM) {
+        fprintf(stderr, "Error: invalid tempo %lld millionths of a BPM\n", ubpm);
+        return -1;
+    }
+
+    unsigned int us_per_beat;
+    snd_seq_tick_time_t playhead;
+    if (set_tempo_ubpm_now(ubpm, &us_per_beat, &playhead) < 0) return -1;
+
+    printf("[C] MIDI tempo set to %lld.%06lld BPM ( %u us/beat ) at tick %lu\n",
+           ubpm / UBPM_PER_BPM, ubpm % UBPM_PER_BPM, us_per_beat, (unsigned long)playhead);
+    return 0;
+}
+
+// Exact tempo in millionths of a BPM, or the queue tempo converted when no
+// exact tempo is in use
+long long midi_get_tempo_ubpm(void) {
+    if (exact.ubpm) return exact.ubpm;
+    return (NS_PER_MINUTE_UBPM / 1000 + tempo_anchor.us_per_beat / 2) / tempo_anchor.us_per_beat;
+}
+
+// Enqueue a tempo change at a queue tick, or at a queue real time when
+// queue_ns is given (not drained). Unlike midi_set_tempo nothing is
+// retracted: the change is a point on the timeline that later live tempo
+// updates leave in place.
+// Returns 0 on success, -1 on error
+static int schedule_tempo_at(unsigned int us_per_beat, snd_seq_tick_time_t tick, const long long *queue_ns) {
+    exact.ubpm = 0;
+    struct tempo_point point;
+    point.us_per_beat = us_per_beat;
+    point.by_time = queue_ns != NULL;
+    point.carry = 0;
+    point.tick = tick;
+    point.queue_ns = queue_ns ? *queue_ns : 0;
+
+    snd_seq_event_t ev;
+    snd_seq_ev_clear(&ev);
+    snd_seq_ev_set_source(&ev, port_id);
+    snd_seq_ev_set_queue_tempo(&ev, queue_id, us_per_beat);
+    snd_seq_ev_set_tag(&ev, TAG_TIMED);
+    if (queue_ns) {
+        snd_seq_real_time_t rt = queue_real_time(*queue_ns);
+        snd_seq_ev_schedule_real(&ev, queue_id, 0, &rt);
+    } else {
+        snd_seq_ev_schedule_tick(&ev, queue_id, 0, tick);
+    }
+
+    /* route clocks past the change were stamped on the old timeline */
+    double from = queue_ns ? tick_at_queue_ns(*queue_ns) : tick;
+    snd_seq_tick_time_t route_from = from < 0 ? 0 : (snd_seq_tick_time_t)from;
+    if (routes_retract(route_from) < 0) return -1;
+    if (add_pending_tempo(&point) < 0) return -1;
+    routes_refill(route_from);
+    int err = snd_seq_event_output(seq_handle, &ev);
+    if (err < 0) {
+        USDT2(alsa_error, tick, err);
+        fprintf(stderr, "Error enqueuing tempo event: %s\n", snd_strerror(err));
+        return -1;
+    }
+    flight_record(FLIGHT_TEMPO, (unsigned int)point.tick, us_per_beat, 0);
+    USDT2(tempo, (unsigned int)point.tick, us_per_beat);
+    TRACE_INSTANT("tempo_at", "tick", (long long)point.tick);
+    return 0;
+}
+
+// Queue tick of a beat on the queue timeline (beat 0 = queue tick 0)
+// Returns 0 on success, -1 if the beat is off the tick range
+static int beat_to_tick(double beat, snd_seq_tick_time_t *tick) {
+    if (!(beat >= 0 && beat <= UINT_MAX / QUEUE_TEMPO_PPQ)) {
+        fprintf(stderr, "Error: invalid beat %.3f\n", beat);
+        return -1;
+    }
+    *tick = (snd_seq_tick_time_t)(beat * QUEUE_TEMPO_PPQ + 0.5);
+    return 0;
+}
+
+// Schedule a tempo change (tenths of BPM) exactly at the given queue tick
+// Returns 0 on success, -1 on error
+int midi_set_tempo_at_tick(unsigned int tick, int bpm10) {
+    RT_SECTION();
+    if (seq_handle == NULL) {
+        fprintf(stderr, "Error: MIDI not initialized\n");
+        return -1;
+    }
+    if (direct.enabled) return direct_refuse("timed tempo changes");
+    unsigned int us_per_beat;
+    if (bpm10_to_us_per_beat(bpm10, &us_per_beat) < 0) return -1;
+    if (schedule_tempo_at(us_per_beat, tick, NULL) < 0) return -1;
+    snd_seq_drain_output(seq_handle);
+    printf("[C] MIDI tempo %.1f BPM scheduled at tick %u\n", bpm10 / 10.0, tick);
+    return 0;
+}
+
+// Schedule a tempo change (tenths of BPM) at the given beat of the queue
+// timeline (beat 0 = queue tick 0)
+// Returns 0 on success, -1 on error
+int midi_set_tempo_at_beat(double beat, int bpm10) {
+    RT_SECTION();
+    snd_seq_tick_time_t tick;
+    if (beat_to_tick(beat, &tick) < 0) return -1;
+    return midi_set_tempo_at_tick(tick, bpm10);
+}
+
+// Schedule a tempo change (tenths of BPM) at a CLOCK_MONOTONIC time in ns
+// (the clock behind Python's time.monotonic_ns())
+// Returns 0 on success, -1 on error
+int midi_set_tempo_at_time(long long monotonic_ns, int bpm10) {
+    RT_SECTION();
+    if (seq_handle == NULL) {
+        fprintf(stderr, "Error: MIDI not initialized\n");
+        return -1;
+    }
+    if (direct.enabled) return direct_refuse("timed tempo changes");
+    unsigned int us_per_beat;
+    if (bpm10_to_us_per_beat(bpm10, &us_per_beat) < 0) return -1;
+    long long queue_ns;
+    if (monotonic_to_queue_ns(monotonic_ns, &queue_ns) < 0) return -1;
+    if (schedule_tempo_at(us_per_beat, 0, &queue_ns) < 0) return -1;
+    snd_seq_drain_output(seq_handle);
+    printf("[C] MIDI tempo %.1f BPM scheduled at queue time %.6f s\n",
+           bpm10 / 10.0, queue_ns / 1e9);
+    return 0;
+}
+
+// Begin a clock run: MIDI START at the given tick (or queue real time when
+// queue_ns is given) and clocks from first_clock_tick on
+// Returns 0 on success, -1 on error
+static int start_clock_run(snd_seq_tick_time_t first_clock_tick, const long long *queue_ns) {
+    int err = retract_clocks(first_clock_tick);
+    if (err >= 0) err = schedule_transport(SND_SEQ_EVENT_START, first_clock_tick, queue_ns);
+    if (err < 0) {
+        fprintf(stderr, "Error enqueuing start event: %s\n", snd_strerror(err));
+        return -1;
+    }
+    flight_record(FLIGHT_START, first_clock_tick, 0, 0);
+    TRACE_INSTANT("start", "tick", first_clock_tick);
+    USDT1(start, first_clock_tick);
+    current_queue_tick = first_clock_tick;
+    clock_origin_tick = first_clock_tick;
+    for (int i = 0; i < clock_output_count; i++) clock_outputs[i].next = 0;
+    if (current_queue_tick > max_scheduled_tick) max_scheduled_tick = current_queue_tick;
+    stop_armed = 0;
+    ensure_queue_running();
+    mtc_start(queue_ns ? *queue_ns : queue_ns_at_tick(first_clock_tick));
+    snd_seq_drain_output(seq_handle);
+    return 0;
+}
+
+// End the clock run: MIDI STOP at the given tick (or queue real time when
+// queue_ns is given); clocks at or after stop_at are dropped
+// Returns 0 on success, -1 on error
+static int stop_clock_run(snd_seq_tick_time_t stop_at, const long long *queue_ns) {
+    int err = retract_clocks(stop_at);
+    if (err >= 0) err = schedule_transport(SND_SEQ_EVENT_STOP, stop_at, queue_ns);
+    if (err < 0) {
+        fprintf(stderr, "Error enqueuing stop event: %s\n", snd_strerror(err));
+        return -1;
+    }
+    flight_record(FLIGHT_STOP, stop_at, 0, 0);
+    TRACE_INSTANT("stop", "tick", stop_at);
+    USDT1(stop, stop_at);
+    if (current_queue_tick > stop_at) current_queue_tick = stop_at;
+    stop_armed = 1;
+    stop_tick = stop_at;
+    mtc_stop(queue_ns ? *queue_ns : queue_ns_at_tick(stop_at));
     snd_seq_drain_output(seq_handle);
+    return 0;
+}
+
+// Send MIDI Start message
+// Returns 0 on success, -1 on error
+int midi_send_start(void) {
+    RT_SECTION();
+    if (seq_handle == NULL) {
+        fprintf(stderr, "Error: MIDI not initialized\n");
+        return -1;
+    }
     
-    printf("[C] MIDI STOP sent\n");
+    if (direct.enabled) {
+        if (direct_send(SND_SEQ_EVENT_START) < 0) return -1;
+        flight_record(FLIGHT_START, current_queue_tick, 0, 0);
+        USDT1(start, current_queue_tick);
+        clock_origin_tick = current_queue_tick;
+        if (direct.period_ps == 0) direct.period_ps = tempo_anchor.us_per_beat * 1000000LL / PPQN;
+        direct_event_init(&direct.clock_ev, SND_SEQ_EVENT_CLOCK);
+        direct.running = 1;
+        direct.next_ns = monotonic_ns();
+        direct.next_frac_ps = 0;
+        printf("[C] MIDI START sent\n");
+        return 0;
+    }
+
+    /* a fresh queue starts at tick 0; a running one restarts at its playhead */
+    snd_seq_tick_time_t playhead = 0;
+    if (queue_running && queue_snapshot(&playhead, NULL, NULL) < 0) return -1;
+    if (start_clock_run(playhead, NULL) < 0) return -1;
+    
+    printf("[C] MIDI START sent, queue started\n");
     
     return 0;
 }
 
+// Schedule MIDI Start at the given queue tick; clocks begin on that tick
+// Returns 0 on success, -1 on error
+int midi_send_start_at_tick(unsigned int tick) {
+    RT_SECTION();
+    if (seq_handle == NULL) {
+        fprintf(stderr, "Error: MIDI not initialized\n");
+        return -1;
+    }
+    if (direct.enabled) return direct_refuse("timed START");
+    if (start_clock_run(tick, NULL) < 0) return -1;
+    printf("[C] MIDI START scheduled at tick %u\n", tick);
+    return 0;
+}
+
+// Schedule MIDI Start at the given beat of the queue timeline
+// Returns 0 on success, -1 on error
+int midi_send_start_at_beat(double beat) {
+    RT_SECTION();
+    snd_seq_tick_time_t tick;
+    if (beat_to_tick(beat, &tick) < 0) return -1;
+    return midi_send_start_at_tick(tick);
+}
+
+// Schedule MIDI Start at a CLOCK_MONOTONIC time in ns. START is stamped with
+// the exact queue real time; clocks begin on the first tick after it.
+// Returns 0 on success, -1 on error
+int midi_send_start_at_time(long long monotonic_ns) {
+    RT_SECTION();
+    if (seq_handle == NULL) {
+        fprintf(stderr, "Error: MIDI not initialized\n");
+        return -1;
+    }
+    if (direct.enabled) return direct_refuse("timed START");
+    long long queue_ns;
+    if (monotonic_to_queue_ns(monotonic_ns, &queue_ns) < 0) return -1;
+    double tick = tick_at_queue_ns(queue_ns);
+    snd_seq_tick_time_t first_clock = tick < 0 ? 0 : (snd_seq_tick_time_t)tick + 1;
+    if (start_clock_run(first_clock, &queue_ns) < 0) return -1;
+    printf("[C] MIDI START scheduled at queue time %.6f s, first clock at tick %lu\n",
+           queue_ns / 1e9, (unsigned long)first_clock);
+    return 0;
+}
+
+// Send MIDI Clock message
+// Returns 0 on success, -1 on error
+int midi_send_clock(void) {
+    RT_SECTION();
+    if (seq_handle == NULL) {
+        fprintf(stderr, "Error: MIDI not initialized\n");
+        return -1;
+    }
+    
+    if (direct.enabled) return direct_clock();
+
+    /* past a scheduled STOP there is nothing left to clock */
+    if (stop_armed && current_queue_tick >= stop_tick) return 0;
+
+    TRACE_BEGIN(trace_from);
+    exact_beat(current_queue_tick);
+    int err;
+    if (clock_output_count == 0 && !mtc.enabled && !routes_active() &&
+        snd_seq_event_output_pending(seq_handle) == 0) {
+        /* alone in the output: one write straight from the template */
+        clock_event.time.tick = current_queue_tick;
+        err = snd_seq_event_output_direct(seq_handle, &clock_event);
+    } else {
+        err = schedule_clock(current_queue_tick);
+    }
+    flight_record(FLIGHT_CLOCK, current_queue_tick, 0, 0);
+    USDT2(clock, current_queue_tick, tempo_anchor.us_per_beat);
+    if (err < 0) {
+        USDT2(alsa_error, current_queue_tick, err);
+        flight_record(FLIGHT_ERROR, current_queue_tick, err, 0);
+        flight_trigger("alsa-error");
+    }
+    
+    // Advance queue tick by ratio (2880 PPQ / 24 PPQN = 120 ticks per MIDI clock)
+    current_queue_tick += CLOCK_STEP;
+    if (current_queue_tick > max_scheduled_tick) max_scheduled_tick = current_queue_tick;
+
+    outputs_fill(current_queue_tick);
+    mtc_service();
+    TRACE_END(trace_from, "schedule_clock", "tick", current_queue_tick - CLOCK_STEP);
+    TRACE_BEGIN(trace_drain);
+    long long drain_from = flight.enabled ? monotonic_ns() : 0;
+    USDT1(drain_start, current_queue_tick);
+    err = snd_seq_drain_output(seq_handle);
+    USDT2(drain_done, current_queue_tick, err);
+    TRACE_END(trace_drain, "drain", "result", err);
+    if (err < 0) USDT2(alsa_error, current_queue_tick, err);
+    if (flight.enabled) {
+        flight_record(FLIGHT_ALSA, current_queue_tick, monotonic_ns() - drain_from, err);
+        if (err < 0) {
+            flight_record(FLIGHT_ERROR, current_queue_tick, err, 0);
+            flight_trigger("alsa-error");
+        }
+    }
+    
+    return 0;
+}
+
+// Send MIDI Stop message
+// Returns 0 on success, -1 on error
+int midi_send_stop(void) {
+    RT_SECTION();
+    if (seq_handle == NULL) {
+        fprintf(stderr, "Error: MIDI not initialized\n");
+        return -1;
+    }
+    
+    if (direct.enabled) {
+        if (direct_send(SND_SEQ_EVENT_STOP) < 0) return -1;
+        flight_record(FLIGHT_STOP, current_queue_tick, 0, 0);
+        USDT1(stop, current_queue_tick);
+        direct.running = 0;
+        printf("[C] MIDI STOP sent\n");
+        return 0;
+    }
+
+    if (stop_clock_run(current_queue_tick, NULL) < 0) return -1;
+    
+    printf("[C] MIDI STOP sent\n");
+    
+    return 0;
+}
+
+// Schedule MIDI Stop at the given queue tick
+// Returns 0 on success, -1 on error
+int midi_send_stop_at_tick(unsigned int tick) {
+    RT_SECTION();
+    if (seq_handle == NULL) {
+        fprintf(stderr, "Error: MIDI not initialized\n");
+        return -1;
+    }
+    if (direct.enabled) return direct_refuse("timed STOP");
+    if (stop_clock_run(tick, NULL) < 0) return -1;
+    printf("[C] MIDI STOP scheduled at tick %u\n", tick);
+    return 0;
+}
+
+// Schedule MIDI Stop at the given beat of the queue timeline
+// Returns 0 on success, -1 on error
+int midi_send_stop_at_beat(double beat) {
+    RT_SECTION();
+    snd_seq_tick_time_t tick;
+    if (beat_to_tick(beat, &tick) < 0) return -1;
+    return midi_send_stop_at_tick(tick);
+}
+
+// Schedule MIDI Stop at a CLOCK_MONOTONIC time in ns; no clock at or after
+// that moment is sent
+// Returns 0 on success, -1 on error
+int midi_send_stop_at_time(long long monotonic_ns) {
+    RT_SECTION();
+    if (seq_handle == NULL) {
+        fprintf(stderr, "Error: MIDI not initialized\n");
+        return -1;
+    }
+    if (direct.enabled) return direct_refuse("timed STOP");
+    long long queue_ns;
+    if (monotonic_to_queue_ns(monotonic_ns, &queue_ns) < 0) return -1;
+    double tick = tick_at_queue_ns(queue_ns);
+    snd_seq_tick_time_t stop_at = tick < 0 ? 0 : (snd_seq_tick_time_t)(tick + 0.999999);
+    if (stop_clock_run(stop_at, &queue_ns) < 0) return -1;
+    printf("[C] MIDI STOP scheduled at queue time %.6f s (tick %lu)\n",
+           queue_ns / 1e9, (unsigned long)stop_at);
+    return 0;
+}
+
+/*
+ * Queue occupancy
+ *
+ * The queue plays clocks on its own tempo timeline while the caller sends
+ * them on its wall clock, so left alone the backlog either grows or runs
+ * dry. midi_occupancy_wait_us() reads the playhead and tells the caller how
+ * long it may wait before the next clock is needed: until the scheduled-ahead
+ * depth has fallen to the low edge of the band, less the caller's usual
+ * oversleep, which it learns from the depth found after each wait. A depth
+ * of zero or less is an underrun (the next clock is already late).
+ */
+#define OCCUPANCY_LOW_NS 10000000LL
+#define OCCUPANCY_HIGH_NS 40000000LL
+#define OCCUPANCY_LATE_GAIN 0.125
+
+static struct {
+    long long low_ns, high_ns;
+    int waited;                 /* the last call asked the caller to wait */
+    long long aim_ns;           /* depth that wait was meant to end at */
+    double late_ns;             /* caller's usual oversleep */
+    int dry;                    /* in an underrun */
+    unsigned long samples, underruns, above;
+    double depth_sum_ns, depth_min_ns, depth_max_ns;
+} occupancy = { .low_ns = OCCUPANCY_LOW_NS, .high_ns = OCCUPANCY_HIGH_NS };
+
+// Keep the clocks scheduled between low_us and high_us ahead of the playhead;
+// high_us should leave room for a clock period above low_us
+// Returns 0 on success, -1 on error
+int midi_occupancy_set_band(int low_us, int high_us) {
+    if (low_us <= 0 || high_us <= low_us) {
+        fprintf(stderr, "Error: invalid occupancy band %d..%d us\n", low_us, high_us);
+        return -1;
+    }
+    occupancy.low_ns = low_us * 1000LL;
+    occupancy.high_ns = high_us * 1000LL;
+    occupancy.waited = 0;
+    occupancy.late_ns = 0.0;
+    return 0;
+}
+
+// How long the caller may wait before sending the next clock, 0 when it is
+// due now. Call it again after the wait rather than sending blindly.
+// Returns microseconds, or -1 on error
+long long midi_occupancy_wait_us(void) {
+    RT_SECTION();
+    if (seq_handle == NULL) return -1;
+    long long period_ns = (long long)tempo_anchor.us_per_beat * 1000LL / PPQN;
+    if (!queue_running || (stop_armed && current_queue_tick >= stop_tick)) return period_ns / 1000;
+
+    long long now_queue_ns;
+    if (queue_snapshot(NULL, &now_queue_ns, NULL) < 0) return -1;
+    settle_pending_tempo(now_queue_ns);
+    long long depth = queue_ns_at_tick(current_queue_tick) - now_queue_ns;
+
+    occupancy.depth_sum_ns += depth;
+    if (occupancy.samples == 0 || depth < occupancy.depth_min_ns) occupancy.depth_min_ns = depth;
+    if (occupancy.samples == 0 || depth > occupancy.depth_max_ns) occupancy.depth_max_ns = depth;
+    occupancy.samples++;
+    if (depth > occupancy.high_ns) occupancy.above++;
+    if (depth <= 0 && !occupancy.dry) {
+        occupancy.underruns++;
+        USDT2(underrun, current_queue_tick, -depth);
+    }
+    occupancy.dry = depth <= 0;
+
+    /* learn how far past the aim the caller's waits end */
+    if (occupancy.waited) {
+        occupancy.late_ns += OCCUPANCY_LATE_GAIN * ((occupancy.aim_ns - depth) - occupancy.late_ns);
+        if (occupancy.late_ns < 0.0) occupancy.late_ns = 0.0;
+        occupancy.waited = 0;
+    }
+
+    long long margin = occupancy.low_ns + (long long)occupancy.late_ns;
+    if (margin > occupancy.high_ns - period_ns) margin = occupancy.high_ns - period_ns;
+    if (margin < 0) margin = 0;
+    if (depth <= margin) return 0;
+    occupancy.waited = 1;
+    occupancy.aim_ns = margin;
+    return (depth - margin) / 1000;
+}
+
+// Scheduled-ahead depth seen by midi_occupancy_wait_us() (mean, min, max in
+// ms), the number of underruns and of readings above the band
+void midi_occupancy_stats(double *mean_ms, double *min_ms, double *max_ms, unsigned long *underruns,
+                          unsigned long *above) {
+    if (mean_ms) *mean_ms = occupancy.samples ? occupancy.depth_sum_ns / occupancy.samples / 1e6 : 0.0;
+    if (min_ms) *min_ms = occupancy.depth_min_ns / 1e6;
+    if (max_ms) *max_ms = occupancy.depth_max_ns / 1e6;
+    if (underruns) *underruns = occupancy.underruns;
+    if (above) *above = occupancy.above;
+}
+
+/*
+ * Precompiled tempo maps
+ *
+ * A map file (built by tempomap.py) holds a setlist: songs, each made of
+ * contiguous tempo segments (constant or linear BPM ramps, with a time
+ * signature) and transport cues. All fields are little-endian and 4-byte
+ * aligned so the file is used in place through mmap:
+ *
+ *   map_header | map_song[song_count] | map_segment[segment_count] | map_cue[cue_count]
+ *
+ * Song-relative positions are queue ticks (QUEUE_TEMPO_PPQ per beat).
+ */
+#define MAP_MAGIC "LBTM"
+#define MAP_VERSION 1
+#define MAP_MAX_CUES_PER_SONG 256
+#define MAP_MIN_US_PER_BEAT 100000U     /* 600 BPM */
+#define MAP_MAX_US_PER_BEAT 6000000U    /* 10 BPM */
+#define MAP_SONG_AUTO_NEXT 0x1          /* roll into the next song at the end */
+#define MAP_RAMP_STEPS_PER_BEAT 8       /* tempo events per beat in a ramp */
+
+enum map_cue_type {
+    MAP_CUE_START = 1,  /* MIDI START, streaming (re)starts here */
+    MAP_CUE_STOP = 2,   /* MIDI STOP, streaming pauses */
+    MAP_CUE_JUMP = 3,   /* continue at target_tick; repeat = times taken (0: always) */
+    MAP_CUE_MARK = 4    /* named position for midi_map_cue(), no action */
+};
+
+struct map_header {
+    char magic[4];
+    uint16_t version;
+    uint16_t flags;
+    uint32_t song_count;
+    uint32_t segment_count;
+    uint32_t cue_count;
+    uint32_t file_size;
+};
+
+struct map_song {
+    char name[32];
+    uint32_t first_segment;
+    uint32_t segment_count;
+    uint32_t first_cue;
+    uint32_t cue_count;
+    uint32_t length_ticks;
+    uint32_t flags;
+};
+
+struct map_segment {
+    uint32_t start_tick;
+    uint32_t length_ticks;
+    uint32_t start_us_per_beat;
+    uint32_t end_us_per_beat;   /* equal to start for a constant tempo */
+    uint8_t ts_num;
+    uint8_t ts_den;
+    uint16_t reserved;
+};
+
+struct map_cue {
+    uint32_t tick;
+    uint16_t type;
+    uint16_t repeat;
+    uint32_t target_tick;
+};
+
+static struct {
+    void *base;
+    size_t size;
+    const struct map_header *hdr;
+    const struct map_song *songs;
+    const struct map_segment *segments;
+    const struct map_cue *cues;
+
+    /* playback state */
+    int playing;                    /* streaming into the queue */
+    int song;
+    uint32_t cursor;                /* song tick of the next clock to stream */
+    long long offset;               /* queue tick = song tick + offset */
+    uint32_t seg;                   /* current segment, index into the song */
+    uint32_t next_cue;              /* next cue to reach, index into the song */
+    unsigned int last_us_per_beat;  /* last tempo put into the queue */
+    long long lookahead_ns;
+    uint16_t jumps_taken[MAP_MAX_CUES_PER_SONG];
+} tempo_map;
+
+// Validate one song of a mapped file
+// Returns 0 if valid, -1 otherwise (with the reason printed)
+static int map_validate_song(const struct map_header *hdr, const struct map_song *song,
+                             const struct map_segment *segments, const struct map_cue *cues,
+                             uint32_t index) {
+    if (song->segment_count == 0 ||
+        song->first_segment > hdr->segment_count ||
+        song->segment_count > hdr->segment_count - song->first_segment) {
+        fprintf(stderr, "Error: tempo map song %u: bad segment range\n", index);
+        return -1;
+    }
+    if (song->cue_count > MAP_MAX_CUES_PER_SONG ||
+        song->first_cue > hdr->cue_count ||
+        song->cue_count > hdr->cue_count - song->first_cue) {
+        fprintf(stderr, "Error: tempo map song %u: bad cue range\n", index);
+        return -1;
+    }
+
+    uint32_t tick = 0;
+    for (uint32_t i = 0; i < song->segment_count; i++) {
+        const struct map_segment *seg = &segments[song->first_segment + i];
+        if (seg->start_tick != tick || seg->length_ticks == 0 ||
+            seg->length_ticks > UINT32_MAX - tick) {
+            fprintf(stderr, "Error: tempo map song %u segment %u: not contiguous\n", index, i);
+            return -1;
+        }
+        if (seg->start_us_per_beat < MAP_MIN_US_PER_BEAT || seg->start_us_per_beat > MAP_MAX_US_PER_BEAT ||
+            seg->end_us_per_beat < MAP_MIN_US_PER_BEAT || seg->end_us_per_beat > MAP_MAX_US_PER_BEAT) {
+            fprintf(stderr, "Error: tempo map song %u segment %u: tempo out of range\n", index, i);
+            return -1;
+        }
+        if (seg->ts_num == 0 || seg->ts_den == 0 || seg->ts_den > 32 ||
+            (seg->ts_den & (seg->ts_den - 1)) != 0) {
+            fprintf(stderr, "Error: tempo map song %u segment %u: bad time signature %u/%u\n",
+                    index, i, seg->ts_num, seg->ts_den);
+            return -1;
+        }
+        tick += seg->length_ticks;
+    }
+    if (tick != song->length_ticks || tick % CLOCK_STEP != 0) {
+        fprintf(stderr, "Error: tempo map song %u: length %u does not match its segments\n",
+                index, song->length_ticks);
+        return -1;
+    }
+
+    uint32_t prev = 0;
+    for (uint32_t i = 0; i < song->cue_count; i++) {
+        const struct map_cue *cue = &cues[song->first_cue + i];
+        if (cue->tick < prev || cue->tick > song->length_ticks || cue->tick % CLOCK_STEP != 0) {
+            fprintf(stderr, "Error: tempo map song %u cue %u: bad position %u\n", index, i, cue->tick);
+            return -1;
+        }
+        if (cue->type < MAP_CUE_START || cue->type > MAP_CUE_MARK) {
+            fprintf(stderr, "Error: tempo map song %u cue %u: unknown type %u\n", index, i, cue->type);
+            return -1;
+        }
+        if (cue->type == MAP_CUE_JUMP &&
+            (cue->target_tick >= song->length_ticks || cue->target_tick % CLOCK_STEP != 0 ||
+             cue->target_tick == cue->tick)) {
+            fprintf(stderr, "Error: tempo map song %u cue %u: bad jump target %u\n",
+                    index, i, cue->target_tick);
+            return -1;
+        }
+        for (uint32_t j = 0; cue->type == MAP_CUE_JUMP && j < song->cue_count; j++) {
+            const struct map_cue *other = &cues[song->first_cue + j];
+            if (other->type == MAP_CUE_JUMP && other->tick == cue->target_tick) {
+                fprintf(stderr, "Error: tempo map song %u cue %u: jumps onto another jump\n", index, i);
+                return -1;
+            }
+        }
+        prev = cue->tick;
+    }
+    return 0;
+}
+
+// Unmap the loaded tempo map and stop streaming from it
+void midi_map_unload(void) {
+    if (tempo_map.base != NULL) {
+        munmap(tempo_map.base, tempo_map.size);
+    }
+    memset(&tempo_map, 0, sizeof(tempo_map));
+}
+
+// mmap a compiled tempo map / setlist and validate all of it
+// Returns the number of songs on success, -1 on error
+int midi_map_load(const char *path) {
+    long long t0 = monotonic_ns();
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Error opening tempo map %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(struct map_header)) {
+        fprintf(stderr, "Error: tempo map %s is truncated\n", path);
+        close(fd);
+        return -1;
+    }
+    void *base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        fprintf(stderr, "Error mapping tempo map %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    const struct map_header *hdr = base;
+    size_t size = st.st_size;
+    size_t expected = sizeof(*hdr) +
+                      (size_t)hdr->song_count * sizeof(struct map_song) +
+                      (size_t)hdr->segment_count * sizeof(struct map_segment) +
+                      (size_t)hdr->cue_count * sizeof(struct map_cue);
+    if (memcmp(hdr->magic, MAP_MAGIC, 4) != 0 || hdr->version != MAP_VERSION) {
+        fprintf(stderr, "Error: %s is not a version %d tempo map\n", path, MAP_VERSION);
+        munmap(base, size);
+        return -1;
+    }
+    if (hdr->song_count == 0 || hdr->file_size != size || expected != size) {
+        fprintf(stderr, "Error: tempo map %s has inconsistent table sizes\n", path);
+        munmap(base, size);
+        return -1;
+    }
+
+    const struct map_song *songs = (const void *)(hdr + 1);
+    const struct map_segment *segments = (const void *)(songs + hdr->song_count);
+    const struct map_cue *cues = (const void *)(segments + hdr->segment_count);
+    for (uint32_t i = 0; i < hdr->song_count; i++) {
+        if (map_validate_song(hdr, &songs[i], segments, cues, i) < 0) {
+            munmap(base, size);
+            return -1;
+        }
+    }
+
+    midi_map_unload();
+    tempo_map.base = base;
+    tempo_map.size = size;
+    tempo_map.hdr = hdr;
+    tempo_map.songs = songs;
+    tempo_map.segments = segments;
+    tempo_map.cues = cues;
+
+    printf("[C] Tempo map %s: %u songs, %u segments, %u cues validated in %.3f ms\n",
+           path, hdr->song_count, hdr->segment_count, hdr->cue_count,
+           (monotonic_ns() - t0) / 1e6);
+    return (int)hdr->song_count;
+}
+
+// Tempo of a segment at a song tick (ramps are linear in BPM)
+static unsigned int map_us_per_beat_at(const struct map_segment *seg, uint32_t tick) {
+    if (seg->start_us_per_beat == seg->end_us_per_beat) return seg->start_us_per_beat;
+    double bpm0 = 60000000.0 / seg->start_us_per_beat;
+    double bpm1 = 60000000.0 / seg->end_us_per_beat;
+    double bpm = bpm0 + (bpm1 - bpm0) * (tick - seg->start_tick) / seg->length_ticks;
+    return (unsigned int)(60000000.0 / bpm + 0.5);
+}
+
+// Tempo of a segment at a song tick, held in steps of 1/MAP_RAMP_STEPS_PER_BEAT
+// beat so a ramp does not queue a tempo change with every clock
+static unsigned int map_ramp_us_per_beat_at(const struct map_segment *seg, uint32_t tick) {
+    const uint32_t step = QUEUE_TEMPO_PPQ / MAP_RAMP_STEPS_PER_BEAT;
+    return map_us_per_beat_at(seg, seg->start_tick + (tick - seg->start_tick) / step * step);
+}
+
+// Tempo changes the ramps of the loaded map can put in the pending table
+// within a lookahead (at the fastest tempo any ramp reaches)
+static int map_ramp_events(long long lookahead_ns) {
+    unsigned int fastest = 0;
+    for (uint32_t i = 0; i < tempo_map.hdr->segment_count; i++) {
+        const struct map_segment *seg = &tempo_map.segments[i];
+        if (seg->start_us_per_beat == seg->end_us_per_beat) continue;
+        unsigned int us = seg->start_us_per_beat < seg->end_us_per_beat ? seg->start_us_per_beat
+                                                                          : seg->end_us_per_beat;
+        if (fastest == 0 || us < fastest) fastest = us;
+    }
+    if (fastest == 0) return 0;
+    return (int)ceil(lookahead_ns / (fastest * 1000.0) * MAP_RAMP_STEPS_PER_BEAT) + 1;
+}
+
+// Position the stream cursor at a song tick (segment and cue indexes follow)
+static void map_seek(uint32_t tick) {
+    const struct map_song *song = &tempo_map.songs[tempo_map.song];
+    const struct map_segment *segs = &tempo_map.segments[song->first_segment];
+    const struct map_cue *cues = &tempo_map.cues[song->first_cue];
+
+    tempo_map.cursor = tick;
+    tempo_map.seg = 0;
+    while (tempo_map.seg + 1 < song->segment_count &&
+           segs[tempo_map.seg].start_tick + segs[tempo_map.seg].length_ticks <= tick)
+        tempo_map.seg++;
+    tempo_map.next_cue = 0;
+    while (tempo_map.next_cue < song->cue_count && cues[tempo_map.next_cue].tick < tick)
+        tempo_map.next_cue++;
+}
+
+// Drop timed tempo changes at or after a queue tick, in the queue and in
+// our tempo timeline
+static int map_retract_from(snd_seq_tick_time_t from_tick) {
+    int err = retract_events(SND_SEQ_EVENT_TEMPO, TAG_TIMED, from_tick);
+    /* and the steps of an exact tempo set before the map took over */
+    if (err >= 0) err = retract_events(SND_SEQ_EVENT_TEMPO, 0, from_tick);
+    if (err >= 0) err = retract_clocks(from_tick);
+    if (err < 0) {
+        fprintf(stderr, "Error retracting queued events: %s\n", snd_strerror(err));
+        return -1;
+    }
+    while (pending_tempo_count > 0 && pending_tempo[pending_tempo_count - 1].tick >= from_tick)
+        pending_tempo_count--;
+    return 0;
+}
+
+// Begin streaming song `song` at song tick `tick`, placed at queue tick qtick
+static int map_begin(int song, uint32_t tick, snd_seq_tick_time_t qtick) {
+    tempo_map.song = song;
+    memset(tempo_map.jumps_taken, 0, sizeof(tempo_map.jumps_taken));
+    map_seek(tick);
+    tempo_map.offset = (long long)qtick - tick;
+    tempo_map.last_us_per_beat = 0;
+    tempo_map.playing = 1;
+    return start_clock_run(qtick, NULL);
+}
+
+// Start streaming a song of the loaded map with lookahead_ms of events kept
+// in the queue ahead of the playhead. The map then owns the tempo: call
+// midi_map_service() regularly instead of midi_send_clock().
+// Returns 0 on success, -1 on error
+int midi_map_play(int song, int lookahead_ms) {
+    if (seq_handle == NULL) {
+        fprintf(stderr, "Error: MIDI not initialized\n");
+        return -1;
+    }
+    if (direct.enabled) return direct_refuse("tempo map playback");
+    if (tempo_map.hdr == NULL) {
+        fprintf(stderr, "Error: no tempo map loaded\n");
+        return -1;
+    }
+    if (song < 0 || (uint32_t)song >= tempo_map.hdr->song_count || lookahead_ms <= 0) {
+        fprintf(stderr, "Error: invalid song %d / lookahead %d ms\n", song, lookahead_ms);
+        return -1;
+    }
+    int ramp_events = map_ramp_events(lookahead_ms * 1000000LL);
+    if (ramp_events > MAX_PENDING_TEMPO) {
+        fprintf(stderr, "Error: lookahead %d ms holds up to %d ramp tempo changes (max %d)\n",
+                lookahead_ms, ramp_events, MAX_PENDING_TEMPO);
+        return -1;
+    }
+    snd_seq_tick_time_t playhead = 0;
+    if (queue_running && queue_snapshot(&playhead, NULL, NULL) < 0) return -1;
+    snd_seq_tick_time_t qtick = playhead + 1;
+    if (map_retract_from(qtick) < 0) return -1;
+
+    tempo_map.lookahead_ns = lookahead_ms * 1000000LL;
+    if (map_begin(song, 0, qtick) < 0) return -1;
+    printf("[C] Tempo map playing song %d (%.32s), lookahead %d ms\n",
+           song, tempo_map.songs[song].name, lookahead_ms);
+    return 0;
+}
+
+// Jump to a cue of the current song on the next bar line. Undelivered
+// events past that point are retracted and streaming continues from the cue.
+// Returns 0 on success, -1 on error
+int midi_map_cue(int cue) {
+    RT_SECTION();
+    if (seq_handle == NULL) {
+        fprintf(stderr, "Error: MIDI not initialized\n");
+        return -1;
+    }
+    if (tempo_map.hdr == NULL) {
+        fprintf(stderr, "Error: no tempo map loaded\n");
+        return -1;
+    }
+    const struct map_song *song = &tempo_map.songs[tempo_map.song];
+    if (cue < 0 || (uint32_t)cue >= song->cue_count) {
+        fprintf(stderr, "Error: invalid cue %d\n", cue);
+        return -1;
+    }
+    uint32_t target = tempo_map.cues[song->first_cue + cue].tick;
+
+    snd_seq_tick_time_t playhead;
+    if (queue_snapshot(&playhead, NULL, NULL) < 0) return -1;
+
+    /* next bar line after the playhead, in the bar grid of the segment
+       that is playing */
+    snd_seq_tick_time_t qtick = playhead + 1;
+    if (tempo_map.playing) {
+        long long song_tick = (long long)playhead - tempo_map.offset;
+        if (song_tick < 0) song_tick = 0;
+        if (song_tick >= song->length_ticks) song_tick = song->length_ticks - 1;
+        const struct map_segment *segs = &tempo_map.segments[song->first_segment];
+        uint32_t s = 0;
+        while (s + 1 < song->segment_count && segs[s].start_tick + segs[s].length_ticks <= song_tick) s++;
+        uint32_t bar = QUEUE_TEMPO_PPQ * 4 / segs[s].ts_den * segs[s].ts_num;
+        long long into_bar = (song_tick - segs[s].start_tick) % bar;
+        qtick = (snd_seq_tick_time_t)(playhead + (bar - into_bar));
+    }
+    if (map_retract_from(qtick) < 0) return -1;
+
+    if (tempo_map.playing) {
+        tempo_map.offset = (long long)qtick - target;
+        map_seek(target);
+        tempo_map.last_us_per_beat = 0;
+        current_queue_tick = qtick;
+    } else if (map_begin(tempo_map.song, target, qtick) < 0) {
+        return -1;
+    }
+    snd_seq_drain_output(seq_handle);
+    printf("[C] Tempo map cue %d (tick %u) at queue tick %lu\n", cue, target, (unsigned long)qtick);
+    return 0;
+}
+
+// Keep the queue filled from the tempo map up to the lookahead horizon.
+// Call regularly (well within the lookahead) while a map is playing.
+// Returns the number of clocks queued, -1 on error
+int midi_map_service(void) {
+    RT_SECTION();
+    if (!tempo_map.playing || seq_handle == NULL) return 0;
+
+    long long now_queue_ns;
+    if (queue_snapshot(NULL, &now_queue_ns, NULL) < 0) return -1;
+    settle_pending_tempo(now_queue_ns);
+    double horizon = tick_at_queue_ns(now_queue_ns + tempo_map.lookahead_ns);
+
+    int queued = 0;
+    while (tempo_map.playing && (double)(tempo_map.cursor + tempo_map.offset) <= horizon) {
+        const struct map_song *song = &tempo_map.songs[tempo_map.song];
+        const struct map_segment *segs = &tempo_map.segments[song->first_segment];
+        const struct map_cue *cues = &tempo_map.cues[song->first_cue];
+        snd_seq_tick_time_t qtick = (snd_seq_tick_time_t)(tempo_map.cursor + tempo_map.offset);
+
+        /* cues on this tick act before its clock */
+        int jumped = 0;
+        while (tempo_map.next_cue < song->cue_count &&
+               cues[tempo_map.next_cue].tick <= tempo_map.cursor) {
+            uint32_t i = tempo_map.next_cue++;
+            const struct map_cue *cue = &cues[i];
+            if (cue->type == MAP_CUE_JUMP &&
+                (cue->repeat == 0 || tempo_map.jumps_taken[i] < cue->repeat)) {
+                tempo_map.jumps_taken[i]++;
+                tempo_map.offset = (long long)qtick - cue->target_tick;
+                map_seek(cue->target_tick);
+                jumped = 1;
+                break;
+            } else if (cue->type == MAP_CUE_START && cue->tick > 0) {
+                /* mid-song: carry on from the cue's position, not from the top */
+                schedule_songpos(cue->tick, qtick);
+                schedule_transport(SND_SEQ_EVENT_CONTINUE, qtick, NULL);
+            } else if (cue->type == MAP_CUE_STOP) {
+                schedule_transport(SND_SEQ_EVENT_STOP, qtick, NULL);
+                tempo_map.playing = 0;
+                break;
+            }
+        }
+        if (!tempo_map.playing) break;
+        if (jumped) continue;
+
+        if (tempo_map.cursor >= song->length_ticks) {
+            if ((song->flags & MAP_SONG_AUTO_NEXT) &&
+                (uint32_t)tempo_map.song + 1 < tempo_map.hdr->song_count) {
+                tempo_map.song++;
+                memset(tempo_map.jumps_taken, 0, sizeof(tempo_map.jumps_taken));
+                map_seek(0);
+                tempo_map.offset = qtick;
+                schedule_transport(SND_SEQ_EVENT_START, qtick, NULL);
+                continue;
+            }
+            schedule_transport(SND_SEQ_EVENT_STOP, qtick, NULL);
+            tempo_map.playing = 0;
+            break;
+        }
+
+        while (tempo_map.seg + 1 < song->segment_count &&
+               segs[tempo_map.seg].start_tick + segs[tempo_map.seg].length_ticks <= tempo_map.cursor)
+            tempo_map.seg++;
+        unsigned int us_per_beat = map_ramp_us_per_beat_at(&segs[tempo_map.seg], tempo_map.cursor);
+        if (us_per_beat != tempo_map.last_us_per_beat) {
+            /* a table full of short segments: the rest waits for the next
+               service, when the playhead has settled some of them */
+            if (pending_tempo_count == MAX_PENDING_TEMPO) break;
+            if (schedule_tempo_at(us_per_beat, qtick, NULL) < 0) return -1;
+            tempo_map.last_us_per_beat = us_per_beat;
+            /* the horizon moves with the tempo we just committed */
+            horizon = tick_at_queue_ns(now_queue_ns + tempo_map.lookahead_ns);
+        }
+
+        if (schedule_clock(qtick) < 0) {
+            fprintf(stderr, "Error enqueuing clock at tick %lu\n", (unsigned long)qtick);
+            return -1;
+        }
+        queued++;
+        tempo_map.cursor += CLOCK_STEP;
+        current_queue_tick = qtick + CLOCK_STEP;
+        if (current_queue_tick > max_scheduled_tick) max_scheduled_tick = current_queue_tick;
+    }
+    if (!tempo_map.playing) {
+        stop_armed = 1;
+        stop_tick = current_queue_tick;
+        mtc_stop(queue_ns_at_tick(current_queue_tick));
+        printf("[C] Tempo map stopped in song %d\n", tempo_map.song);
+    }
+    outputs_fill(current_queue_tick);
+    mtc_service();
+    snd_seq_drain_output(seq_handle);
+    return queued;
+}
+
+// Index of the song being played from the tempo map, -1 if none
+int midi_map_get_song(void) {
+    return tempo_map.playing ? tempo_map.song : -1;
+}
+
+/*
+ * Queue timer and audio clock
+ *
+ * The queue can run off the system timer, the high resolution timer or the
+ * period interrupts of a PCM device. The audio clock reader keeps a capture
+ * stream running (a PCM timer only ticks while its stream does) and fits
+ * the queue's real time against the sample clock to report their drift.
+ * Each period, the PCM's hardware position and the queue time are paired
+ * at the CLOCK_MONOTONIC instant the driver stamped the position with. The
+ * reader thread reads the queue through a sequencer handle of its own, so
+ * it never shares the engine's handle with the clock path.
+ */
+#define AUDIO_CHANNELS 2
+#define AUDIO_DRIFT_TAU_S 30.0   /* memory of the drift fit */
+#define AUDIO_MAX_PERIOD_FRAMES 8192
+
+enum queue_timer_source { QUEUE_TIMER_SYSTEM = 0, QUEUE_TIMER_HRTIMER = 1, QUEUE_TIMER_PCM = 2 };
+
+static struct {
+    snd_pcm_t *pcm;
+    snd_seq_t *seq;             /* the reader thread's own handle */
+    pthread_t thread;
+    volatile int running;
+    unsigned int rate;
+    unsigned int period_frames;
+    int16_t buffer[AUDIO_MAX_PERIOD_FRAMES * AUDIO_CHANNELS];
+
+    pthread_mutex_t lock;       /* guards the fit below */
+    int samples;
+    long long frames0, queue_ns0;
+    /* exponentially weighted least squares of y = queue - audio (us)
+       against x = audio time (s) */
+    double sw, sx, sy, sxx, sxy;
+    double last_x;
+    unsigned long xruns;
+} audio_clock = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+// Select the timer that drives the queue. For QUEUE_TIMER_PCM, card, device
+// and subdevice name a PCM timer (subdevice = substream * 2 + 1 for capture).
+// Must be called before the queue is started.
+// Returns 0 on success, -1 on error
+int midi_set_queue_timer(int source, int card, int device, int subdevice) {
+    if (seq_handle == NULL) {
+        fprintf(stderr, "Error: MIDI not initialized\n");
+        return -1;
+    }
+    if (queue_running) {
+        fprintf(stderr, "Error: queue timer must be selected before the queue starts\n");
+        return -1;
+    }
+
+    snd_timer_id_t *id;
+    snd_seq_queue_timer_t *timer;
+    snd_timer_id_alloca(&id);
+    snd_seq_queue_timer_alloca(&timer);
+
+    switch (source) {
+    case QUEUE_TIMER_SYSTEM:
+    case QUEUE_TIMER_HRTIMER:
+        snd_timer_id_set_class(id, SND_TIMER_CLASS_GLOBAL);
+        snd_timer_id_set_sclass(id, SND_TIMER_SCLASS_NONE);
+        snd_timer_id_set_card(id, -1);
+        snd_timer_id_set_device(id, source == QUEUE_TIMER_HRTIMER ? SND_TIMER_GLOBAL_HRTIMER
+                                                                  : SND_TIMER_GLOBAL_SYSTEM);
+        snd_timer_id_set_subdevice(id, 0);
+        break;
+    case QUEUE_TIMER_PCM:
+        snd_timer_id_set_class(id, SND_TIMER_CLASS_PCM);
+        snd_timer_id_set_sclass(id, SND_TIMER_SCLASS_NONE);
+        snd_timer_id_set_card(id, card);
+        snd_timer_id_set_device(id, device);
+        snd_timer_id_set_subdevice(id, subdevice);
+        break;
+    default:
+        fprintf(stderr, "Error: invalid queue timer source %d\n", source);
+        return -1;
+    }
+
+    int err = snd_seq_get_queue_timer(seq_handle, queue_id, timer);
+    if (err >= 0) {
+        snd_seq_queue_timer_set_type(timer, SND_SEQ_TIMER_ALSA);
+        snd_seq_queue_timer_set_id(timer, id);
+        err = snd_seq_set_queue_timer(seq_handle, queue_id, timer);
+    }
+    if (err < 0) {
+        fprintf(stderr, "Error setting queue timer: %s\n", snd_strerror(err));
+        return -1;
+    }
+    printf("[C] Queue timer: %s\n", (const char *[]){ "system", "hrtimer", "pcm" }[source]);
+    return 0;
+}
+
+// Add one (audio position, queue time) observation to the drift fit
+static void audio_clock_observe(long long frames, long long queue_ns) {
+    pthread_mutex_lock(&audio_clock.lock);
+    if (audio_clock.samples++ == 0) {
+        audio_clock.frames0 = frames;
+        audio_clock.queue_ns0 = queue_ns;
+    }
+    double x = (double)(frames - audio_clock.frames0) / audio_clock.rate;
+    double y = (queue_ns - audio_clock.queue_ns0) / 1000.0 - x * 1e6;
+    double forget = 1.0 - (x - audio_clock.last_x) / AUDIO_DRIFT_TAU_S;
+    if (forget < 0.0) forget = 0.0;
+    audio_clock.sw = audio_clock.sw * forget + 1.0;
+    audio_clock.sx = audio_clock.sx * forget + x;
+    audio_clock.sy = audio_clock.sy * forget + y;
+    audio_clock.sxx = audio_clock.sxx * forget + x * x;
+    audio_clock.sxy = audio_clock.sxy * forget + x * y;
+    audio_clock.last_x = x;
+    pthread_mutex_unlock(&audio_clock.lock);
+}
+
+// Keeps the capture stream running and samples both clocks once per period
+static void *audio_clock_thread(void *arg) {
+    RT_SECTION();
+    (void)arg;
+    long long frames = 0;
+    while (audio_clock.running) {
+        snd_pcm_sframes_t n = snd_pcm_readi(audio_clock.pcm, audio_clock.buffer,
+                                            audio_clock.period_frames);
+        if (n < 0) {
+            audio_clock.xruns++;
+            if (snd_pcm_recover(audio_clock.pcm, (int)n, 1) < 0) {
+                fprintf(stderr, "Error reading audio clock: %s\n", snd_strerror((int)n));
+                break;
+            }
+            /* the stream restarted: the fit starts over */
+            pthread_mutex_lock(&audio_clock.lock);
+            audio_clock.samples = 0;
+            audio_clock.sw = audio_clock.sx = audio_clock.sy = 0.0;
+            audio_clock.sxx = audio_clock.sxy = audio_clock.last_x = 0.0;
+            pthread_mutex_unlock(&audio_clock.lock);
+            frames = 0;
+            continue;
+        }
+        frames += n;
+
+        /* hardware position = what we have read + what is waiting, as of
+           the driver's timestamp; the queue time is taken back to it */
+        snd_pcm_uframes_t avail = 0;
+        snd_htimestamp_t ts;
+        if (snd_pcm_htimestamp(audio_clock.pcm, &avail, &ts) < 0) continue;
+        long long queue_ns, mono_ns;
+        if (!queue_running || queue_snapshot_on(audio_clock.seq, NULL, &queue_ns, &mono_ns) < 0) continue;
+        long long ts_ns = (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+        if (ts_ns > 0 && ts_ns <= mono_ns) queue_ns -= mono_ns - ts_ns;
+        audio_clock_observe(frames + (long long)avail, queue_ns);
+    }
+    return NULL;
+}
+
+// Open a capture PCM as the reference audio clock. Its drift against the
+// queue is measured from then on. With lock set, the queue is also driven
+// by the PCM's period timer so it cannot drift from the audio clock; this
+// must happen before the queue starts.
+// Returns 0 on success, -1 on error
+int midi_audio_clock_open(const char *pcm_name, unsigned int rate, unsigned int period_frames, int lock) {
+    if (seq_handle == NULL) {
+        fprintf(stderr, "Error: MIDI not initialized\n");
+        return -1;
+    }
+    if (audio_clock.pcm != NULL) {
+        fprintf(stderr, "Error: audio clock already open\n");
+        return -1;
+    }
+    if (rate == 0 || period_frames == 0 || period_frames > AUDIO_MAX_PERIOD_FRAMES) {
+        fprintf(stderr, "Error: invalid audio clock rate %u / period %u\n", rate, period_frames);
+        return -1;
+    }
+
+    int err = snd_pcm_open(&audio_clock.pcm, pcm_name, SND_PCM_STREAM_CAPTURE, 0);
+    if (err < 0) {
+        fprintf(stderr, "Error opening PCM %s: %s\n", pcm_name, snd_strerror(err));
+        audio_clock.pcm = NULL;
+        return -1;
+    }
+    unsigned int latency_us = (unsigned int)(4ULL * period_frames * 1000000ULL / rate);
+    err = snd_pcm_set_params(audio_clock.pcm, SND_PCM_FORMAT_S16_LE, SND_PCM_ACCESS_RW_INTERLEAVED,
+                             AUDIO_CHANNELS, rate, 0, latency_us);
+    if (err >= 0) {
+        /* stamp the hardware position on CLOCK_MONOTONIC, like monotonic_ns() */
+        snd_pcm_sw_params_t *sw;
+        snd_pcm_sw_params_alloca(&sw);
+        err = snd_pcm_sw_params_current(audio_clock.pcm, sw);
+        if (err >= 0) err = snd_pcm_sw_params_set_tstamp_mode(audio_clock.pcm, sw, SND_PCM_TSTAMP_ENABLE);
+        if (err >= 0) err = snd_pcm_sw_params_set_tstamp_type(audio_clock.pcm, sw, SND_PCM_TSTAMP_TYPE_MONOTONIC);
+        if (err >= 0) err = snd_pcm_sw_params(audio_clock.pcm, sw);
+    }
+    if (err < 0) {
+        fprintf(stderr, "Error configuring PCM %s: %s\n", pcm_name, snd_strerror(err));
+        snd_pcm_close(audio_clock.pcm);
+        audio_clock.pcm = NULL;
+        return -1;
+    }
+
+    if (lock) {
+        snd_pcm_info_t *info;
+        snd_pcm_info_alloca(&info);
+        err = snd_pcm_info(audio_clock.pcm, info);
+        if (err < 0 ||
+            midi_set_queue_timer(QUEUE_TIMER_PCM, snd_pcm_info_get_card(info),
+                                 (int)snd_pcm_info_get_device(info),
+                                 (int)(snd_pcm_info_get_subdevice(info) << 1) | SND_PCM_STREAM_CAPTURE) < 0) {
+            fprintf(stderr, "Error: cannot lock the queue to PCM %s\n", pcm_name);
+            snd_pcm_close(audio_clock.pcm);
+            audio_clock.pcm = NULL;
+            return -1;
+        }
+    }
+
+    err = snd_seq_open(&audio_clock.seq, "default", SND_SEQ_OPEN_OUTPUT, 0);
+    if (err < 0) {
+        fprintf(stderr, "Error opening sequencer for the audio clock: %s\n", snd_strerror(err));
+        snd_pcm_close(audio_clock.pcm);
+        audio_clock.pcm = NULL;
+        audio_clock.seq = NULL;
+        return -1;
+    }
+    snd_seq_set_client_name(audio_clock.seq, "Python MIDI Clock (audio clock)");
+
+    audio_clock.rate = rate;
+    audio_clock.period_frames = period_frames;
+    audio_clock.samples = 0;
+    audio_clock.sw = audio_clock.sx = audio_clock.sy = 0.0;
+    audio_clock.sxx = audio_clock.sxy = audio_clock.last_x = 0.0;
+    audio_clock.xruns = 0;
+    audio_clock.running = 1;
+    if (pthread_create(&audio_clock.thread, NULL, audio_clock_thread, NULL) != 0) {
+        fprintf(stderr, "Error starting audio clock thread\n");
+        audio_clock.running = 0;
+        snd_seq_close(audio_clock.seq);
+        audio_clock.seq = NULL;
+        snd_pcm_close(audio_clock.pcm);
+        audio_clock.pcm = NULL;
+        return -1;
+    }
+
+    printf("[C] Audio clock %s at %u Hz, period %u frames%s\n",
+           pcm_name, rate, period_frames, lock ? ", queue locked to it" : "");
+    return 0;
+}
+
+// Stop reading the audio clock and close its PCM
+void midi_audio_clock_close(void) {
+    if (audio_clock.pcm == NULL) return;
+    audio_clock.running = 0;
+    pthread_join(audio_clock.thread, NULL);
+    snd_seq_close(audio_clock.seq);
+    audio_clock.seq = NULL;
+    snd_pcm_close(audio_clock.pcm);
+    audio_clock.pcm = NULL;
+}
+
+// Drift of the queue timer against the audio clock in parts per million
+// (positive: the queue runs fast) and the accumulated offset in ms since the
+// audio clock was opened. Returns 0 when available, -1 before enough samples.
+int midi_audio_clock_drift(double *ppm, double *offset_ms) {
+    RT_SECTION();
+    int ok = -1;
+    pthread_mutex_lock(&audio_clock.lock);
+    double det = audio_clock.sw * audio_clock.sxx - audio_clock.sx * audio_clock.sx;
+    if (audio_clock.samples > 16 && det > 0.0) {
+        double slope = (audio_clock.sw * audio_clock.sxy - audio_clock.sx * audio_clock.sy) / det;
+        double intercept = (audio_clock.sy - slope * audio_clock.sx) / audio_clock.sw;
+        if (ppm) *ppm = slope;
+        if (offset_ms) *offset_ms = (intercept + slope * audio_clock.last_x) / 1000.0;
+        ok = 0;
+    }
+    pthread_mutex_unlock(&audio_clock.lock);
+    return ok;
+}
+
+/*
+ * Reclocker
+ *
+ * Clock received on an input port is run through an alpha-beta filter that
+ * tracks the upstream period and phase. Each input clock is re-emitted on
+ * the main port at its filtered time plus a fixed delay (the lookahead),
+ * stamped on the queue's real-time axis. When input stops, the filter's
+ * prediction keeps the output going (flywheel) for a bounded time.
+ */
+#define RECLOCK_ALPHA 0.10          /* phase correction per input clock */
+#define RECLOCK_BETA 0.005          /* period correction per input clock */
+#define RECLOCK_JITTER_WEIGHT 0.01  /* smoothing of the jitter statistics */
+#define RECLOCK_MIN_PERIOD_NS (60e9 / (PPQN * 400.0))
+#define RECLOCK_MAX_PERIOD_NS (60e9 / (PPQN * 20.0))
+
+static struct {
+    int enabled;
+    int emit;                   /* re-emit, or only track (tempo source) */
+    int in_port;
+    long long delay_ns;         /* output = filtered input time + delay */
+    long long flywheel_ns;      /* how long to keep going without input */
+
+    int have_period;
+    double period_ns;
+    double phase_ns;            /* filtered time of input clock `index` */
+    long long index;            /* -1: waiting for the first clock of a run */
+    int from_start;             /* run began with START: clock 0 is beat 0 */
+    long long out_next;         /* index of the next clock to emit */
+    long long last_input_ns;
+    double last_out_ns;
+
+    /* exponentially weighted interval statistics, for jitter reporting */
+    double in_mean, in_var, last_in_ns;
+    double out_mean, out_var;
+    unsigned long clocks_in, clocks_out, dropped, flywheeled;
+} reclock = { .in_port = -1 };
+
+// Create an input port whose events are stamped with our queue's real time
+// on arrival
+// Returns the port id, or a negative error code
+static int create_input_port(const char *name) {
+    snd_seq_port_info_t *info;
+    snd_seq_port_info_alloca(&info);
+    snd_seq_port_info_set_name(info, name);
+    snd_seq_port_info_set_capability(info, SND_SEQ_PORT_CAP_WRITE | SND_SEQ_PORT_CAP_SUBS_WRITE);
+    snd_seq_port_info_set_type(info, SND_SEQ_PORT_TYPE_MIDI_GENERIC | SND_SEQ_PORT_TYPE_APPLICATION);
+    snd_seq_port_info_set_timestamping(info, 1);
+    snd_seq_port_info_set_timestamp_real(info, 1);
+    snd_seq_port_info_set_timestamp_queue(info, queue_id);
+    int err = snd_seq_create_port(seq_handle, info);
+    if (err < 0) return err;
+    return snd_seq_port_info_get_port(info);
+}
+
+static long long event_queue_ns(const snd_seq_event_t *ev) {
+    return (long long)ev->time.time.tv_sec * 1000000000LL + ev->time.time.tv_nsec;
+}
+
+// Update a weighted mean/variance pair with one interval
+static void reclock_interval_stat(double *mean, double *var, double interval) {
+    if (*mean == 0.0) {
+        *mean = interval;
+        return;
+    }
+    double d = interval - *mean;
+    *mean += RECLOCK_JITTER_WEIGHT * d;
+    *var = (1.0 - RECLOCK_JITTER_WEIGHT) * (*var + RECLOCK_JITTER_WEIGHT * d * d);
+}
+
+// Enqueue a realtime message on the main port at a queue real time (not drained)
+static int reclock_emit(int type, double queue_ns) {
+    snd_seq_event_t ev;
+    snd_seq_real_time_t rt = queue_real_time((long long)queue_ns);
+    snd_seq_ev_clear(&ev);
+    snd_seq_ev_set_source(&ev, port_id);
+    snd_seq_ev_set_subs(&ev);
+    ev.type = type;
+    snd_seq_ev_schedule_real(&ev, queue_id, 0, &rt);
+    return snd_seq_event_output(seq_handle, &ev);
+}
+
+// Feed one received clock into the filter
+static void reclock_input_clock(long long t) {
+    reclock.clocks_in++;
+    /* input resuming after the flywheel ran out starts a new run at its own
+       phase, instead of catching up on the clocks of the gap all at once */
+    if (reclock.emit && reclock.index >= 0 && t - reclock.last_input_ns > reclock.flywheel_ns) {
+        reclock.index = -1;
+        reclock.from_start = 0;
+    }
+    if (reclock.index < 0) {
+        reclock.phase_ns = (double)t;
+        reclock.index = 0;
+        reclock.out_next = 0;
+        reclock.last_in_ns = (double)t;
+    } else if (!reclock.have_period) {
+        double period = t - reclock.phase_ns;
+        if (period >= RECLOCK_MIN_PERIOD_NS && period <= RECLOCK_MAX_PERIOD_NS) {
+            reclock.period_ns = period;
+            reclock.have_period = 1;
+        }
+        reclock.phase_ns = (double)t;
+        reclock.index++;
+    } else {
+        /* whole periods since the last clock; more than one means upstream
+           dropped clocks, which the flywheel has already covered */
+        long long m = (long long)((t - reclock.phase_ns) / reclock.period_ns + 0.5);
+        if (m < 1) m = 1;
+        reclock.dropped += m - 1;
+        double predicted = reclock.phase_ns + m * reclock.period_ns;
+        double error = t - predicted;
+        reclock.phase_ns = predicted + RECLOCK_ALPHA * error;
+        reclock.period_ns += RECLOCK_BETA * error / m;
+        if (reclock.period_ns < RECLOCK_MIN_PERIOD_NS) reclock.period_ns = RECLOCK_MIN_PERIOD_NS;
+        if (reclock.period_ns > RECLOCK_MAX_PERIOD_NS) reclock.period_ns = RECLOCK_MAX_PERIOD_NS;
+        reclock.index += m;
+        if (m == 1) reclock_interval_stat(&reclock.in_mean, &reclock.in_var, t - reclock.last_in_ns);
+    }
+    reclock.last_in_ns = (double)t;
+    reclock.last_input_ns = t;
+}
+
+// Start reclocking: clock, START, STOP and CONTINUE arriving on a new
+// "Clock In" port are re-emitted, cleaned up, on the main port lookahead_ms
+// later. Without input the output keeps running for up to flywheel_ms.
+// Returns the input port id on success, -1 on error
+int midi_reclock_enable(int lookahead_ms, int flywheel_ms) {
+    if (seq_handle == NULL) {
+        fprintf(stderr, "Error: MIDI not initialized\n");
+        return -1;
+    }
+    if (direct.enabled) return direct_refuse("the reclocker");
+    if (lookahead_ms <= 0 || flywheel_ms < 0) {
+        fprintf(stderr, "Error: invalid lookahead %d ms / flywheel %d ms\n", lookahead_ms, flywheel_ms);
+        return -1;
+    }
+    if (reclock.in_port < 0) {
+        reclock.in_port = create_input_port("Clock In");
+        if (reclock.in_port < 0) {
+            fprintf(stderr, "Error creating input port: %s\n", snd_strerror(reclock.in_port));
+            return -1;
+        }
+    }
+    int in_port = reclock.in_port;
+    memset(&reclock, 0, sizeof(reclock));
+    reclock.in_port = in_port;
+    reclock.delay_ns = lookahead_ms * 1000000LL;
+    reclock.flywheel_ns = flywheel_ms * 1000000LL;
+    reclock.index = -1;
+    reclock.enabled = 1;
+    reclock.emit = 1;
+    ensure_queue_running();
+
+    printf("[C] Reclocking from port %d: delay %d ms, flywheel %d ms\n",
+           reclock.in_port, lookahead_ms, flywheel_ms);
+    return reclock.in_port;
+}
+
+// Handle one input event addressed to the reclock port
+static void reclock_input(const snd_seq_event_t *ev) {
+    long long t = event_queue_ns(ev);
+    switch (ev->type) {
+    case SND_SEQ_EVENT_CLOCK:
+        reclock_input_clock(t);
+        break;
+    case SND_SEQ_EVENT_START:
+    case SND_SEQ_EVENT_CONTINUE:
+        /* the next clock begins a new run at its own phase */
+        if (reclock.emit) {
+            retract_events_after_ns(SND_SEQ_EVENT_CLOCK, 0, t + reclock.delay_ns);
+            reclock_emit(ev->type, (double)(t + reclock.delay_ns));
+        }
+        reclock.index = -1;
+        reclock.from_start = ev->type == SND_SEQ_EVENT_START;
+        reclock.last_out_ns = 0.0;
+        reclock.last_input_ns = t;
+        break;
+    case SND_SEQ_EVENT_STOP:
+        if (reclock.emit) {
+            retract_events_after_ns(SND_SEQ_EVENT_CLOCK, 0, t + reclock.delay_ns);
+            reclock_emit(SND_SEQ_EVENT_STOP, (double)(t + reclock.delay_ns));
+        }
+        /* clocks that keep coming after STOP are still forwarded */
+        reclock.index = -1;
+        reclock.from_start = 0;
+        break;
+    default:
+        break;
+    }
+}
+
+static void standby_input(const snd_seq_event_t *ev);
+static int merge_input(const snd_seq_event_t *ev);
+
+// Dispatch every pending input event to the port it arrived on. The handle
+// is nonblocking: this returns as soon as nothing is left (-EAGAIN).
+static void poll_input(void) {
+    snd_seq_event_t *ev;
+    for (;;) {
+        int err = snd_seq_event_input(seq_handle, &ev);
+        if (err == -ENOSPC) continue;   /* the kernel's input overran; read on */
+        if (err < 0 || ev == NULL) break;
+        if (reclock.enabled && ev->dest.port == reclock.in_port) reclock_input(ev);
+        else if (!merge_input(ev) && !route_input(ev)) standby_input(ev);
+    }
+}
+
+// Read pending input and queue clean clocks up to the lookahead horizon.
+// Call at least a few times per clock period.
+// Returns the number of clocks queued, -1 on error
+int midi_reclock_service(void) {
+    RT_SECTION();
+    if (!reclock.enabled || seq_handle == NULL) return 0;
+
+    poll_input();
+
+    long long now_queue_ns;
+    if (queue_snapshot(NULL, &now_queue_ns, NULL) < 0) return -1;
+    if (!reclock.emit || reclock.index < 0) {
+        snd_seq_drain_output(seq_handle);
+        return 0;
+    }
+
+    int queued = 0;
+    double horizon = (double)(now_queue_ns + reclock.delay_ns);
+    for (;;) {
+        double period = reclock.have_period ? reclock.period_ns : 0.0;
+        if (reclock.out_next > reclock.index && !reclock.have_period) break;
+        double t = reclock.phase_ns + (reclock.out_next - reclock.index) * period + reclock.delay_ns;
+        if (t > horizon) break;
+        /* flywheel only so far past the last real input */
+        if (reclock.out_next > reclock.index &&
+            t - reclock.delay_ns > reclock.last_input_ns + reclock.flywheel_ns) break;
+        /* filter corrections must never bunch clocks up */
+        if (reclock.last_out_ns > 0.0 && t < reclock.last_out_ns + period / 2)
+            t = reclock.last_out_ns + period / 2;
+
+        if (reclock_emit(SND_SEQ_EVENT_CLOCK, t) < 0) {
+            fprintf(stderr, "Error enqueuing reclocked clock\n");
+            return -1;
+        }
+        if (reclock.last_out_ns > 0.0)
+            reclock_interval_stat(&reclock.out_mean, &reclock.out_var, t - reclock.last_out_ns);
+        if (reclock.out_next > reclock.index) reclock.flywheeled++;
+        reclock.last_out_ns = t;
+        reclock.out_next++;
+        reclock.clocks_out++;
+        queued++;
+    }
+    snd_seq_drain_output(seq_handle);
+    return queued;
+}
+
+// Reclocker statistics: input and output interval jitter (standard
+// deviation, us), tracked tempo, and clocks dropped upstream / bridged by
+// the flywheel. Any pointer may be NULL.
+// Returns 0 on success, -1 if reclocking is off
+int midi_reclock_stats(double *in_jitter_us, double *out_jitter_us, double *bpm,
+                       unsigned long *dropped, unsigned long *flywheeled) {
+    if (!reclock.enabled) return -1;
+    if (in_jitter_us) *in_jitter_us = sqrt(reclock.in_var) / 1000.0;
+    if (out_jitter_us) *out_jitter_us = sqrt(reclock.out_var) / 1000.0;
+    if (bpm) *bpm = reclock.have_period ? 60e9 / (PPQN * reclock.period_ns) : 0.0;
+    if (dropped) *dropped = reclock.dropped;
+    if (flywheeled) *flywheeled = reclock.flywheeled;
+    return 0;
+}
+
+/*
+ * Audio beat tracker
+ *
+ * Audio from a capture PCM (or a WAV file) is mixed to mono and cut into
+ * overlapping frames. The onset strength of each frame is the spectral flux
+ * of its log-compressed magnitude spectrum, with the local mean removed.
+ * Every few hops the tempo is taken from the autocorrelation of the last
+ * few seconds of onset strength, weighted towards 120 BPM, and the beat
+ * phase from a comb over the same window; both are smoothed against the
+ * running prediction. The result is offered to the tempo source arbitration
+ * like a Link session: tempo and beat position at a CLOCK_MONOTONIC time.
+ */
+#define BEAT_FRAME 1024             /* FFT size */
+#define BEAT_HOP 256
+#define BEAT_RING 2048              /* onset strength history, power of two */
+#define BEAT_WINDOW 1024            /* hops analysed for tempo and phase */
+#define BEAT_MEAN_HOPS 32           /* local mean removed from the flux */
+#define BEAT_ANALYSE_EVERY 32       /* hops between tempo/phase updates */
+#define BEAT_MIN_BPM 60.0
+#define BEAT_MAX_BPM 200.0
+#define BEAT_PRIOR_BPM 120.0
+#define BEAT_PRIOR_OCTAVES 0.9      /* width of the tempo prior */
+#define BEAT_TEMPO_TOLERANCE 0.08   /* estimates this close refine the tempo */
+#define BEAT_TEMPO_SWITCH 3         /* estimates that must agree to change it */
+#define BEAT_PHASE_GAIN 0.25
+#define BEAT_LOW_HZ 250.0           /* low band (kick, bass) ends here */
+#define BEAT_HIGH_WEIGHT 0.5        /* weight of the high band's mean flux */
+#define BEAT_OUT_RING 256
+#define BEAT_STALE_NS 1000000000LL
+#define BEAT_MAX_CHANNELS 8         /* of a WAV file */
+
+typedef float v4sf __attribute__((vector_size(16)));
+typedef int32_t v4si __attribute__((vector_size(16)));
+
+struct beat_event {
+    double time_s;                  /* stream time of the beat */
+    double detected_s;              /* stream time it was reported at */
+    double bpm;
+};
+
+static struct {
+    pthread_t thread;
+    volatile int running;
+    volatile int finished;          /* the file has been read to its end */
+    snd_pcm_t *pcm;
+    FILE *wav;
+    char wav_buffer[BUFSIZ];
+    int channels;
+    int realtime;
+    unsigned int rate;
+    int16_t input[BEAT_HOP * BEAT_MAX_CHANNELS];
+
+    /* analysis state, owned by the thread */
+    float window[BEAT_FRAME], cos_table[BEAT_FRAME / 2], sin_table[BEAT_FRAME / 2];
+    float band_weight[BEAT_FRAME / 2];
+    float re[BEAT_FRAME], im[BEAT_FRAME], log_mag[BEAT_FRAME / 2], prev_log_mag[BEAT_FRAME / 2];
+    float ring[BEAT_RING];
+    float flux_hist[BEAT_MEAN_HOPS];
+    float linear[BEAT_WINDOW];      /* unwrapped analysis window */
+    float frame[BEAT_FRAME];
+    long long hops;
+    double last_emitted_s;
+    int disagree;
+    double candidate_period;
+
+    pthread_mutex_t lock;           /* guards everything below */
+    double period_s;                /* 0 until the first estimate */
+    double ref_s;                   /* stream time of beat number ref_beat */
+    double ref_beat;
+    double confidence;
+    long long mono_at_zero_ns;      /* CLOCK_MONOTONIC of stream time 0 */
+    long long updated_mono_ns;
+    struct beat_event out[BEAT_OUT_RING];
+    unsigned int out_head, out_tail;
+    unsigned long out_dropped;      /* beats lost to a full ring */
+    double process_us_sum, process_us_max;
+    unsigned long processed;
+} beat = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static float dot4(const float *a, const float *b, int n) {
+    v4sf acc = { 0.0f, 0.0f, 0.0f, 0.0f };
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        v4sf x, y;
+        memcpy(&x, a + i, sizeof(x));
+        memcpy(&y, b + i, sizeof(y));
+        acc += x * y;
+    }
+    float sum = acc[0] + acc[1] + acc[2] + acc[3];
+    for (; i < n; i++) sum += a[i] * b[i];
+    return sum;
+}
+
+// In-place radix-2 FFT of beat.re/beat.im (BEAT_FRAME points)
+static void beat_fft(void) {
+    float *re = beat.re, *im = beat.im;
+    for (int i = 1, j = 0; i < BEAT_FRAME; i++) {
+        int bit = BEAT_FRAME >> 1;
+        for (; j & bit; bit >>= 1) j ^= bit;
+        j |= bit;
+        if (i < j) {
+            float t = re[i]; re[i] = re[j]; re[j] = t;
+            t = im[i]; im[i] = im[j]; im[j] = t;
+        }
+    }
+    for (int len = 2; len <= BEAT_FRAME; len <<= 1) {
+        int step = BEAT_FRAME / len;
+        for (int i = 0; i < BEAT_FRAME; i += len) {
+            for (int k = 0; k < len / 2; k++) {
+                float wr = beat.cos_table[k * step], wi = -beat.sin_table[k * step];
+                float *ar = &re[i + k], *ai = &im[i + k];
+                float *br = &re[i + k + len / 2], *bi = &im[i + k + len / 2];
+                float tr = *br * wr - *bi * wi, ti = *br * wi + *bi * wr;
+                *br = *ar - tr; *bi = *ai - ti;
+                *ar += tr; *ai += ti;
+            }
+        }
+    }
+}
+
+// Onset strength of the current frame: rectified spectral flux of the log
+// magnitude, the low band (kick, bass) weighing most, minus its recent mean
+static float beat_onset(void) {
+    const int bins = BEAT_FRAME / 2;
+    for (int i = 0; i < BEAT_FRAME; i++) {
+        beat.re[i] = beat.frame[i] * beat.window[i];
+        beat.im[i] = 0.0f;
+    }
+    beat_fft();
+    for (int k = 0; k < bins; k++)
+        beat.log_mag[k] = log1pf(100.0f * sqrtf(beat.re[k] * beat.re[k] + beat.im[k] * beat.im[k]));
+
+    v4sf flux4 = { 0.0f, 0.0f, 0.0f, 0.0f };
+    const v4sf zero = flux4;
+    for (int k = 0; k < bins; k += 4) {
+        v4sf now, before, weight;
+        memcpy(&now, beat.log_mag + k, sizeof(now));
+        memcpy(&before, beat.prev_log_mag + k, sizeof(before));
+        memcpy(&weight, beat.band_weight + k, sizeof(weight));
+        v4sf d = now - before;
+        flux4 += weight * (v4sf)((v4si)d & (d > zero));
+    }
+    memcpy(beat.prev_log_mag, beat.log_mag, bins * sizeof(float));
+    float flux = flux4[0] + flux4[1] + flux4[2] + flux4[3];
+
+    float mean = 0.0f;
+    beat.flux_hist[beat.hops % BEAT_MEAN_HOPS] = flux;
+    for (int i = 0; i < BEAT_MEAN_HOPS; i++) mean += beat.flux_hist[i];
+    mean /= BEAT_MEAN_HOPS;
+    return flux > mean ? flux - mean : 0.0f;
+}
+
+// Tempo and phase from the last BEAT_WINDOW onset values
+static void beat_analyse(double now_s) {
+    const double hop_s = (double)BEAT_HOP / beat.rate;
+    float *x = beat.linear;
+    for (int i = 0; i < BEAT_WINDOW; i++)
+        x[i] = beat.ring[(beat.hops - BEAT_WINDOW + i) & (BEAT_RING - 1)];
+
+    /* autocorrelation over the lags of the tempo range, with a log-normal
+       prior around BEAT_PRIOR_BPM */
+    int min_lag = (int)(60.0 / BEAT_MAX_BPM / hop_s);
+    int max_lag = (int)(60.0 / BEAT_MIN_BPM / hop_s) + 1;
+    float energy = dot4(x, x, BEAT_WINDOW);
+    if (energy <= 0.0f) return;
+    double acf[max_lag + 2];
+    double best = 0.0, sum = 0.0;
+    int best_lag = 0;
+    for (int lag = min_lag - 1; lag <= max_lag + 1; lag++)
+        acf[lag - min_lag + 1] = dot4(x, x + lag, BEAT_WINDOW - lag) / energy;
+    for (int lag = min_lag; lag <= max_lag; lag++) {
+        double octaves = log2(60.0 / (lag * hop_s) / BEAT_PRIOR_BPM);
+        double w = acf[lag - min_lag + 1] *
+                   exp(-0.5 * octaves * octaves / (BEAT_PRIOR_OCTAVES * BEAT_PRIOR_OCTAVES));
+        sum += w;
+        if (w > best) {
+            best = w;
+            best_lag = lag;
+        }
+    }
+    if (best_lag == 0) return;
+    double contrast = 1.0 - sum / (max_lag - min_lag + 1) / best;
+
+    /* parabolic interpolation of the raw peak */
+    double a = acf[best_lag - min_lag], b = acf[best_lag - min_lag + 1], c = acf[best_lag - min_lag + 2];
+    double shift = a - 2 * b + c < 0.0 ? 0.5 * (a - c) / (a - 2 * b + c) : 0.0;
+    double period = (best_lag + shift) * hop_s;
+
+    pthread_mutex_lock(&beat.lock);
+    double current = beat.period_s;
+    pthread_mutex_unlock(&beat.lock);
+    if (current > 0.0 && fabs(period / current - 1.0) > BEAT_TEMPO_TOLERANCE) {
+        /* a different tempo has to be seen a few times in a row */
+        if (beat.disagree > 0 && fabs(period / beat.candidate_period - 1.0) <= BEAT_TEMPO_TOLERANCE)
+            beat.disagree++;
+        else
+            beat.disagree = 1;
+        beat.candidate_period = period;
+        if (beat.disagree < BEAT_TEMPO_SWITCH) period = current;
+        else current = 0.0;
+    } else {
+        beat.disagree = 0;
+    }
+    if (current > 0.0) period = 0.7 * current + 0.3 * period;
+
+    /* comb over the window: the phase whose beats collect the most onset
+       strength, recent beats weighing more */
+    double p_hops = period / hop_s;
+    int phases = (int)p_hops;
+    double best_score = -1.0;
+    int best_phase = 0;
+    for (int phase = 0; phase < phases; phase++) {
+        double score = 0.0, weight = 1.0;
+        for (double pos = BEAT_WINDOW - 1 - phase; pos >= 0.0; pos -= p_hops, weight *= 0.9)
+            score += weight * x[(int)(pos + 0.5)];
+        if (score > best_score) {
+            best_score = score;
+            best_phase = phase;
+        }
+    }
+    /* onset values sit at frame centres */
+    double last_beat_s = now_s - (best_phase + 0.5) * hop_s - 0.5 * BEAT_FRAME / (double)beat.rate;
+
+    pthread_mutex_lock(&beat.lock);
+    if (current > 0.0) {
+        double n = floor((last_beat_s - beat.ref_s) / period + 0.5);
+        double predicted = beat.ref_s + n * period;
+        beat.ref_beat += n;
+        beat.ref_s = predicted + BEAT_PHASE_GAIN * (last_beat_s - predicted);
+    } else {
+        /* (re)acquired: start counting from this beat */
+        beat.ref_s = last_beat_s;
+        if (beat.last_emitted_s < last_beat_s - 0.5 * period) beat.last_emitted_s = last_beat_s - 0.5 * period;
+    }
+    beat.period_s = period;
+    beat.confidence = contrast < 0.0 ? 0.0 : contrast;
+    beat.updated_mono_ns = monotonic_ns();
+    pthread_mutex_unlock(&beat.lock);
+}
+
+// Report the beats the stream has passed
+static void beat_emit(double now_s) {
+    pthread_mutex_lock(&beat.lock);
+    double period = beat.period_s;
+    while (period > 0.0) {
+        double k = ceil((beat.last_emitted_s + 0.5 * period - beat.ref_s) / period);
+        double t = beat.ref_s + k * period;
+        if (t > now_s) break;
+        beat.last_emitted_s = t;
+        if (beat.out_head - beat.out_tail < BEAT_OUT_RING) {
+            struct beat_event *e = &beat.out[beat.out_head++ % BEAT_OUT_RING];
+            e->time_s = t;
+            e->detected_s = now_s;
+            e->bpm = 60.0 / period;
+        } else {
+            beat.out_dropped++;
+        }
+    }
+    pthread_mutex_unlock(&beat.lock);
+}
+
+// Read one hop of audio into the end of the frame
+// Returns the number of frames read (< BEAT_HOP only at the end of a file),
+// or -1 on error
+static int beat_read(long long *end_mono_ns) {
+    int n;
+    if (beat.wav) {
+        n = (int)fread(beat.input, (size_t)beat.channels * sizeof(int16_t), BEAT_HOP, beat.wav);
+        if (beat.realtime) {
+            struct timespec ts;
+            long long due = beat.mono_at_zero_ns +
+                            (long long)((beat.hops + 1) * BEAT_HOP * 1e9 / beat.rate);
+            ts.tv_sec = due / 1000000000LL;
+            ts.tv_nsec = due % 1000000000LL;
+            clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+        }
+        *end_mono_ns = beat.mono_at_zero_ns + (long long)((beat.hops + 1) * BEAT_HOP * 1e9 / beat.rate);
+    } else {
+        snd_pcm_sframes_t got = snd_pcm_readi(beat.pcm, beat.input, BEAT_HOP);
+        if (got < 0) {
+            if (snd_pcm_recover(beat.pcm, (int)got, 1) < 0) {
+                fprintf(stderr, "Error reading beat tracker audio: %s\n", snd_strerror((int)got));
+                return -1;
+            }
+            got = 0;
+        }
+        n = (int)got;
+        /* the last frame read is as old as what is still waiting behind it */
+        snd_pcm_sframes_t delay = 0;
+        if (snd_pcm_delay(beat.pcm, &delay) < 0) delay = 0;
+        *end_mono_ns = monotonic_ns() - (long long)(delay * 1e9 / beat.rate);
+    }
+    memmove(beat.frame, beat.frame + BEAT_HOP, (BEAT_FRAME - BEAT_HOP) * sizeof(float));
+    float *dst = beat.frame + BEAT_FRAME - BEAT_HOP;
+    for (int i = 0; i < BEAT_HOP; i++) {
+        int sum = 0;
+        for (int c = 0; i < n && c < beat.channels; c++) sum += beat.input[i * beat.channels + c];
+        dst[i] = sum / (32768.0f * beat.channels);
+    }
+    return n;
+}
+
+static void *beat_thread(void *arg) {
+    RT_SECTION();
+    (void)arg;
+    while (beat.running) {
+        long long end_mono_ns;
+        int n = beat_read(&end_mono_ns);
+        if (n < 0 || (n == 0 && beat.wav)) {
+            pthread_mutex_lock(&beat.lock);
+            beat.finished = 1;
+            pthread_mutex_unlock(&beat.lock);
+            break;
+        }
+        if (n == 0) continue;
+
+        long long t0 = monotonic_ns();
+        double now_s = (double)(beat.hops + 1) * BEAT_HOP / beat.rate;
+        if (!beat.wav) {
+            pthread_mutex_lock(&beat.lock);
+            beat.mono_at_zero_ns = end_mono_ns - (long long)(now_s * 1e9);
+            pthread_mutex_unlock(&beat.lock);
+        }
+        beat.ring[beat.hops & (BEAT_RING - 1)] = beat_onset();
+        beat.hops++;
+        /* the history starts out as silence, so half a window is enough */
+        if (beat.hops >= BEAT_WINDOW / 2 && beat.hops % BEAT_ANALYSE_EVERY == 0) beat_analyse(now_s);
+        beat_emit(now_s);
+
+        double us = (monotonic_ns() - t0) / 1000.0;
+        pthread_mutex_lock(&beat.lock);
+        beat.process_us_sum += us;
+        if (us > beat.process_us_max) beat.process_us_max = us;
+        beat.processed++;
+        pthread_mutex_unlock(&beat.lock);
+    }
+    return NULL;
+}
+
+// Open a 16-bit PCM WAV file, leaving it positioned at the samples
+// Returns 0 on success, -1 on error
+static int beat_open_wav(const char *path) {
+    beat.wav = fopen(path, "rb");
+    if (beat.wav == NULL) {
+        perror("Error opening WAV file");
+        return -1;
+    }
+    setvbuf(beat.wav, beat.wav_buffer, _IOFBF, sizeof(beat.wav_buffer));
+    unsigned char hdr[12], chunk[8], fmt[16];
+    int have_fmt = 0;
+    if (fread(hdr, 1, 12, beat.wav) != 12 || memcmp(hdr, "RIFF", 4) || memcmp(hdr + 8, "WAVE", 4))
+        goto bad;
+    while (fread(chunk, 1, 8, beat.wav) == 8) {
+        uint32_t size = chunk[4] | chunk[5] << 8 | chunk[6] << 16 | (uint32_t)chunk[7] << 24;
+        if (!memcmp(chunk, "fmt ", 4) && size >= 16) {
+            if (fread(fmt, 1, 16, beat.wav) != 16) goto bad;
+            int format = fmt[0] | fmt[1] << 8, bits = fmt[14] | fmt[15] << 8;
+            beat.channels = fmt[2] | fmt[3] << 8;
+            beat.rate = fmt[4] | fmt[5] << 8 | fmt[6] << 16 | (uint32_t)fmt[7] << 24;
+            if (format != 1 || bits != 16 || beat.channels < 1 ||
+                beat.channels > BEAT_MAX_CHANNELS || beat.rate == 0) goto bad;
+            have_fmt = 1;
+            fseek(beat.wav, (long)(size - 16 + (size & 1)), SEEK_CUR);
+        } else if (!memcmp(chunk, "data", 4) && have_fmt) {
+            return 0;
+        } else {
+            fseek(beat.wav, (long)(size + (size & 1)), SEEK_CUR);
+        }
+    }
+bad:
+    fprintf(stderr, "Error: %s is not a 16-bit PCM WAV file\n", path);
+    fclose(beat.wav);
+    beat.wav = NULL;
+    return -1;
+}
+
+static void beat_free(void) {
+    if (beat.wav) fclose(beat.wav);
+    if (beat.pcm) snd_pcm_close(beat.pcm);
+    beat.wav = NULL;
+    beat.pcm = NULL;
+}
+
+// Track the beat of the audio from a capture PCM, or from a WAV file when
+// source ends in ".wav" (rate is then taken from the file). A file is read
+// at its own pace when realtime is set, otherwise as fast as possible.
+// Returns 0 on success, -1 on error
+int midi_beat_open(const char *source_name, unsigned int rate, int realtime) {
+    if (beat.running || beat.wav || beat.pcm) {
+        fprintf(stderr, "Error: beat tracker already open\n");
+        return -1;
+    }
+    size_t len = source_name ? strlen(source_name) : 0;
+    if (len > 4 && !strcmp(source_name + len - 4, ".wav")) {
+        if (beat_open_wav(source_name) < 0) return -1;
+        beat.realtime = realtime;
+    } else {
+        if (rate == 0) {
+            fprintf(stderr, "Error: invalid beat tracker rate %u\n", rate);
+            return -1;
+        }
+        int err = snd_pcm_open(&beat.pcm, source_name, SND_PCM_STREAM_CAPTURE, 0);
+        if (err >= 0)
+            err = snd_pcm_set_params(beat.pcm, SND_PCM_FORMAT_S16_LE, SND_PCM_ACCESS_RW_INTERLEAVED,
+                                     AUDIO_CHANNELS, rate, 1,
+                                     (unsigned int)(4ULL * BEAT_HOP * 1000000ULL / rate));
+        if (err < 0) {
+            fprintf(stderr, "Error opening PCM %s: %s\n", source_name, snd_strerror(err));
+            if (beat.pcm) snd_pcm_close(beat.pcm);
+            beat.pcm = NULL;
+            return -1;
+        }
+        beat.channels = AUDIO_CHANNELS;
+        beat.rate = rate;
+        beat.realtime = 1;
+    }
+
+    const int bins = BEAT_FRAME / 2;
+    for (int i = 0; i < BEAT_FRAME; i++)
+        beat.window[i] = 0.5f - 0.5f * cosf(2.0f * (float)M_PI * i / BEAT_FRAME);
+    for (int i = 0; i < BEAT_FRAME / 2; i++) {
+        beat.cos_table[i] = cosf(2.0f * (float)M_PI * i / BEAT_FRAME);
+        beat.sin_table[i] = sinf(2.0f * (float)M_PI * i / BEAT_FRAME);
+    }
+    /* each band contributes its mean flux, so that the few bins of the low
+       band are not drowned by the many of the high one */
+    int low_bins = (int)(BEAT_LOW_HZ * BEAT_FRAME / beat.rate) + 1;
+    if (low_bins >= bins) low_bins = bins - 1;
+    for (int k = 0; k < bins; k++)
+        beat.band_weight[k] = k < low_bins ? 1.0f / low_bins : (float)BEAT_HIGH_WEIGHT / (bins - low_bins);
+    memset(beat.prev_log_mag, 0, sizeof(beat.prev_log_mag));
+    memset(beat.ring, 0, sizeof(beat.ring));
+    memset(beat.flux_hist, 0, sizeof(beat.flux_hist));
+    memset(beat.frame, 0, sizeof(beat.frame));
+    beat.hops = 0;
+    beat.disagree = 0;
+    beat.period_s = beat.ref_s = beat.ref_beat = beat.confidence = 0.0;
+    beat.updated_mono_ns = 0;
+    beat.out_head = beat.out_tail = 0;
+    beat.out_dropped = 0;
+    beat.process_us_sum = beat.process_us_max = 0.0;
+    beat.processed = 0;
+    beat.finished = 0;
+    beat.mono_at_zero_ns = monotonic_ns();
+
+    beat.running = 1;
+    if (pthread_create(&beat.thread, NULL, beat_thread, NULL) != 0) {
+        fprintf(stderr, "Error starting beat tracker thread\n");
+        beat.running = 0;
+        beat_free();
+        return -1;
+    }
+    printf("[C] Beat tracker on %s at %u Hz (%d channels)%s\n", source_name, beat.rate, beat.channels,
+           beat.wav && !beat.realtime ? ", offline" : "");
+    return 0;
+}
+
+// Stop the beat tracker
+void midi_beat_close(void) {
+    if (!beat.wav && !beat.pcm) return;
+    beat.running = 0;
+    pthread_join(beat.thread, NULL);
+    beat_free();
+}
+
+// Current estimate: tempo and a confidence between 0 and 1. Either pointer
+// may be NULL.
+// Returns 0 once the tracker has an estimate, -1 before
+int midi_beat_get(double *bpm, double *confidence) {
+    pthread_mutex_lock(&beat.lock);
+    int ok = beat.period_s > 0.0 ? 0 : -1;
+    if (ok == 0) {
+        if (bpm) *bpm = 60.0 / beat.period_s;
+        if (confidence) *confidence = beat.confidence;
+    }
+    pthread_mutex_unlock(&beat.lock);
+    return ok;
+}
+
+// Next beat reported by the tracker: its time and the time it was reported
+// at, both in seconds of audio since the start of the stream, and the tempo
+// then. Any pointer may be NULL.
+// Returns 1 for a beat, 0 if none is waiting, -1 when the stream has ended
+// (a file read to its end, or a read error) and every beat collected
+int midi_beat_next(double *time_s, double *detected_s, double *bpm) {
+    int result = 0;
+    pthread_mutex_lock(&beat.lock);
+    if (beat.out_tail != beat.out_head) {
+        const struct beat_event *e = &beat.out[beat.out_tail++ % BEAT_OUT_RING];
+        if (time_s) *time_s = e->time_s;
+        if (detected_s) *detected_s = e->detected_s;
+        if (bpm) *bpm = e->bpm;
+        result = 1;
+    } else if (beat.finished) {
+        result = -1;
+    }
+    pthread_mutex_unlock(&beat.lock);
+    return result;
+}
+
+// Processing cost of one hop of audio, mean and worst, in microseconds, and
+// the beats dropped because midi_beat_next() did not keep up. Any pointer
+// may be NULL.
+void midi_beat_stats(double *mean_us, double *max_us, unsigned long *dropped) {
+    pthread_mutex_lock(&beat.lock);
+    if (mean_us) *mean_us = beat.processed ? beat.process_us_sum / beat.processed : 0.0;
+    if (max_us) *max_us = beat.process_us_max;
+    if (dropped) *dropped = beat.out_dropped;
+    pthread_mutex_unlock(&beat.lock);
+}
+
+/*
+ * Tempo conditioning
+ *
+ * Readings of an external source (Link, MIDI clock-in, audio) are cleaned
+ * up before the arbitration steers the engine towards them: a running
+ * median over the last readings, a hysteresis that holds the output until
+ * the median has moved by at least a given amount, snapping to the nearest
+ * integer BPM when within reach, and quantization to a fixed step. All
+ * stages are off by default; the rate of change is limited further on by
+ * the arbitration's slew. Counters tell how many readings went in, how
+ * often the conditioned tempo changed and how many tempo events the engine
+ * queued as a result.
+ */
+#define CONDITION_MAX_MEDIAN 15
+
+static struct {
+    int median_len;             /* 1: no median */
+    double hysteresis;          /* BPM */
+    double quantum;             /* BPM, 0: off */
+    double snap;                /* BPM, 0: off */
+
+    double window[CONDITION_MAX_MEDIAN];
+    int count, next;
+    double held;                /* conditioned tempo, 0 until the first reading */
+    unsigned long readings, changes, tempo_events;
+} condition = { .median_len = 1 };
+
+// Median of the readings in the window (no more than CONDITION_MAX_MEDIAN)
+static double condition_median(void) {
+    double v[CONDITION_MAX_MEDIAN];
+    int n = condition.count;
+    for (int i = 0; i < n; i++) {
+        int j = i;
+        for (; j > 0 && v[j - 1] > condition.window[i]; j--) v[j] = v[j - 1];
+        v[j] = condition.window[i];
+    }
+    return n % 2 ? v[n / 2] : 0.5 * (v[n / 2 - 1] + v[n / 2]);
+}
+
+// Run one reading of a source through the stages; reset starts over, as
+// when another source is taken
+static double condition_tempo(double bpm, int reset) {
+    if (reset) {
+        condition.count = 0;
+        condition.next = 0;
+        condition.held = 0.0;
+    }
+    condition.readings++;
+
+    condition.window[condition.next] = bpm;
+    condition.next = (condition.next + 1) % condition.median_len;
+    if (condition.count < condition.median_len) condition.count++;
+    double value = condition_median();
+
+    if (condition.held > 0.0 && fabs(value - condition.held) < condition.hysteresis)
+        return condition.held;
+    if (condition.snap > 0.0 && fabs(value - round(value)) <= condition.snap)
+        value = round(value);
+    if (condition.quantum > 0.0)
+        value = round(value / condition.quantum) * condition.quantum;
+
+    if (value != condition.held) condition.changes++;
+    condition.held = value;
+    return value;
+}
+
+// Configure the conditioning of source readings: median over median_len
+// readings (1 = off, at most 15), hold until the median moves by hysteresis
+// BPM, snap to whole BPM within snap_bpm and quantize to quantum_bpm (0 =
+// off for either)
+// Returns 0 on success, -1 on error
+int midi_condition_set(int median_len, double hysteresis_bpm, double quantum_bpm, double snap_bpm) {
+    if (median_len < 1 || median_len > CONDITION_MAX_MEDIAN || hysteresis_bpm < 0.0 ||
+        quantum_bpm < 0.0 || snap_bpm < 0.0 || snap_bpm >= 0.5) {
+        fprintf(stderr, "Error: invalid tempo conditioning (median %d, hysteresis %.3f, quantum %.3f, snap %.3f)\n",
+                median_len, hysteresis_bpm, quantum_bpm, snap_bpm);
+        return -1;
+    }
+    condition.median_len = median_len;
+    condition.hysteresis = hysteresis_bpm;
+    condition.quantum = quantum_bpm;
+    condition.snap = snap_bpm;
+    condition.count = 0;
+    condition.next = 0;
+    condition.held = 0.0;
+    printf("[C] Tempo conditioning: median %d, hysteresis %.3f BPM, quantum %.3f BPM, snap %.3f BPM\n",
+           median_len, hysteresis_bpm, quantum_bpm, snap_bpm);
+    return 0;
+}
+
+// Readings conditioned, changes of the conditioned tempo, and tempo events
+// the arbitration queued
+void midi_condition_stats(unsigned long *readings, unsigned long *changes, unsigned long *tempo_events) {
+    if (readings) *readings = condition.readings;
+    if (changes) *changes = condition.changes;
+    if (tempo_events) *tempo_events = condition.tempo_events;
+}
+
+/*
+ * Tempo source arbitration
+ *
+ * Tempo comes from Link (reported by the caller), from MIDI clock received
+ * on an input port, from the audio beat tracker, or from the internal
+ * generator, in that order of priority. Each source gets a health score
+ * from its staleness, its peers and the regularity of its clock; the
+ * highest-priority healthy source is followed. The engine never jumps to a source: the queue tempo is steered
+ * towards the source tempo plus a phase correction, both rate-limited, so a
+ * hand-over bends the clock instead of breaking it.
+ */
+enum { SOURCE_LINK, SOURCE_MIDI_IN, SOURCE_AUDIO, SOURCE_INTERNAL, SOURCE_COUNT };
+static const char *const source_names[SOURCE_COUNT] = { "Link", "MIDI clock-in", "audio", "internal" };
+
+#define SOURCE_HEALTHY 0.5
+#define SOURCE_INTERNAL_HEALTH 0.2
+#define SOURCE_LINK_SOLO_HEALTH 0.4     /* Link without peers is no reference */
+#define SOURCE_LINK_STALE_NS 1000000000LL
+#define SOURCE_MIDI_STALE_PERIODS 4
+#define SOURCE_HOLDOFF_NS 2000000000LL  /* a better source must stay healthy this long */
+#define SOURCE_PHASE_TIME_S 2.0         /* time constant of the phase correction */
+#define SOURCE_PHASE_DEADBAND 0.002     /* beats; smaller errors are left alone */
+
+static struct {
+    int enabled;
+    int active;
+    double health[SOURCE_COUNT];
+    long long healthy_since[SOURCE_COUNT];  /* 0: not healthy */
+
+    /* Link, as last reported */
+    double link_bpm, link_beat;
+    long long link_mono_ns;
+    int link_peers;
+
+    double hold_bpm;            /* source tempo last followed; internal keeps it */
+    double cmd_bpm;             /* tempo the engine is steered to */
+    double max_slew;            /* BPM per second */
+    double max_phase_rate;      /* beats per second */
+    long long last_service_ns;
+    unsigned long switches;
+} source;
+
+static double clamp(double v, double lo, double hi) {
+    return v < lo ? lo : v > hi ? hi : v;
+}
+
+// Fraction of a beat a is ahead of b, in [-0.5, 0.5)
+static double beat_phase_error(double a, double b) {
+    double e = fmod(a - b, 1.0);
+    if (e >= 0.5) e -= 1.0;
+    if (e < -0.5) e += 1.0;
+    return e;
+}
+
+// Score every source at monotonic time now_mono_ns
+static void source_score(long long now_mono_ns, long long now_queue_ns) {
+    double *h = source.health;
+
+    h[SOURCE_LINK] = 0.0;
+    if (source.link_mono_ns > 0 && now_mono_ns - source.link_mono_ns < SOURCE_LINK_STALE_NS)
+        h[SOURCE_LINK] = source.link_peers > 0 ? 1.0 : SOURCE_LINK_SOLO_HEALTH;
+
+    /* MIDI clock-in is as good as its interval jitter is small against the
+       period, and worthless once several clocks are missing */
+    h[SOURCE_MIDI_IN] = 0.0;
+    if (reclock.enabled && reclock.have_period && reclock.index >= 0 &&
+        now_queue_ns - reclock.last_input_ns < SOURCE_MIDI_STALE_PERIODS * reclock.period_ns)
+        h[SOURCE_MIDI_IN] = clamp(1.0 - sqrt(reclock.in_var) / (0.25 * reclock.period_ns), 0.0, 1.0);
+
+    /* the beat tracker is as good as its tempo peak stands out */
+    h[SOURCE_AUDIO] = 0.0;
+    pthread_mutex_lock(&beat.lock);
+    if (beat.running && !beat.finished && beat.period_s > 0.0 && now_mono_ns - beat.updated_mono_ns < BEAT_STALE_NS)
+        h[SOURCE_AUDIO] = beat.confidence;
+    pthread_mutex_unlock(&beat.lock);
+
+    h[SOURCE_INTERNAL] = SOURCE_INTERNAL_HEALTH;
+
+    for (int i = 0; i < SOURCE_COUNT; i++) {
+        if (h[i] < SOURCE_HEALTHY && i != SOURCE_INTERNAL)
+            source.healthy_since[i] = 0;
+        else if (source.healthy_since[i] == 0)
+            source.healthy_since[i] = now_mono_ns;
+    }
+}
+
+// Pick the source to follow: a failing one is left at once, a better one
+// is taken only after it has been healthy for the hold-off time
+static int source_select(long long now_mono_ns) {
+    for (int i = 0; i < SOURCE_COUNT; i++) {
+        if (source.healthy_since[i] == 0) continue;
+        if (i == source.active) return i;
+        if (i > source.active || now_mono_ns - source.healthy_since[i] >= SOURCE_HOLDOFF_NS) return i;
+    }
+    return SOURCE_INTERNAL;
+}
+
+// Tempo and beat position of a source at the given instant. Sets *has_phase
+// when the source defines a beat phase.
+static double source_reading(int i, long long now_mono_ns, long long now_queue_ns,
+                             double *beat_pos, int *has_phase) {
+    *has_phase = 0;
+    switch (i) {
+    case SOURCE_LINK:
+        *beat_pos = source.link_beat + (now_mono_ns - source.link_mono_ns) * source.link_bpm / 60e9;
+        *has_phase = 1;
+        return source.link_bpm;
+    case SOURCE_MIDI_IN:
+        *beat_pos = (reclock.index + (now_queue_ns - reclock.phase_ns) / reclock.period_ns) / PPQN;
+        *has_phase = reclock.from_start;
+        return 60e9 / (PPQN * reclock.period_ns);
+    case SOURCE_AUDIO: {
+        pthread_mutex_lock(&beat.lock);
+        double now_s = (now_mono_ns - beat.mono_at_zero_ns) / 1e9;
+        double bpm = 60.0 / beat.period_s;
+        *beat_pos = beat.ref_beat + (now_s - beat.ref_s) / beat.period_s;
+        pthread_mutex_unlock(&beat.lock);
+        *has_phase = 1;
+        return bpm;
+    }
+    default:
+        return source.hold_bpm;
+    }
+}
+
+// Turn on tempo source arbitration. The engine tempo changes by at most
+// max_slew_bpm_per_s, and phase is pulled in at most max_phase_rate beats
+// per second.
+// Returns 0 on success, -1 on error
+int midi_source_enable(double max_slew_bpm_per_s, double max_phase_rate) {
+    if (seq_handle == NULL) {
+        fprintf(stderr, "Error: MIDI not initialized\n");
+        return -1;
+    }
+    if (max_slew_bpm_per_s <= 0.0 || max_phase_rate < 0.0) {
+        fprintf(stderr, "Error: invalid slew %.3f BPM/s / phase rate %.3f beats/s\n",
+                max_slew_bpm_per_s, max_phase_rate);
+        return -1;
+    }
+    memset(&source, 0, sizeof(source));
+    source.active = SOURCE_INTERNAL;
+    /* hold the tempo the timeline ends up at, past any pending change */
+    source.hold_bpm = 60e6 / (pending_tempo_count ? pending_tempo[pending_tempo_count - 1].us_per_beat
+                                                  : tempo_anchor.us_per_beat);
+    source.cmd_bpm = source.hold_bpm;
+    source.max_slew = max_slew_bpm_per_s;
+    source.max_phase_rate = max_phase_rate;
+    source.enabled = 1;
+
+    printf("[C] Tempo source arbitration on: slew %.2f BPM/s, phase %.3f beats/s\n",
+           max_slew_bpm_per_s, max_phase_rate);
+    return 0;
+}
+
+// Follow MIDI clock received on the "Clock In" port as the second source.
+// Not available while reclocking, which already owns that input.
+// Returns the input port id on success, -1 on error
+int midi_source_enable_midi_in(void) {
+    if (seq_handle == NULL) {
+        fprintf(stderr, "Error: MIDI not initialized\n");
+        return -1;
+    }
+    if (reclock.enabled && reclock.emit) {
+        fprintf(stderr, "Error: clock input is in use by the reclocker\n");
+        return -1;
+    }
+    if (reclock.in_port < 0) {
+        reclock.in_port = create_input_port("Clock In");
+        if (reclock.in_port < 0) {
+            fprintf(stderr, "Error creating input port: %s\n", snd_strerror(reclock.in_port));
+            return -1;
+        }
+    }
+    int in_port = reclock.in_port;
+    memset(&reclock, 0, sizeof(reclock));
+    reclock.in_port = in_port;
+    reclock.index = -1;
+    reclock.enabled = 1;
+    ensure_queue_running();
+
+    printf("[C] Tracking MIDI clock-in on port %d as a tempo source\n", reclock.in_port);
+    return reclock.in_port;
+}
+
+// Report the Link session: tempo, beat position at CLOCK_MONOTONIC time
+// mono_ns, and the number of peers
+void midi_source_link_update(double bpm, double beat_pos, long long mono_ns, int peers) {
+    RT_SECTION();
+    if (bpm <= 0.0) return;
+    flight_record(FLIGHT_LINK, 0, llround(bpm * 1e6), llround(beat_pos * 1e6));
+    TRACE_INSTANT("link_update", "ubpm", llround(bpm * 1e6));
+    source.link_bpm = bpm;
+    source.link_beat = beat_pos;
+    source.link_mono_ns = mono_ns;
+    source.link_peers = peers;
+}
+
+// Re-score the sources, hand over if needed and steer the engine tempo.
+// Call it regularly (a few times per beat). Clock-in is read only as far as
+// it has arrived, so the call never waits for input.
+// Returns the source being followed (0 Link, 1 MIDI clock-in, 2 audio,
+// 3 internal), or -1 on error
+int midi_source_service(void) {
+    RT_SECTION();
+    if (seq_handle == NULL || !source.enabled) return -1;
+    TRACE_BEGIN(trace_from);
+    if (reclock.enabled && !reclock.emit) poll_input();
+
+    long long now_queue_ns, now_mono_ns;
+    if (queue_snapshot(NULL, &now_queue_ns, &now_mono_ns) < 0) return -1;
+    settle_pending_tempo(now_queue_ns);
+
+    source_score(now_mono_ns, now_queue_ns);
+    int next = source_select(now_mono_ns);
+
+    double source_beat;
+    int has_phase;
+    double bpm = source_reading(next, now_mono_ns, now_queue_ns, &source_beat, &has_phase);
+    if (next != SOURCE_INTERNAL) {
+        bpm = condition_tempo(bpm, next != source.active);
+        source.hold_bpm = bpm;
+    }
+
+    /* the phase is only meaningful while a clock run is going */
+    int running = direct.enabled ? direct.running : queue_running && !stop_armed;
+    double engine_beat = direct.enabled ? direct_beat(now_mono_ns)
+                                        : (tick_at_queue_ns(now_queue_ns) - clock_origin_tick) / (double)QUEUE_TEMPO_PPQ;
+    double error = has_phase && running ? beat_phase_error(source_beat, engine_beat) : 0.0;
+    if (has_phase && running) {
+        flight_record(FLIGHT_PHASE, 0, llround(error * 1e6), next);
+        if (flight.phase_beats > 0.0 && next == source.active && fabs(error) > flight.phase_beats)
+            flight_trigger("phase-error");
+    }
+    /* jitter in the reported phase should not turn into tempo events */
+    double steer = fabs(error) < SOURCE_PHASE_DEADBAND ? 0.0 : error;
+
+    if (next != source.active) {
+        if (has_phase && running)
+            printf("[C] Tempo source: %s -> %s (health %.2f), %.1f BPM, phase error %+.3f beats\n",
+                   source_names[source.active], source_names[next], source.health[next], bpm, error);
+        else
+            printf("[C] Tempo source: %s -> %s (health %.2f), %.1f BPM, phase held\n",
+                   source_names[source.active], source_names[next], source.health[next], bpm);
+        source.active = next;
+        source.switches++;
+    }
+
+    /* target tempo: the source's, plus enough to pull the phase in */
+    double correction = clamp(steer / SOURCE_PHASE_TIME_S, -source.max_phase_rate, source.max_phase_rate);
+    double target = bpm + correction * 60.0;
+
+    double dt = source.last_service_ns ? (now_mono_ns - source.last_service_ns) / 1e9 : 0.0;
+    source.last_service_ns = now_mono_ns;
+    double step = source.max_slew * dt;
+    source.cmd_bpm += clamp(target - source.cmd_bpm, -step, step);
+
+    unsigned int us_per_beat = (unsigned int)(60e6 / source.cmd_bpm + 0.5);
+    if (us_per_beat != tempo_anchor.us_per_beat) {
+        if (set_tempo_now(us_per_beat, NULL) < 0) return -1;
+        condition.tempo_events++;
+    }
+    TRACE_END(trace_from, "source_service", "source", source.active);
+    return source.active;
+}
+
+// Source being followed, or -1 when arbitration is off
+int midi_source_get_active(void) {
+    return source.enabled ? source.active : -1;
+}
+
+// Health score (0..1) of a source, or -1 if unknown
+double midi_source_get_health(int which) {
+    if (!source.enabled || which < 0 || which >= SOURCE_COUNT) return -1.0;
+    return source.health[which];
+}
+
+// Tempo currently in effect at the playhead, in BPM
+double midi_get_tempo(void) {
+    if (exact.ubpm) return (double)exact.ubpm / UBPM_PER_BPM;
+    return 60e6 / tempo_anchor.us_per_beat;
+}
+
+/*
+ * Hot standby
+ *
+ * The active instance publishes its timeline in a shared memory segment:
+ * the tempo points in effect mapped to CLOCK_MONOTONIC, the clock grid, the
+ * run state and the subscribers of its output port, plus a heartbeat. A
+ * standby instance on the same host watches the active client through the
+ * sequencer's announce port and the heartbeat. When the active one goes
+ * away without closing the segment, the standby bends its own queue so that
+ * its next clock lands exactly on the active grid's next clock, restores the
+ * subscriptions and becomes the active instance. The active role is claimed
+ * with a compare-and-swap of the owner pid in the segment, so of two
+ * instances started together, or two standbys taking over together, only
+ * one becomes active.
+ */
+#define STANDBY_MAGIC 0x42534c4cU           /* "LLSB" */
+#define STANDBY_VERSION 1
+#define STANDBY_MAX_TEMPO 16
+#define STANDBY_MAX_SUBS 16
+#define STANDBY_SUBS_REFRESH 32             /* publishes between subscriber scans */
+#define STANDBY_READ_TRIES 1000
+
+enum { STANDBY_NONE, STANDBY_ACTIVE, STANDBY_WAITING };
+enum { SHARED_EMPTY, SHARED_LIVE, SHARED_CLOSED };
+
+struct standby_tempo {
+    double tick;
+    int64_t mono_ns;
+    uint32_t us_per_beat;
+    uint32_t pad;
+};
+
+struct standby_shared {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t seq;                   /* odd while the writer is updating */
+    int32_t state;
+    int32_t pid;
+    int32_t owner;                  /* pid holding the active role, 0: none */
+    int32_t client, port;
+    int32_t running;
+    int64_t heartbeat_ns;
+    uint32_t clock_origin_tick;
+    uint32_t current_queue_tick;
+    int32_t tempo_count;            /* tempo[0] is the point in effect */
+    int32_t sub_count;
+    struct standby_tempo tempo[STANDBY_MAX_TEMPO];
+    struct { int32_t client, port; } subs[STANDBY_MAX_SUBS];
+};
+
+static struct {
+    int role;
+    char name[64];
+    struct standby_shared *shared;
+    long long timeout_ns;
+    int watch_port;                 /* receives the announce port's events */
+    int peer_gone;
+    unsigned int publishes;
+    int sub_count;
+    struct { int client, port; } subs[STANDBY_MAX_SUBS];
+    struct standby_shared last;     /* standby: latest consistent copy */
+} standby = { .watch_port = -1 };
+
+// Copy the shared state into standby.last. A writer that died halfway
+// through an update leaves the previous copy in place.
+// Returns 0 on success, -1 if no consistent copy could be taken
+static int standby_read(void) {
+    struct standby_shared copy;
+    for (int i = 0; i < STANDBY_READ_TRIES; i++) {
+        uint32_t seq = __atomic_load_n(&standby.shared->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) continue;
+        memcpy(&copy, standby.shared, sizeof(copy));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&standby.shared->seq, __ATOMIC_RELAXED) == seq) {
+            standby.last = copy;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// List the subscribers of the main output port
+static void standby_scan_subscribers(void) {
+    snd_seq_query_subscribe_t *query;
+    snd_seq_addr_t root = { .client = (unsigned char)snd_seq_client_id(seq_handle),
+                            .port = (unsigned char)port_id };
+    snd_seq_query_subscribe_alloca(&query);
+    snd_seq_query_subscribe_set_root(query, &root);
+    snd_seq_query_subscribe_set_type(query, SND_SEQ_QUERY_SUBS_READ);
+    snd_seq_query_subscribe_set_index(query, 0);
+    standby.sub_count = 0;
+    while (standby.sub_count < STANDBY_MAX_SUBS && snd_seq_query_port_subscribers(seq_handle, query) >= 0) {
+        const snd_seq_addr_t *addr = snd_seq_query_subscribe_get_addr(query);
+        standby.subs[standby.sub_count].client = addr->client;
+        standby.subs[standby.sub_count].port = addr->port;
+        standby.sub_count++;
+        snd_seq_query_subscribe_set_index(query, snd_seq_query_subscribe_get_index(query) + 1);
+    }
+}
+
+// Write the timeline and a heartbeat to the shared segment
+static int standby_publish(int state) {
+    long long now_queue_ns, now_mono_ns;
+    if (queue_snapshot(NULL, &now_queue_ns, &now_mono_ns) < 0) return -1;
+    settle_pending_tempo(now_queue_ns);
+    long long mono_offset = now_mono_ns - now_queue_ns;
+    if (standby.publishes++ % STANDBY_SUBS_REFRESH == 0) standby_scan_subscribers();
+
+    struct standby_shared *sh = standby.shared;
+    __atomic_add_fetch(&sh->seq, 1, __ATOMIC_ACQ_REL);
+    sh->state = state;
+    sh->pid = getpid();
+    sh->client = snd_seq_client_id(seq_handle);
+    sh->port = port_id;
+    sh->running = queue_running && !stop_armed;
+    sh->heartbeat_ns = now_mono_ns;
+    sh->clock_origin_tick = clock_origin_tick;
+    sh->current_queue_tick = current_queue_tick;
+    const struct tempo_point *p = &tempo_anchor;
+    int n = 0;
+    for (;;) {
+        sh->tempo[n].tick = p->tick;
+        sh->tempo[n].mono_ns = p->queue_ns + mono_offset;
+        sh->tempo[n].us_per_beat = p->us_per_beat;
+        if (++n == STANDBY_MAX_TEMPO || n > pending_tempo_count) break;
+        p = &pending_tempo[n - 1];
+    }
+    sh->tempo_count = n;
+    sh->sub_count = standby.sub_count;
+    for (int i = 0; i < standby.sub_count; i++) {
+        sh->subs[i].client = standby.subs[i].client;
+        sh->subs[i].port = standby.subs[i].port;
+    }
+    __atomic_add_fetch(&sh->seq, 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+// Claim the active role from `from` (0 or the pid of a holder known to be
+// gone). A live holder other than `from` keeps it.
+// Returns 1 if this process holds the role now, 0 if not
+static int standby_claim(int32_t from) {
+    int32_t me = getpid();
+    int32_t owner = __atomic_load_n(&standby.shared->owner, __ATOMIC_ACQUIRE);
+    for (;;) {
+        if (owner == me) return 1;
+        if (owner != from && owner != 0 && !(kill(owner, 0) < 0 && errno == ESRCH)) return 0;
+        if (__atomic_compare_exchange_n(&standby.shared->owner, &owner, me, 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            return 1;
+    }
+}
+
+// Note the active client leaving, as announced by the sequencer
+static void standby_input(const snd_seq_event_t *ev) {
+    if (standby.role != STANDBY_WAITING || ev->dest.port != standby.watch_port) return;
+    if (ev->data.addr.client != standby.last.client) return;
+    if (ev->type == SND_SEQ_EVENT_CLIENT_EXIT ||
+        (ev->type == SND_SEQ_EVENT_PORT_EXIT && ev->data.addr.port == standby.last.port))
+        standby.peer_gone = 1;
+}
+
+// Continue the active instance's timeline from its next clock
+// Returns 1 if a clock run was going, 0 if not, -1 on error
+static int standby_take_over(const struct standby_shared *sh) {
+    long long now_queue_ns, now_mono_ns;
+    snd_seq_tick_time_t playhead;
+    if (queue_snapshot(&playhead, &now_queue_ns, &now_mono_ns) < 0) return -1;
+
+    /* where the active grid is now, and when its next clock is due */
+    const struct standby_tempo *p = &sh->tempo[0];
+    for (int i = 1; i < sh->tempo_count && sh->tempo[i].mono_ns <= now_mono_ns; i++) p = &sh->tempo[i];
+    double tick_ns = ns_per_tick(p->us_per_beat);
+    double active_tick = p->tick + (now_mono_ns - p->mono_ns) / tick_ns;
+    double since_origin = active_tick - sh->clock_origin_tick;
+    double next = sh->clock_origin_tick + (floor(since_origin / CLOCK_STEP) + 1) * CLOCK_STEP;
+
+    /* pick the tick of ours that will carry it, and run the queue at the
+       tempo that gets there exactly in time; skip a clock rather than bend
+       the tempo by more than a factor of two */
+    double here = tick_at_queue_ns(now_queue_ns);
+    snd_seq_tick_time_t target = 0;
+    unsigned int bend_us = 0;
+    for (int tries = 0; tries < 2; tries++, next += CLOCK_STEP) {
+        double due_ns = (next - active_tick) * tick_ns;
+        double ticks = floor(here + due_ns / tick_ns + 0.5) - here;
+        if (ticks < 0.5) ticks += 1.0;
+        double ratio = due_ns / (ticks * tick_ns);
+        if (ratio < 0.5 || ratio > 2.0) continue;
+        target = (snd_seq_tick_time_t)(here + ticks + 0.5);
+        bend_us = (unsigned int)(p->us_per_beat * ratio + 0.5);
+        break;
+    }
+    if (bend_us == 0) return -1;
+
+    if (set_tempo_now(bend_us, NULL) < 0) return -1;
+    if (schedule_tempo_at(p->us_per_beat, target, NULL) < 0) return -1;
+
+    /* keep the beat phase of the active grid */
+    snd_seq_tick_time_t phase = (snd_seq_tick_time_t)(next - sh->clock_origin_tick) % QUEUE_TEMPO_PPQ;
+    clock_origin_tick = target >= phase ? target - phase : target;
+    current_queue_tick = target;
+    if (current_queue_tick > max_scheduled_tick) max_scheduled_tick = current_queue_tick;
+    for (int i = 0; i < clock_output_count; i++) clock_outputs[i].next = 0;
+    stop_armed = !sh->running;
+
+    for (int i = 0; i < sh->sub_count; i++) {
+        int err = snd_seq_connect_to(seq_handle, port_id, sh->subs[i].client, sh->subs[i].port);
+        if (err < 0)
+            fprintf(stderr, "Error restoring subscription to %d:%d: %s\n",
+                    sh->subs[i].client, sh->subs[i].port, snd_strerror(err));
+    }
+    snd_seq_drain_output(seq_handle);
+
+    printf("[C] Standby took over from client %d: next clock in %.3f ms at tick %lu (%.1f BPM), "
+           "%d subscriptions restored, heartbeat %.1f ms old\n",
+           sh->client, (queue_ns_at_tick(target) - now_queue_ns) / 1e6, (unsigned long)target,
+           60e6 / p->us_per_beat, sh->sub_count, (now_mono_ns - sh->heartbeat_ns) / 1e6);
+    return sh->running;
+}
+
+// Share the timeline through the shared memory segment `name`, either as
+// the active instance (standby_role = 0, which fails while a live instance
+// holds the segment) or as a standby waiting to take over (1); with -1 the
+// role is standby if a live instance already holds it. A standby takes
+// over when the active client exits or its heartbeat is older than
+// timeout_ms.
+// Returns the role taken (1 active, 2 standby), -1 on error
+int midi_standby_open(const char *name, int standby_role, int timeout_ms) {
+    if (seq_handle == NULL) {
+        fprintf(stderr, "Error: MIDI not initialized\n");
+        return -1;
+    }
+    if (direct.enabled) return direct_refuse("hot standby");
+    if (standby.shared != NULL || timeout_ms <= 0 || name == NULL || name[0] != '/' ||
+        strlen(name) >= sizeof(standby.name)) {
+        fprintf(stderr, "Error: invalid shared state %s\n", name ? name : "(null)");
+        return -1;
+    }
+    int fd = shm_open(name, O_RDWR | O_CREAT, 0600);
+    if (fd < 0) {
+        perror("Error opening shared state");
+        return -1;
+    }
+    if (ftruncate(fd, sizeof(struct standby_shared)) < 0) {
+        perror("Error sizing shared state");
+        close(fd);
+        return -1;
+    }
+    void *mem = mmap(NULL, sizeof(struct standby_shared), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mem == MAP_FAILED) {
+        perror("Error mapping shared state");
+        return -1;
+    }
+    standby.shared = mem;
+    strcpy(standby.name, name);
+    standby.timeout_ns = timeout_ms * 1000000LL;
+    standby.peer_gone = 0;
+    standby.publishes = 0;
+    ensure_queue_running();
+
+    if (standby_role <= 0 && !standby_claim(0)) {
+        if (standby_role == 0) {
+            fprintf(stderr, "Error: %s is held by active process %d\n", name, standby.shared->owner);
+            munmap(standby.shared, sizeof(struct standby_shared));
+            standby.shared = NULL;
+            return -1;
+        }
+        standby_role = 1;
+    }
+    if (standby_role <= 0) {
+        standby.shared->magic = STANDBY_MAGIC;
+        standby.shared->version = STANDBY_VERSION;
+        standby.role = STANDBY_ACTIVE;
+        printf("[C] Publishing timeline to %s\n", name);
+        return standby_publish(SHARED_LIVE) < 0 ? -1 : STANDBY_ACTIVE;
+    }
+
+    if (standby.watch_port < 0) {
+        standby.watch_port = create_input_port("Standby Watch");
+        if (standby.watch_port < 0 ||
+            snd_seq_connect_from(seq_handle, standby.watch_port,
+                                 SND_SEQ_CLIENT_SYSTEM, SND_SEQ_PORT_SYSTEM_ANNOUNCE) < 0) {
+            fprintf(stderr, "Error watching the announce port\n");
+            munmap(standby.shared, sizeof(struct standby_shared));
+            standby.shared = NULL;
+            return -1;
+        }
+    }
+    standby.role = STANDBY_WAITING;
+    printf("[C] Standing by on %s (timeout %d ms)\n", name, timeout_ms);
+    return STANDBY_WAITING;
+}
+
+// Active: publish the timeline and heartbeat; call it at least every clock.
+// Standby: check on the active instance and take over when it is gone.
+// Returns 0 while nothing changes, 1 after taking over a running clock,
+// 2 after taking over a stopped one, -1 on error
+int midi_standby_service(void) {
+    RT_SECTION();
+    if (seq_handle == NULL || standby.shared == NULL) return -1;
+    if (standby.role == STANDBY_ACTIVE) {
+        /* a standby that took us for dead now owns the segment */
+        int32_t owner = __atomic_load_n(&standby.shared->owner, __ATOMIC_ACQUIRE);
+        if (owner != getpid()) {
+            fprintf(stderr, "Error: process %d has taken over %s\n", owner, standby.name);
+            return -1;
+        }
+        return standby_publish(SHARED_LIVE) < 0 ? -1 : 0;
+    }
+
+    int fresh = standby_read() == 0;
+    /* exit announcements are taken as far as they have arrived; the
+       heartbeat and pid checks below run on every call either way */
+    poll_input();
+    const struct standby_shared *sh = &standby.last;
+    if (sh->magic != STANDBY_MAGIC || sh->version != STANDBY_VERSION || sh->state != SHARED_LIVE) {
+        standby.peer_gone = 0;      /* nothing to take over (yet, or any more) */
+        return 0;
+    }
+    long long age = monotonic_ns() - sh->heartbeat_ns;
+    int gone = standby.peer_gone || age > standby.timeout_ns ||
+               (kill(sh->pid, 0) < 0 && errno == ESRCH);
+    if (!gone) return 0;
+    /* another standby may have got there first; it publishes soon */
+    if (!standby_claim(sh->pid)) {
+        standby.peer_gone = 0;
+        return 0;
+    }
+    if (!fresh)
+        printf("[C] Warning: active instance died while publishing, using its previous timeline\n");
+
+    int result = standby_take_over(sh);
+    if (result < 0) return -1;
+    standby.role = STANDBY_ACTIVE;
+    standby.peer_gone = 0;
+    if (standby_publish(SHARED_LIVE) < 0) return -1;
+    return result ? 1 : 2;
+}
+
+// Role of this instance: 0 not sharing, 1 active, 2 standby
+int midi_standby_get_role(void) {
+    return standby.role;
+}
+
+// Stop sharing; an active instance marks the segment closed so that its
+// standby does not take over a deliberate shutdown
+static void standby_close(void) {
+    if (standby.shared == NULL) return;
+    if (standby.role == STANDBY_ACTIVE) {
+        __atomic_add_fetch(&standby.shared->seq, 1, __ATOMIC_ACQ_REL);
+        standby.shared->state = SHARED_CLOSED;
+        __atomic_add_fetch(&standby.shared->seq, 1, __ATOMIC_RELEASE);
+        int32_t me = getpid();
+        __atomic_compare_exchange_n(&standby.shared->owner, &me, 0, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+    }
+    munmap(standby.shared, sizeof(struct standby_shared));
+    standby.shared = NULL;
+    standby.role = STANDBY_NONE;
+}
+
+/*
+ * MIDI merge
+ *
+ * Events arriving on the merge input ports are forwarded to the clock
+ * output port, so one cable carries both. On a DIN link (31250 baud, 3125
+ * bytes/s) a burst of notes queued ahead of a clock delays it, so merged
+ * events are placed on a model of the wire: each goes out as early as the
+ * wire is free, but only where it ends before the next clock is due,
+ * otherwise right after that clock. Clocks themselves are queued with high
+ * priority. With no wire rate set, merged events are passed straight on.
+ */
+#define MAX_MERGE_INPUTS 8
+#define MERGE_DIN_BYTES_PER_S 3125
+#define MERGE_SLOT_TRIES 4          /* clocks an event may wait for */
+
+static struct {
+    int ports[MAX_MERGE_INPUTS];
+    int count;
+    double byte_ns;                 /* wire time per byte, 0: no model */
+    long long wire_free_ns;         /* queue time the wire is idle from */
+    unsigned long forwarded, deferred;
+    unsigned long dropped;          /* refused by the output buffer */
+    double delay_sum_us, delay_max_us;
+} merge = { .byte_ns = 1e9 / MERGE_DIN_BYTES_PER_S };
+
+// Wire length of an event in bytes (without running status), 0 for events
+// that are not merged
+static int merge_event_bytes(const snd_seq_event_t *ev) {
+    switch (ev->type) {
+    case SND_SEQ_EVENT_NOTEON:
+    case SND_SEQ_EVENT_NOTEOFF:
+    case SND_SEQ_EVENT_KEYPRESS:
+    case SND_SEQ_EVENT_CONTROLLER:
+    case SND_SEQ_EVENT_PITCHBEND:
+    case SND_SEQ_EVENT_SONGPOS:
+        return 3;
+    case SND_SEQ_EVENT_PGMCHANGE:
+    case SND_SEQ_EVENT_CHANPRESS:
+    case SND_SEQ_EVENT_SONGSEL:
+    case SND_SEQ_EVENT_QFRAME:
+        return 2;
+    case SND_SEQ_EVENT_CONTROL14:
+        return 6;
+    case SND_SEQ_EVENT_NONREGPARAM:
+    case SND_SEQ_EVENT_REGPARAM:
+        return 12;
+    case SND_SEQ_EVENT_TUNE_REQUEST:
+    case SND_SEQ_EVENT_SENSING:
+        return 1;
+    case SND_SEQ_EVENT_SYSEX:
+        return (int)ev->data.ext.len;
+    default:
+        /* our own clock and transport win over the inputs', and sequencer
+           system messages are not MIDI */
+        return 0;
+    }
+}
+
+// Earliest queue time from `earliest` on at which `bytes` fit on the wire
+// without overlapping a clock of the running grid
+static long long merge_slot(long long earliest, int bytes) {
+    long long t = earliest > merge.wire_free_ns ? earliest : merge.wire_free_ns;
+    if (merge.byte_ns == 0.0 || !queue_running || stop_armed) return t;
+    double length_ns = bytes * merge.byte_ns;
+    for (int i = 0; i < MERGE_SLOT_TRIES; i++) {
+        double tick = tick_at_queue_ns(t);
+        double clock_tick = clock_origin_tick;
+        if (tick > clock_origin_tick)
+            clock_tick += ceil((tick - clock_origin_tick) / CLOCK_STEP) * CLOCK_STEP;
+        long long clock_ns = queue_ns_at_tick(clock_tick);
+        if (t + length_ns <= clock_ns) break;
+        t = clock_ns + (long long)merge.byte_ns;
+    }
+    return t;
+}
+
+// Forward one event that arrived on a merge input
+// Returns 1 if the event was addressed to a merge input, 0 if not
+static int merge_input(const snd_seq_event_t *ev) {
+    int i = 0;
+    while (i < merge.count && merge.ports[i] != ev->dest.port) i++;
+    if (i == merge.count) return 0;
+    int bytes = merge_event_bytes(ev);
+    if (bytes == 0) return 1;
+
+    snd_seq_event_t out = *ev;
+    snd_seq_ev_set_source(&out, port_id);
+    snd_seq_ev_set_subs(&out);
+    long long arrived = event_queue_ns(ev);
+    long long now_queue_ns, t;
+    if (queue_snapshot(NULL, &now_queue_ns, NULL) < 0) {
+        now_queue_ns = t = arrived;     /* delay unknown, counted as none */
+    } else if (merge.byte_ns == 0.0) {
+        t = now_queue_ns;
+    } else {
+        t = merge_slot(now_queue_ns, bytes);
+        merge.wire_free_ns = t + (long long)(bytes * merge.byte_ns);
+    }
+    if (t > now_queue_ns) {
+        snd_seq_real_time_t rt = queue_real_time(t);
+        snd_seq_ev_schedule_real(&out, queue_id, 0, &rt);
+    } else {
+        snd_seq_ev_set_direct(&out);
+    }
+    if (snd_seq_event_output(seq_handle, &out) < 0) {
+        merge.dropped++;
+        return 1;
+    }
+    if (t > now_queue_ns) merge.deferred++;
+
+    double delay_us = (t - arrived) / 1000.0;
+    merge.delay_sum_us += delay_us;
+    if (delay_us > merge.delay_max_us) merge.delay_max_us = delay_us;
+    merge.forwarded++;
+    return 1;
+}
+
+// Add an input port whose events are merged into the clock output
+// Returns the port id on success, -1 on error
+int midi_merge_add_input(const char *name) {
+    if (seq_handle == NULL) {
+        fprintf(stderr, "Error: MIDI not initialized\n");
+        return -1;
+    }
+    if (direct.enabled) return direct_refuse("MIDI merge");
+    if (merge.count == MAX_MERGE_INPUTS) {
+        fprintf(stderr, "Error: too many merge inputs (max %d)\n", MAX_MERGE_INPUTS);
+        return -1;
+    }
+    int port = create_input_port(name);
+    if (port < 0) {
+        fprintf(stderr, "Error creating merge input: %s\n", snd_strerror(port));
+        return -1;
+    }
+    merge.ports[merge.count++] = port;
+    ensure_queue_running();
+    printf("[C] Merging port %d (%s) into the clock output\n", port, name);
+    return port;
+}
+
+// Bytes per second of the output link merged events are fitted around
+// clocks on (MERGE_DIN_BYTES_PER_S for DIN), or 0 to forward at once
+// Returns 0 on success, -1 on error
+int midi_merge_set_wire_rate(int bytes_per_sec) {
+    if (bytes_per_sec < 0) {
+        fprintf(stderr, "Error: invalid wire rate %d\n", bytes_per_sec);
+        return -1;
+    }
+    merge.byte_ns = bytes_per_sec ? 1e9 / bytes_per_sec : 0.0;
+    return 0;
+}
+
+// Merge statistics: events forwarded, how many of them were held back for
+// a clock or a busy wire, how many were dropped because the output buffer
+// was full, and the mean and worst added latency in us. Any pointer may be
+// NULL.
+void midi_merge_stats(unsigned long *forwarded, unsigned long *deferred, unsigned long *dropped,
+                      double *mean_us, double *max_us) {
+    if (forwarded) *forwarded = merge.forwarded;
+    if (deferred) *deferred = merge.deferred;
+    if (dropped) *dropped = merge.dropped;
+    if (mean_us) *mean_us = merge.forwarded ? merge.delay_sum_us / merge.forwarded : 0.0;
+    if (max_us) *max_us = merge.delay_max_us;
+}
+
+/*
+ * Route latency compensation
+ *
+ * A route is a destination that takes the clock straight from us instead
+ * of through a subscription, so that its copy can be sent early by the
+ * route's output latency. The latency is measured over a loopback (the
+ * route's device echoing, or a cable from its output back to an input):
+ * a burst of probe SysEx messages (non-commercial id 0x7d) goes out at known
+ * queue times and comes back on a port stamped by the kernel against the
+ * same queue. The output latency is taken as a share of the median round
+ * trip, after removing the probe's extra wire time. Routes are measured
+ * again every few seconds while the caller services them.
+ *
+ * Route clocks sit on the real-time axis, so they are retracted and sent
+ * again when the tempo timeline ahead of them changes. All queued clocks of
+ * a route share the offset they were stamped with; a new measurement is
+ * slewed in by restamping them in small steps, so the clock never jumps by
+ * a whole change in latency. START, STOP, CONTINUE and song position copies
+ * are kept until every route has delivered them and are restamped along
+ * with the clocks.
+ */
+#define MAX_ROUTES 8
+#define ROUTE_PROBES 8
+#define ROUTE_PROBE_BYTES 6             /* F0 7D 'L' 'B' id F7 */
+#define ROUTE_PROBE_LEAD_NS 20000000LL  /* first probe this far ahead */
+#define ROUTE_PROBE_SPACING_NS 5000000LL
+#define ROUTE_PROBE_TIMEOUT_NS 500000000LL
+#define ROUTE_SLEW_NS 250000LL          /* offset change per service call */
+#define ROUTE_MAX_TRANSPORT 16          /* transport copies in flight */
+
+static struct {
+    struct route {
+        snd_seq_addr_t dest, loop;
+        snd_seq_event_t clock_ev;
+        double share;               /* part of the round trip that is output */
+        long long interval_ns;
+        long long offset_ns;        /* queued clocks go out this much early */
+        long long target_ns;        /* offset measured, slewed towards */
+        snd_seq_tick_time_t resend_from;    /* first clock retracted */
+        long long rtt_ns;
+        long long next_ns;          /* CLOCK_MONOTONIC time of the next burst */
+        long long deadline_ns;      /* of the burst in flight, 0: none */
+        unsigned char first_id;     /* probe ids of the burst in flight */
+        long long sent_ns[ROUTE_PROBES];
+        long long trip_ns[ROUTE_PROBES];
+        int got;
+    } routes[MAX_ROUTES];
+    int count;
+    int in_port;
+    unsigned char next_id;
+    struct route_transport {
+        snd_seq_event_t ev;         /* as sent on the clock port */
+        snd_seq_tick_time_t tick;   /* its place on the timeline */
+        long long queue_ns;         /* or its fixed queue time, with by_time */
+        int by_time;
+        long long sent_ns[MAX_ROUTES];      /* stamp of the copy to each route */
+        unsigned char resend[MAX_ROUTES];   /* copy retracted, to be sent again */
+    } transport[ROUTE_MAX_TRANSPORT];
+    int transport_count;
+} route = { .in_port = -1 };
+
+static int routes_active(void) {
+    return route.count;
+}
+
+// Send the clock at `tick` (at queue_ns) to a route, early by its offset
+// (not drained)
+static int route_clock(struct route *r, long long queue_ns) {
+    r->clock_ev.time.time = queue_real_time(queue_ns - r->offset_ns);
+    return snd_seq_event_output(seq_handle, &r->clock_ev);
+}
+
+// Send the clock at `tick` to every route, early by its offset (not drained)
+static int routes_clock(snd_seq_tick_time_t tick) {
+    if (route.count == 0) return 0;
+    long long queue_ns = queue_ns_at_tick(tick);
+    for (int i = 0; i < route.count; i++) {
+        int err = route_clock(&route.routes[i], queue_ns);
+        if (err < 0) return err;
+    }
+    return 0;
+}
+
+// First clock tick at or after `from` whose copy to the route has not gone
+// out by now_queue_ns (on the timeline and offset it was stamped with)
+static snd_seq_tick_time_t route_pending_from(const struct route *r, snd_seq_tick_time_t from,
+                                              long long now_queue_ns) {
+    snd_seq_tick_time_t tick = clock_origin_tick;
+    if (from > tick) tick += (from - tick + CLOCK_STEP - 1) / CLOCK_STEP * CLOCK_STEP;
+    while (tick < current_queue_tick && queue_ns_at_tick(tick) - r->offset_ns <= now_queue_ns)
+        tick += CLOCK_STEP;
+    return tick;
+}
+
+// Remove the route's events of a type stamped at or after queue_ns
+static int route_remove_after(const struct route *r, int type, long long ns) {
+    snd_seq_remove_events_t *rm;
+    snd_seq_timestamp_t ts;
+    snd_seq_remove_events_alloca(&rm);
+    ts.time = queue_real_time(ns);
+    snd_seq_remove_events_set_condition(rm, SND_SEQ_REMOVE_OUTPUT |
+                                            SND_SEQ_REMOVE_TIME_AFTER |
+                                            SND_SEQ_REMOVE_DEST |
+                                            SND_SEQ_REMOVE_EVENT_TYPE |
+                                            SND_SEQ_REMOVE_TAG_MATCH);
+    snd_seq_remove_events_set_queue(rm, queue_id);
+    snd_seq_remove_events_set_time(rm, &ts);
+    snd_seq_remove_events_set_dest(rm, &r->dest);
+    snd_seq_remove_events_set_event_type(rm, type);
+    snd_seq_remove_events_set_tag(rm, TAG_ROUTE);
+    return snd_seq_remove_events(seq_handle, rm);
+}
+
+// Remove the route's clocks from the one of tick `first` on
+static int route_remove_from(const struct route *r, snd_seq_tick_time_t first) {
+    /* half a clock early catches the rounding, never the previous clock */
+    return route_remove_after(r, SND_SEQ_EVENT_CLOCK,
+                              queue_ns_at_tick(first) - r->offset_ns -
+                              (long long)(ns_per_tick(tempo_anchor.us_per_beat) * CLOCK_STEP / 2));
+}
+
+// Send a transport copy to route i, early by its offset, on the current
+// timeline (not drained)
+static int route_transport_send(int i, struct route_transport *t) {
+    struct route *r = &route.routes[i];
+    snd_seq_event_t out = t->ev;
+    long long ns = (t->by_time ? t->queue_ns : queue_ns_at_tick(t->tick)) - r->offset_ns;
+    snd_seq_real_time_t rt = queue_real_time(ns);
+    snd_seq_ev_set_dest(&out, r->dest.client, r->dest.port);
+    snd_seq_ev_set_tag(&out, TAG_ROUTE);
+    snd_seq_ev_schedule_real(&out, queue_id, 0, &rt);
+    t->sent_ns[i] = ns;
+    t->resend[i] = 0;
+    return snd_seq_event_output(seq_handle, &out);
+}
+
+// Forget the transport copies every route has delivered by now_queue_ns
+static void routes_transport_settle(long long now_queue_ns) {
+    int n = 0;
+    for (int k = 0; k < route.transport_count; k++) {
+        const struct route_transport *t = &route.transport[k];
+        int live = 0;
+        for (int i = 0; i < route.count; i++) live |= t->resend[i] || t->sent_ns[i] > now_queue_ns;
+        if (live) route.transport[n++] = *t;
+    }
+    route.transport_count = n;
+}
+
+// Retract route i's transport copies that have not gone out by
+// now_queue_ns and mark them for route_transport_resend
+static int route_transport_retract(int i, long long now_queue_ns) {
+    for (int k = 0; k < route.transport_count; k++) {
+        struct route_transport *t = &route.transport[k];
+        if (!t->resend[i] && t->sent_ns[i] > now_queue_ns) t->resend[i] = 1;
+    }
+    /* one removal per type, from its earliest copy retracted */
+    for (int k = 0; k < route.transport_count; k++) {
+        const struct route_transport *t = &route.transport[k];
+        if (!t->resend[i]) continue;
+        int first = 1;
+        long long from = t->sent_ns[i];
+        for (int j = 0; j < route.transport_count; j++) {
+            const struct route_transport *u = &route.transport[j];
+            if (j == k || !u->resend[i] || u->ev.type != t->ev.type) continue;
+            if (j < k) first = 0;
+            if (u->sent_ns[i] < from) from = u->sent_ns[i];
+        }
+        if (!first) continue;
+        int err = route_remove_after(&route.routes[i], t->ev.type, from);
+        if (err < 0) return err;
+    }
+    return 0;
+}
+
+// Send route i's retracted transport copies again (not drained)
+static int route_transport_resend(int i) {
+    for (int k = 0; k < route.transport_count; k++) {
+        if (!route.transport[k].resend[i]) continue;
+        int err = route_transport_send(i, &route.transport[k]);
+        if (err < 0) return err;
+    }
+    return 0;
+}
+
+// Remove the route clocks of ticks from `from` on that have not gone out
+// yet, on the timeline they were stamped with. Copies already delivered
+// (a route runs ahead of the queue by its offset) are remembered, so that
+// routes_refill does not send them twice.
+static int routes_retract(snd_seq_tick_time_t from) {
+    if (route.count == 0) return 0;
+    long long now_queue_ns = INT64_MIN;     /* without a reading nothing is taken as sent */
+    if (queue_snapshot(NULL, &now_queue_ns, NULL) == 0) routes_transport_settle(now_queue_ns);
+    for (int i = 0; i < route.count; i++) {
+        struct route *r = &route.routes[i];
+        r->resend_from = route_pending_from(r, from, now_queue_ns);
+        int err = route_remove_from(r, r->resend_from);
+        if (err >= 0) err = route_transport_retract(i, now_queue_ns);
+        if (err < 0) return err;
+    }
+    return 0;
+}
+
+// Send the route clocks retracted from `from` on again, up to the main
+// clock's next tick, and the retracted transport copies, on the current
+// timeline (not drained)
+static void routes_refill(snd_seq_tick_time_t from) {
+    for (int i = 0; i < route.count; i++) {
+        struct route *r = &route.routes[i];
+        snd_seq_tick_time_t tick = clock_origin_tick;
+        if (from > tick) tick += (from - tick + CLOCK_STEP - 1) / CLOCK_STEP * CLOCK_STEP;
+        if (r->resend_from > tick) tick = r->resend_from;
+        for (; tick < current_queue_tick; tick += CLOCK_STEP) {
+            if (route_clock(r, queue_ns_at_tick(tick)) < 0) {
+                fprintf(stderr, "Error re-emitting route clock at tick %lu\n", (unsigned long)tick);
+                return;
+            }
+        }
+        if (route_transport_resend(i) < 0) {
+            fprintf(stderr, "Error re-emitting route transport\n");
+            return;
+        }
+    }
+}
+
+// Move route i's queued clocks and transport copies a step towards its
+// measured offset: the ones not yet sent are retracted at the offset they
+// carry and stamped again at the new one (not drained)
+static int route_slew(int i, snd_seq_tick_time_t playhead, long long now_queue_ns) {
+    struct route *r = &route.routes[i];
+    long long step = r->target_ns - r->offset_ns;
+    if (step > ROUTE_SLEW_NS) step = ROUTE_SLEW_NS;
+    if (step < -ROUTE_SLEW_NS) step = -ROUTE_SLEW_NS;
+    snd_seq_tick_time_t tick = route_pending_from(r, playhead, now_queue_ns);
+    int err = route_remove_from(r, tick);
+    if (err >= 0) err = route_transport_retract(i, now_queue_ns);
+    if (err < 0) return err;
+    r->offset_ns += step;
+    for (; tick < current_queue_tick; tick += CLOCK_STEP) {
+        err = route_clock(r, queue_ns_at_tick(tick));
+        if (err < 0) return err;
+    }
+    return route_transport_resend(i);
+}
+
+// Send a START/STOP/CONTINUE/song position to every route, early by its
+// offset, and keep it for restamping: at a queue tick, or at a queue real
+// time when queue_ns is given (not drained)
+static int routes_transport(const snd_seq_event_t *ev, snd_seq_tick_time_t tick, const long long *queue_ns) {
+    if (route.count == 0) return 0;
+    if (route.transport_count == ROUTE_MAX_TRANSPORT) {
+        long long now_queue_ns;
+        if (queue_snapshot(NULL, &now_queue_ns, NULL) == 0) routes_transport_settle(now_queue_ns);
+        if (route.transport_count == ROUTE_MAX_TRANSPORT) {
+            fprintf(stderr, "Error: too many route transport events in flight (max %d)\n",
+                    ROUTE_MAX_TRANSPORT);
+            return -1;
+        }
+    }
+    struct route_transport *t = &route.transport[route.transport_count++];
+    memset(t, 0, sizeof(*t));
+    t->ev = *ev;
+    t->tick = tick;
+    t->by_time = queue_ns != NULL;
+    if (queue_ns) t->queue_ns = *queue_ns;
+    for (int i = 0; i < route.count; i++) {
+        int err = route_transport_send(i, t);
+        if (err < 0) return err;
+    }
+    return 0;
+}
+
+// Send a burst of probes to a route
+static int route_probe(struct route *r, long long now_mono_ns) {
+    long long now_queue_ns;
+    if (queue_snapshot(NULL, &now_queue_ns, NULL) < 0) return -1;
+    r->first_id = route.next_id;
+    r->got = 0;
+    for (int i = 0; i < ROUTE_PROBES; i++) {
+        unsigned char probe[ROUTE_PROBE_BYTES] = { 0xf0, 0x7d, 'L', 'B', (route.next_id + i) & 0x7f, 0xf7 };
+        snd_seq_event_t ev;
+        long long ns = now_queue_ns + ROUTE_PROBE_LEAD_NS + i * ROUTE_PROBE_SPACING_NS;
+        snd_seq_real_time_t rt = queue_real_time(ns);
+        snd_seq_ev_clear(&ev);
+        snd_seq_ev_set_source(&ev, port_id);
+        snd_seq_ev_set_dest(&ev, r->dest.client, r->dest.port);
+        snd_seq_ev_set_sysex(&ev, sizeof(probe), probe);
+        snd_seq_ev_schedule_real(&ev, queue_id, 0, &rt);
+        int err = snd_seq_event_output(seq_handle, &ev);
+        if (err < 0) {
+            fprintf(stderr, "Error sending latency probe: %s\n", snd_strerror(err));
+            return -1;
+        }
+        r->sent_ns[i] = ns;
+    }
+    route.next_id = (route.next_id + ROUTE_PROBES) & 0x7f;
+    snd_seq_drain_output(seq_handle);
+    r->deadline_ns = now_mono_ns + ROUTE_PROBE_LEAD_NS + ROUTE_PROBES * ROUTE_PROBE_SPACING_NS +
+                     ROUTE_PROBE_TIMEOUT_NS;
+    return 0;
+}
+
+// Take a probe that came back on the loopback port
+// Returns 1 if the event was for the loopback port, 0 if not
+static int route_input(const snd_seq_event_t *ev) {
+    if (route.count == 0 || ev->dest.port != route.in_port) return 0;
+    if (ev->type != SND_SEQ_EVENT_SYSEX || ev->data.ext.len != ROUTE_PROBE_BYTES) return 1;
+    const unsigned char *b = ev->data.ext.ptr;
+    if (b[0] != 0xf0 || b[1] != 0x7d || b[2] != 'L' || b[3] != 'B') return 1;
+    for (int i = 0; i < route.count; i++) {
+        struct route *r = &route.routes[i];
+        int k = (b[4] - r->first_id) & 0x7f;
+        if (r->deadline_ns == 0 || k >= ROUTE_PROBES || ev->source.client != r->loop.client ||
+            ev->source.port != r->loop.port)
+            continue;
+        if (r->got < ROUTE_PROBES) r->trip_ns[r->got++] = event_queue_ns(ev) - r->sent_ns[k];
+        break;
+    }
+    return 1;
+}
+
+static int compare_ll(const void *a, const void *b) {
+    long long x = *(const long long *)a, y = *(const long long *)b;
+    return (x > y) - (x < y);
+}
+
+// Turn the round trips of a finished burst into the route's offset
+static void route_finish(struct route *r, int index) {
+    r->deadline_ns = 0;
+    if (r->got < ROUTE_PROBES / 2) {
+        fprintf(stderr, "Error: route %d:%d, %d of %d probes came back from %d:%d\n", r->dest.client,
+                r->dest.port, r->got, ROUTE_PROBES, r->loop.client, r->loop.port);
+        return;
+    }
+    qsort(r->trip_ns, r->got, sizeof(r->trip_ns[0]), compare_ll);
+    long long rtt = r->trip_ns[r->got / 2];
+    /* a clock is one byte on the wire, the probe ROUTE_PROBE_BYTES */
+    double output = r->share * (rtt - (ROUTE_PROBE_BYTES - 1) * merge.byte_ns);
+    long long offset = output < 0.0 ? 0 : llround(output);
+    if (llabs(offset - r->target_ns) >= 100000 || r->rtt_ns == 0)
+        printf("[C] Route %d: %d:%d round trip %.3f ms (%d/%d probes), clock sent %.3f ms early\n", index,
+               r->dest.client, r->dest.port, rtt / 1e6, r->got, ROUTE_PROBES, offset / 1e6);
+    r->rtt_ns = rtt;
+    r->target_ns = offset;
+}
+
+// Send the clock straight to `dest` instead of through a subscription and
+// keep it early by the route's measured output latency: `output_share` of
+// the round trip through `loopback` (an input that echoes what dest gets),
+// measured again every interval_s seconds. Routes take the scheduled
+// clock; the reclocker's clock is not sent to them.
+// Returns the route index on success, -1 on error
+int midi_route_add(const char *dest, const char *loopback, double output_share, int interval_s) {
+    if (seq_handle == NULL) {
+        fprintf(stderr, "Error: MIDI not initialized\n");
+        return -1;
+    }
+    if (direct.enabled) return direct_refuse("route compensation");
+    if (reclock.enabled) {
+        fprintf(stderr, "Error: routes cannot be used with the reclocker\n");
+        return -1;
+    }
+    if (route.count == MAX_ROUTES || output_share < 0.0 || output_share > 1.0 || interval_s <= 0) {
+        fprintf(stderr, "Error: invalid route settings or too many routes (max %d)\n", MAX_ROUTES);
+        return -1;
+    }
+    struct route *r = &route.routes[route.count];
+    memset(r, 0, sizeof(*r));
+    if (snd_seq_parse_address(seq_handle, &r->dest, dest) < 0 ||
+        snd_seq_parse_address(seq_handle, &r->loop, loopback) < 0) {
+        fprintf(stderr, "Error: invalid route %s through %s\n", dest, loopback);
+        return -1;
+    }
+    if (route.in_port < 0) {
+        route.in_port = create_input_port("Latency Loopback");
+        if (route.in_port < 0) {
+            fprintf(stderr, "Error creating loopback port: %s\n", snd_strerror(route.in_port));
+            route.in_port = -1;
+            return -1;
+        }
+    }
+    int err = snd_seq_connect_from(seq_handle, route.in_port, r->loop.client, r->loop.port);
+    if (err < 0) {
+        fprintf(stderr, "Error connecting loopback %s: %s\n", loopback, snd_strerror(err));
+        return -1;
+    }
+    /* the route gets its own early copy from now on */
+    snd_seq_disconnect_to(seq_handle, port_id, r->dest.client, r->dest.port);
+    snd_seq_ev_clear(&r->clock_ev);
+    snd_seq_ev_set_source(&r->clock_ev, port_id);
+    snd_seq_ev_set_dest(&r->clock_ev, r->dest.client, r->dest.port);
+    r->clock_ev.type = SND_SEQ_EVENT_CLOCK;
+    snd_seq_ev_set_priority(&r->clock_ev, 1);
+    snd_seq_ev_set_tag(&r->clock_ev, TAG_ROUTE);
+    snd_seq_ev_schedule_real(&r->clock_ev, queue_id, 0, &r->clock_ev.time.time);
+    r->share = output_share;
+    r->interval_ns = interval_s * 1000000000LL;
+    r->next_ns = monotonic_ns();
+    ensure_queue_running();
+    printf("[C] Route %d: clock to %d:%d, latency measured through %d:%d every %d s\n", route.count,
+           r->dest.client, r->dest.port, r->loop.client, r->loop.port, interval_s);
+    return route.count++;
+}
+
+// Measure the routes that are due, finish the bursts that are done and
+// slew the clocks towards the latest measurement. Call it regularly (a few
+// times per second); probes are taken in as they arrive by the service
+// calls and midi_wait.
+// Returns 0 on success, -1 on error
+int midi_route_service(void) {
+    RT_SECTION();
+    if (route.count == 0) return 0;
+    if (seq_handle == NULL) return -1;
+    poll_input();
+    long long now = monotonic_ns();
+    int slewing = 0;
+    for (int i = 0; i < route.count; i++) {
+        struct route *r = &route.routes[i];
+        if (r->deadline_ns && (r->got == ROUTE_PROBES || now >= r->deadline_ns)) {
+            route_finish(r, i);
+            r->next_ns = now + r->interval_ns;
+        } else if (r->deadline_ns == 0 && now >= r->next_ns && route_probe(r, now) < 0) {
+            return -1;
+        }
+        slewing |= r->offset_ns != r->target_ns;
+    }
+    if (!slewing) return 0;
+
+    snd_seq_tick_time_t playhead;
+    long long now_queue_ns;
+    if (queue_snapshot(&playhead, &now_queue_ns, NULL) < 0) return -1;
+    for (int i = 0; i < route.count; i++) {
+        struct route *r = &route.routes[i];
+        if (r->offset_ns == r->target_ns) continue;
+        int err = route_slew(i, playhead, now_queue_ns);
+        if (err < 0) {
+            fprintf(stderr, "Error restamping route clocks: %s\n", snd_strerror(err));
+            return -1;
+        }
+    }
+    snd_seq_drain_output(seq_handle);
+    return 0;
+}
+
+// Round trip and clock offset of a route, in ms
+// Returns 0 on success, -1 if there is no such route
+int midi_route_get_latency(int index, double *rtt_ms, double *offset_ms) {
+    if (index < 0 || index >= route.count) return -1;
+    if (rtt_ms) *rtt_ms = route.routes[index].rtt_ns / 1e6;
+    if (offset_ms) *offset_ms = route.routes[index].offset_ns / 1e6;
+    return 0;
+}
+
+// Sleep for up to timeout_us, handling input (merge, reclock, standby) as
+// it arrives instead of on the next service call
+// Returns 0 on success, -1 on error
+int midi_wait(long long timeout_us) {
+    RT_SECTION();
+    if (seq_handle == NULL) return -1;
+    struct pollfd fds[4];
+    int nfds = snd_seq_poll_descriptors(seq_handle, fds, 4, POLLIN);
+    long long deadline = monotonic_ns() + timeout_us * 1000LL;
+    TRACE_BEGIN(trace_from);
+    USDT1(wait_start, timeout_us);
+    for (;;) {
+        poll_input();
+        snd_seq_drain_output(seq_handle);
+        long long left = deadline - monotonic_ns();
+        if (left <= 0) {
+            TRACE_END(trace_from, "wait", "late_ns", -left);
+            USDT2(wait_done, -left, timeout_us);
+            flight_record(FLIGHT_WAKE, current_queue_tick, -left, timeout_us);
+            if (flight.late_ns > 0 && -left > flight.late_ns) flight_trigger("late-wakeup");
+            return 0;
+        }
+        /* events already read into the input buffer do not wake ppoll */
+        if (snd_seq_event_input_pending(seq_handle, 0) > 0) continue;
+        struct timespec ts = { .tv_sec = left / 1000000000LL, .tv_nsec = left % 1000000000LL };
+        if (ppoll(fds, nfds, &ts, NULL) < 0 && errno != EINTR) return -1;
+    }
+}
+
 // Get current tick count
 unsigned int midi_get_tick_count(void) {
     return current_queue_tick;
@@ -211,6 +4988,10 @@ unsigned int midi_get_tick_count(void) {
 // Cleanup and close ALSA sequencer
 void midi_cleanup(void) {
     if (seq_handle != NULL) {
+        midi_audio_clock_close();
+        midi_beat_close();
+        midi_flight_disable();
+        standby_close();
         if (queue_id >= 0) {
             snd_seq_stop_queue(seq_handle, queue_id, NULL);
             snd_seq_free_queue(seq_handle, queue_id);
@@ -219,6 +5000,23 @@ void midi_cleanup(void) {
         seq_handle = NULL;
         port_id = -1;
         queue_id = -1;
+        queue_running = 0;
+        midi_map_unload();
+        clock_output_count = 0;
+        memset(&reclock, 0, sizeof(reclock));
+        reclock.in_port = -1;
+        memset(&source, 0, sizeof(source));
+        merge.count = 0;
+        merge.wire_free_ns = 0;
+        route.count = 0;
+        route.transport_count = 0;
+        route.in_port = -1;
+        direct.running = 0;
+        direct.period_ps = 0;
+        standby.watch_port = -1;
+        memset(&mtc, 0, sizeof(mtc));
+        mtc.port = -1;
+        mtc.own_port = -1;
         printf("[C] MIDI cleanup complete\n");
     }
 }
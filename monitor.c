@@ -1,21 +1,99 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdatomic.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <poll.h>
 #include <alsa/asoundlib.h>
 #include <signal.h>
 #include <time.h>
-#include <sys/time.h>
 
 #define PPQN 24  // MIDI clock sends 24 pulses per quarter note
 #define SAMPLE_WINDOW 96  // Number of ticks to average over (4 beats)
+#define RING_SIZE 4096  // Records between reader and each worker (power of two)
+#define CACHE_LINE 64
+#define IDLE_SLEEP_NS 500000  // Worker back-off when its ring is empty
+#define MAX_SHARDS 64
+#define SHARD_SLOTS 256  // Clock sources one shard can track (power of two)
+#define REPORT_INTERVAL_S 10  // Summary period when watching several sources
+#define BENCH_SOURCES 64
+#define MAX_POLL_FDS 4
+#define READER_POLL_MS 100  // How often an idle reader checks for shutdown
 
-static int running = 1;
+// What the reader thread keeps of an event: arrival time, type and sender
+struct clock_record {
+    int64_t time_ns;
+    uint8_t type;
+    uint8_t client;
+    uint8_t port;
+};
+
+// Single-producer single-consumer ring. Head and tail live on their own
+// cache lines so that the reader and the worker do not share one.
+struct ring {
+    _Alignas(CACHE_LINE) atomic_uint head;  // written by the reader
+    _Alignas(CACHE_LINE) atomic_uint tail;  // written by the worker
+    _Alignas(CACHE_LINE) struct clock_record records[RING_SIZE];
+    // reader-side statistics, read when reporting
+    atomic_uint high_water;
+    atomic_ulong dropped;
+};
+
+// Analysis state of one clock source, owned by a single worker
+struct source_state {
+    uint16_t key;  // (client << 8 | port) + 1, 0 for a free slot
+    int started;
+    int tick_count;
+    int beat_count;
+    int64_t last_tick_time;
+    double tick_intervals[SAMPLE_WINDOW];
+    double interval_sum;
+    int interval_index;
+    int intervals_collected;
+};
+
+// One shard: a ring, the sources hashed to it and the counters it publishes.
+// Shards are cache-line aligned and only their worker writes to them, so
+// workers never contend; the reporter reads the counters without locking.
+struct shard {
+    struct ring ring;
+    _Alignas(CACHE_LINE) atomic_ulong events;
+    atomic_ulong beats;
+    atomic_uint sources;
+    atomic_ulong untracked;  // events from sources beyond SHARD_SLOTS
+    pthread_t thread;
+    struct source_state slots[SHARD_SLOTS];
+};
+
+static volatile sig_atomic_t running = 1;
+static struct shard *shards;
+static int shard_count = 1;
+static int quiet = 0;
+static atomic_ulong overruns;
+static atomic_ulong wakeups;
+// With kernel timestamps, events carry our queue's real time; this maps it
+// to CLOCK_MONOTONIC
+static int kernel_stamps = 0;
+static int64_t queue_to_mono_ns = 0;
+// Every record, one line each, for offline analysis (stepbench.py)
+static FILE *record_log = NULL;
+static atomic_uint max_batch;
 
 void signal_handler(int sig) {
-    printf("\nReceived SIGINT, shutting down...\n");
+    (void)sig;
     running = 0;
 }
 
+static int64_t monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
 // Calculate BPM from interval between ticks
 double calculate_bpm(double interval_us) {
     if (interval_us <= 0) return 0.0;
@@ -30,156 +108,545 @@ double calculate_bpm(double interval_us) {
     return bpm;
 }
 
+// Sources are spread over the shards by their address, so every event of
+// one source is analysed by the same worker in order
+static struct shard *shard_for(uint8_t client, uint8_t port) {
+    uint32_t h = ((uint32_t)client << 8 | port) * 2654435761u;
+    return &shards[(h >> 16) % shard_count];
+}
+
+// Push a record; returns 0, or -1 when the ring is full
+static int ring_push(struct ring *r, const struct clock_record *rec) {
+    unsigned int head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    unsigned int tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+    unsigned int used = head - tail;
+    if (used == RING_SIZE) {
+        return -1;
+    }
+    r->records[head & (RING_SIZE - 1)] = *rec;
+    atomic_store_explicit(&r->head, head + 1, memory_order_release);
+    if (used + 1 > atomic_load_explicit(&r->high_water, memory_order_relaxed)) {
+        atomic_store_explicit(&r->high_water, used + 1, memory_order_relaxed);
+    }
+    return 0;
+}
+
+// Pop a record; returns 0, or -1 when the ring is empty
+static int ring_pop(struct ring *r, struct clock_record *rec) {
+    unsigned int tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    unsigned int head = atomic_load_explicit(&r->head, memory_order_acquire);
+    if (tail == head) {
+        return -1;
+    }
+    *rec = r->records[tail & (RING_SIZE - 1)];
+    atomic_store_explicit(&r->tail, tail + 1, memory_order_release);
+    return 0;
+}
+
+static struct source_state *find_source(struct shard *s, uint8_t client, uint8_t port) {
+    uint16_t key = (uint16_t)((client << 8 | port) + 1);
+    unsigned int i = (key * 40503u) & (SHARD_SLOTS - 1);
+    for (int probe = 0; probe < SHARD_SLOTS; probe++, i = (i + 1) & (SHARD_SLOTS - 1)) {
+        if (s->slots[i].key == key) {
+            return &s->slots[i];
+        }
+        if (s->slots[i].key == 0) {
+            s->slots[i].key = key;
+            atomic_fetch_add_explicit(&s->sources, 1, memory_order_relaxed);
+            return &s->slots[i];
+        }
+    }
+    return NULL;
+}
+
+static void print_report(double elapsed_s, unsigned long last_events);
+
+// Analyse one event of one source (runs on the source's worker)
+static void process_record(struct shard *s, const struct clock_record *rec) {
+    struct source_state *src = find_source(s, rec->client, rec->port);
+    atomic_fetch_add_explicit(&s->events, 1, memory_order_relaxed);
+    if (record_log) {
+        fprintf(record_log, "%lld %d %d %d\n", (long long)rec->time_ns, rec->client, rec->port, rec->type);
+    }
+    if (src == NULL) {
+        atomic_fetch_add_explicit(&s->untracked, 1, memory_order_relaxed);
+        return;
+    }
+
+    switch (rec->type) {
+        case SND_SEQ_EVENT_START:
+            if (!quiet) printf("[%3d:%-3d] >>> MIDI START received\n", rec->client, rec->port);
+            src->started = 1;
+            src->tick_count = 0;
+            src->beat_count = 0;
+            src->interval_index = 0;
+            src->intervals_collected = 0;
+            src->interval_sum = 0.0;
+            src->last_tick_time = 0;
+            break;
+
+        case SND_SEQ_EVENT_STOP:
+            if (!quiet) {
+                printf("[%3d:%-3d] >>> MIDI STOP received\n", rec->client, rec->port);
+                printf("[%3d:%-3d] Total ticks received: %d\n", rec->client, rec->port, src->tick_count);
+                printf("[%3d:%-3d] Total beats: %d\n", rec->client, rec->port, src->beat_count);
+                print_report(0.0, 0);
+            }
+            src->started = 0;
+            break;
+
+        case SND_SEQ_EVENT_CONTINUE:
+            if (!quiet) printf("[%3d:%-3d] >>> MIDI CONTINUE received\n", rec->client, rec->port);
+            src->started = 1;
+            break;
+
+        case SND_SEQ_EVENT_CLOCK:
+            if (!src->started) {
+                if (!quiet) printf("[%3d:%-3d] >>> MIDI CLOCK received (but not started yet)\n",
+                                   rec->client, rec->port);
+                src->started = 1;
+            }
+
+            src->tick_count++;
+
+            // Calculate interval from last tick
+            if (src->last_tick_time != 0) {
+                double interval_us = (double)((rec->time_ns - src->last_tick_time) / 1000);
+
+                // Store interval in circular buffer, keeping the sum current
+                if (src->intervals_collected < SAMPLE_WINDOW) {
+                    src->intervals_collected++;
+                } else {
+                    src->interval_sum -= src->tick_intervals[src->interval_index];
+                }
+                src->tick_intervals[src->interval_index] = interval_us;
+                src->interval_sum += interval_us;
+                src->interval_index = (src->interval_index + 1) % SAMPLE_WINDOW;
+
+                // Print status every quarter note (24 ticks)
+                if (src->tick_count % PPQN == 0) {
+                    src->beat_count++;
+                    atomic_fetch_add_explicit(&s->beats, 1, memory_order_relaxed);
+                    if (!quiet) {
+                        double bpm = calculate_bpm(src->interval_sum / src->intervals_collected);
+                        printf("[%3d:%-3d] Beat %4d | Tick %6d | Interval: %7.2f µs | BPM: %6.2f | Avg over %d ticks\n",
+                               rec->client, rec->port, src->beat_count, src->tick_count, interval_us, bpm,
+                               src->intervals_collected);
+                    }
+                }
+            }
+
+            src->last_tick_time = rec->time_ns;
+            break;
+
+        default:
+            // Ignore other event types
+            break;
+    }
+}
+
+// Worker: drain the shard's ring, analysing each record
+static void *worker_thread(void *arg) {
+    struct shard *s = arg;
+    struct clock_record rec;
+
+    while (running) {
+        if (ring_pop(&s->ring, &rec) < 0) {
+            struct timespec idle = { 0, IDLE_SLEEP_NS };
+            nanosleep(&idle, NULL);
+            continue;
+        }
+        process_record(s, &rec);
+    }
+    return NULL;
+}
+
+// Reader thread: timestamp each event and hand it to its source's shard,
+// nothing else. It never waits for a worker; when a ring is full the record
+// is dropped and counted. Each wakeup drains everything that is pending, both
+// in the library's buffer and in the kernel, before polling again.
+static void *reader_thread(void *arg) {
+    snd_seq_t *seq_handle = arg;
+    snd_seq_event_t *ev;
+    struct pollfd fds[MAX_POLL_FDS];
+    int nfds = snd_seq_poll_descriptors(seq_handle, fds, MAX_POLL_FDS, POLLIN);
+
+    while (running) {
+        if (poll(fds, nfds, READER_POLL_MS) <= 0) {
+            continue;
+        }
+        atomic_fetch_add_explicit(&wakeups, 1, memory_order_relaxed);
+
+        unsigned int batch = 0;
+        for (;;) {
+            int err = snd_seq_event_input(seq_handle, &ev);
+            int64_t now = monotonic_ns();
+
+            if (err == -ENOSPC) {
+                // the kernel's input pool overflowed: events were lost
+                atomic_fetch_add_explicit(&overruns, 1, memory_order_relaxed);
+                continue;
+            }
+            if (err == -EAGAIN) {
+                break;
+            }
+            if (err < 0) {
+                if (err != -EINTR) {
+                    fprintf(stderr, "Error receiving event: %s\n", snd_strerror(err));
+                    running = 0;
+                }
+                break;
+            }
+
+            if (kernel_stamps && (ev->flags & SND_SEQ_TIME_STAMP_MASK) == SND_SEQ_TIME_STAMP_REAL) {
+                // stamped by the kernel on arrival, free of our own wakeup latency
+                now = queue_to_mono_ns + (int64_t)ev->time.time.tv_sec * 1000000000LL + ev->time.time.tv_nsec;
+            }
+            struct clock_record rec = {
+                .time_ns = now, .type = ev->type, .client = ev->source.client, .port = ev->source.port
+            };
+            struct shard *s = shard_for(rec.client, rec.port);
+            if (ring_push(&s->ring, &rec) < 0) {
+                atomic_fetch_add_explicit(&s->ring.dropped, 1, memory_order_relaxed);
+            }
+            batch++;
+
+            // nothing buffered and nothing more in the kernel: back to poll
+            if (snd_seq_event_input_pending(seq_handle, 1) == 0) {
+                break;
+            }
+        }
+        if (batch > atomic_load_explicit(&max_batch, memory_order_relaxed)) {
+            atomic_store_explicit(&max_batch, batch, memory_order_relaxed);
+        }
+    }
+    return NULL;
+}
+
+// Only the realtime messages the analysis uses reach this client; the kernel
+// drops everything else (notes, controllers, active sensing) before it takes
+// space in the input pool
+static int set_event_filter(snd_seq_t *seq_handle) {
+    static const int types[] = {
+        SND_SEQ_EVENT_CLOCK, SND_SEQ_EVENT_START, SND_SEQ_EVENT_STOP, SND_SEQ_EVENT_CONTINUE
+    };
+    for (size_t i = 0; i < sizeof(types) / sizeof(types[0]); i++) {
+        int err = snd_seq_set_client_event_filter(seq_handle, types[i]);
+        if (err < 0) {
+            return err;
+        }
+    }
+    return 0;
+}
+
+// Create the input port. With kernel timestamps the port stamps every event
+// with the real time of a queue of our own, which is started here and mapped
+// to CLOCK_MONOTONIC by reading both clocks back to back.
+// Returns the port id, or a negative error code
+static int create_input_port(snd_seq_t *seq_handle) {
+    if (!kernel_stamps) {
+        return snd_seq_create_simple_port(seq_handle, "MIDI Clock In",
+                                          SND_SEQ_PORT_CAP_WRITE | SND_SEQ_PORT_CAP_SUBS_WRITE,
+                                          SND_SEQ_PORT_TYPE_MIDI_GENERIC | SND_SEQ_PORT_TYPE_APPLICATION);
+    }
+
+    int queue = snd_seq_alloc_queue(seq_handle);
+    if (queue < 0) {
+        return queue;
+    }
+    snd_seq_port_info_t *info;
+    snd_seq_port_info_alloca(&info);
+    snd_seq_port_info_set_name(info, "MIDI Clock In");
+    snd_seq_port_info_set_capability(info, SND_SEQ_PORT_CAP_WRITE | SND_SEQ_PORT_CAP_SUBS_WRITE);
+    snd_seq_port_info_set_type(info, SND_SEQ_PORT_TYPE_MIDI_GENERIC | SND_SEQ_PORT_TYPE_APPLICATION);
+    snd_seq_port_info_set_timestamping(info, 1);
+    snd_seq_port_info_set_timestamp_real(info, 1);
+    snd_seq_port_info_set_timestamp_queue(info, queue);
+    int err = snd_seq_create_port(seq_handle, info);
+    if (err < 0) {
+        return err;
+    }
+    err = snd_seq_start_queue(seq_handle, queue, NULL);
+    if (err >= 0) {
+        err = snd_seq_drain_output(seq_handle);
+    }
+    if (err < 0) {
+        return err;
+    }
+
+    snd_seq_queue_status_t *status;
+    snd_seq_queue_status_alloca(&status);
+    int64_t before = monotonic_ns();
+    err = snd_seq_get_queue_status(seq_handle, queue, status);
+    int64_t after = monotonic_ns();
+    if (err < 0) {
+        return err;
+    }
+    const snd_seq_real_time_t *rt = snd_seq_queue_status_get_real_time(status);
+    queue_to_mono_ns = before + (after - before) / 2 - ((int64_t)rt->tv_sec * 1000000000LL + rt->tv_nsec);
+    return snd_seq_port_info_get_port(info);
+}
+
+// Sum the shards' counters; each is read once without stopping the workers
+static void print_report(double elapsed_s, unsigned long last_events) {
+    unsigned long events = 0, beats = 0, dropped = 0, untracked = 0;
+    unsigned int sources = 0, high_water = 0;
+    for (int i = 0; i < shard_count; i++) {
+        struct shard *s = &shards[i];
+        events += atomic_load_explicit(&s->events, memory_order_relaxed);
+        beats += atomic_load_explicit(&s->beats, memory_order_relaxed);
+        sources += atomic_load_explicit(&s->sources, memory_order_relaxed);
+        untracked += atomic_load_explicit(&s->untracked, memory_order_relaxed);
+        dropped += atomic_load_explicit(&s->ring.dropped, memory_order_relaxed);
+        unsigned int hw = atomic_load_explicit(&s->ring.high_water, memory_order_relaxed);
+        if (hw > high_water) high_water = hw;
+    }
+    printf("Report: %u sources on %d shards | %lu events", sources, shard_count, events);
+    if (elapsed_s > 0) printf(" (%.0f/s)", (events - last_events) / elapsed_s);
+    printf(" | %lu beats | ring high water %u of %d | dropped %lu | input overruns %lu | %lu wakeups, max batch %u",
+           beats, high_water, RING_SIZE, dropped, atomic_load(&overruns), atomic_load(&wakeups),
+           atomic_load(&max_batch));
+    if (untracked) printf(" | untracked %lu", untracked);
+    printf("\n");
+}
+
+static int start_workers(int pin) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    for (int i = 0; i < shard_count; i++) {
+        if (pthread_create(&shards[i].thread, NULL, worker_thread, &shards[i]) != 0) {
+            fprintf(stderr, "Error starting worker %d\n", i);
+            running = 0;
+            for (int j = 0; j < i; j++) pthread_join(shards[j].thread, NULL);
+            return -1;
+        }
+        if (pin && cpus > 1) {
+            // one worker per core, leaving CPU 0 to the producer
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET((int)(1 + i % (cpus - 1)), &set);
+            pthread_setaffinity_np(shards[i].thread, sizeof(set), &set);
+        }
+    }
+    return 0;
+}
+
+static void stop_workers(void) {
+    running = 0;
+    for (int i = 0; i < shard_count; i++) {
+        pthread_join(shards[i].thread, NULL);
+    }
+}
+
+static void bench_source(int i, uint8_t *client, uint8_t *port) {
+    *client = (uint8_t)(128 + i / 16);
+    *port = (uint8_t)(i % 16);
+}
+
+// Benchmark without ALSA: one producer feeds synthetic clocks from many
+// sources through the same dispatch as the reader, as fast as the workers
+// take them, and reports what each worker (pinned to its own core) processed
+static int run_benchmark(double seconds, int sources) {
+    printf("Benchmark: %d sources, %d workers, %.1f s\n", sources, shard_count, seconds);
+    quiet = 1;
+    if (start_workers(1) < 0) {
+        return 1;
+    }
+
+    int64_t start = monotonic_ns();
+    int64_t end = start + (int64_t)(seconds * 1e9);
+    int64_t t = start;
+    unsigned long produced = 0, stalls = 0;
+    uint8_t type = SND_SEQ_EVENT_START;
+    while (running) {
+        for (int i = 0; i < sources; i++) {
+            struct clock_record rec = { .time_ns = t + i, .type = type };
+            bench_source(i, &rec.client, &rec.port);
+            struct ring *r = &shard_for(rec.client, rec.port)->ring;
+            while (ring_push(r, &rec) < 0) {
+                stalls++;
+                sched_yield();
+            }
+            produced++;
+        }
+        // 120 BPM: every source ticks once per 20.8 ms round
+        type = SND_SEQ_EVENT_CLOCK;
+        t += 20833333;
+        if (monotonic_ns() >= end) break;
+    }
+    // let the workers finish what is queued
+    for (int i = 0; i < shard_count; i++) {
+        struct ring *r = &shards[i].ring;
+        while (atomic_load(&r->tail) != atomic_load(&r->head)) sched_yield();
+    }
+    double elapsed = (monotonic_ns() - start) / 1e9;
+    stop_workers();
+
+    unsigned long total = 0;
+    for (int i = 0; i < shard_count; i++) {
+        unsigned long events = atomic_load(&shards[i].events);
+        total += events;
+        printf("  worker %2d: %3u sources | %10.0f events/s\n", i, atomic_load(&shards[i].sources),
+               events / elapsed);
+    }
+    printf("Total %.0f events/s, %.0f per worker core | producer stalled on full rings %lu times\n",
+           total / elapsed, total / elapsed / shard_count, stalls);
+    return 0;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-j workers] [-q] [-k] [-o file] [-i bytes] [-p events] [-b seconds [-s sources]]\n",
+            prog);
+    fprintf(stderr, "  -j N  analyse on N worker threads, sources are sharded by address (default 1)\n");
+    fprintf(stderr, "  -q    no per-beat output, periodic reports only\n");
+    fprintf(stderr, "  -k    use kernel arrival timestamps instead of reading the clock in the reader\n");
+    fprintf(stderr, "  -o F  write every event as \"monotonic_ns client port type\" to F\n");
+    fprintf(stderr, "  -i N  input buffer size in bytes (ALSA default if not given)\n");
+    fprintf(stderr, "  -p N  kernel input pool size in events (ALSA default if not given)\n");
+    fprintf(stderr, "  -b S  benchmark the workers for S seconds with synthetic clocks, no ALSA\n");
+    fprintf(stderr, "  -s N  number of synthetic sources for -b (default %d)\n", BENCH_SOURCES);
+}
+
 int main(int argc, char *argv[]) {
     snd_seq_t *seq_handle;
     int port_id;
     int err;
-    snd_seq_event_t *ev;
+    pthread_t reader;
+    double bench_seconds = 0.0;
+    int bench_sources = BENCH_SOURCES;
+    long input_buffer = 0;
+    long input_pool = 0;
+    int opt;
     
-    struct timeval last_tick_time = {0, 0};
-    struct timeval current_time;
-    int tick_count = 0;
-    int beat_count = 0;
-    int started = 0;
+    const char *log_path = NULL;
     
-    // Running average of tick intervals
-    double tick_intervals[SAMPLE_WINDOW];
-    int interval_index = 0;
-    int intervals_collected = 0;
+    while ((opt = getopt(argc, argv, "j:qko:i:p:b:s:h")) != -1) {
+        switch (opt) {
+            case 'j': shard_count = atoi(optarg); break;
+            case 'q': quiet = 1; break;
+            case 'k': kernel_stamps = 1; break;
+            case 'o': log_path = optarg; break;
+            case 'i': input_buffer = atol(optarg); break;
+            case 'p': input_pool = atol(optarg); break;
+            case 'b': bench_seconds = atof(optarg); break;
+            case 's': bench_sources = atoi(optarg); break;
+            default: usage(argv[0]); return 1;
+        }
+    }
+    if (shard_count < 1 || shard_count > MAX_SHARDS || bench_sources < 1 || bench_sources > 128 * 16 ||
+        bench_seconds < 0.0 || input_buffer < 0 || input_pool < 0) {
+        usage(argv[0]);
+        return 1;
+    }
     
     // Setup signal handler
-    signal(SIGINT, signal_handler);
-    signal(SIGTERM, signal_handler);
+    struct sigaction sa = { .sa_handler = signal_handler };
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    shards = aligned_alloc(CACHE_LINE, sizeof(struct shard) * shard_count);
+    if (shards == NULL) {
+        fprintf(stderr, "Error allocating %d shards\n", shard_count);
+        return 1;
+    }
+    memset(shards, 0, sizeof(struct shard) * shard_count);
+
+    if (bench_seconds > 0.0) {
+        int result = run_benchmark(bench_seconds, bench_sources);
+        free(shards);
+        return result;
+    }
+
+    if (log_path) {
+        record_log = fopen(log_path, "w");
+        if (record_log == NULL) {
+            fprintf(stderr, "Error opening %s\n", log_path);
+            free(shards);
+            return 1;
+        }
+    }
     
     // Open ALSA sequencer
-    err = snd_seq_open(&seq_handle, "default", SND_SEQ_OPEN_INPUT, 0);
+    // Starting the timestamp queue (-k) is an output event
+    err = snd_seq_open(&seq_handle, "default", kernel_stamps ? SND_SEQ_OPEN_DUPLEX : SND_SEQ_OPEN_INPUT,
+                       SND_SEQ_NONBLOCK);
     if (err < 0) {
         fprintf(stderr, "Error opening ALSA sequencer: %s\n", snd_strerror(err));
+        free(shards);
         return 1;
     }
     
     // Set client name
     snd_seq_set_client_name(seq_handle, "MIDI Clock Analyzer");
     
+    // Only realtime messages, with room for bursts
+    err = set_event_filter(seq_handle);
+    if (err >= 0 && input_buffer > 0) {
+        err = snd_seq_set_input_buffer_size(seq_handle, (size_t)input_buffer);
+    }
+    if (err >= 0 && input_pool > 0) {
+        err = snd_seq_set_client_pool_input(seq_handle, (size_t)input_pool);
+    }
+    if (err < 0) {
+        fprintf(stderr, "Error configuring input: %s\n", snd_strerror(err));
+        snd_seq_close(seq_handle);
+        free(shards);
+        return 1;
+    }
+
     // Create input port
-    port_id = snd_seq_create_simple_port(seq_handle, "MIDI Clock In",
-                                          SND_SEQ_PORT_CAP_WRITE | SND_SEQ_PORT_CAP_SUBS_WRITE,
-                                          SND_SEQ_PORT_TYPE_MIDI_GENERIC | SND_SEQ_PORT_TYPE_APPLICATION);
+    port_id = create_input_port(seq_handle);
     if (port_id < 0) {
         fprintf(stderr, "Error creating port: %s\n", snd_strerror(port_id));
         snd_seq_close(seq_handle);
+        free(shards);
         return 1;
     }
     
     printf("MIDI Clock Analyzer started\n");
     printf("Client ID: %d, Port ID: %d\n", snd_seq_client_id(seq_handle), port_id);
     printf("Connect a MIDI clock source to this port using:\n");
-    printf("  aconnect <source_client>:<source_port> %d:%d\n", 
+    printf("  aconnect <source_client>:<source_port> %d:%d\n",
            snd_seq_client_id(seq_handle), port_id);
     printf("\nWaiting for MIDI clock data...\n");
     printf("Press Ctrl+C to stop\n\n");
+    fflush(stdout);
     
-    // Initialize tick interval array
-    for (int i = 0; i < SAMPLE_WINDOW; i++) {
-        tick_intervals[i] = 0.0;
+    if (start_workers(0) < 0) {
+        snd_seq_close(seq_handle);
+        free(shards);
+        return 1;
+    }
+    if (pthread_create(&reader, NULL, reader_thread, seq_handle) != 0) {
+        fprintf(stderr, "Error starting reader thread\n");
+        stop_workers();
+        snd_seq_close(seq_handle);
+        free(shards);
+        return 1;
     }
     
-    // Main event loop
+    // Report periodically when watching several sources or when quiet
+    int64_t last_report = monotonic_ns();
+    unsigned long last_events = 0;
     while (running) {
-        // Wait for event with timeout
-        err = snd_seq_event_input(seq_handle, &ev);
-        
-        if (err == -EAGAIN || err == -ENOSPC) {
-            continue;
-        }
-        
-        if (err < 0) {
-            if (running) {
-                fprintf(stderr, "Error receiving event: %s\n", snd_strerror(err));
-            }
-            break;
-        }
-        
-        // Get current time
-        gettimeofday(&current_time, NULL);
-        
-        switch (ev->type) {
-            case SND_SEQ_EVENT_START:
-                printf(">>> MIDI START received\n");
-                started = 1;
-                tick_count = 0;
-                beat_count = 0;
-                interval_index = 0;
-                intervals_collected = 0;
-                last_tick_time.tv_sec = 0;
-                last_tick_time.tv_usec = 0;
-                break;
-                
-            case SND_SEQ_EVENT_STOP:
-                printf(">>> MIDI STOP received\n");
-                printf("Total ticks received: %d\n", tick_count);
-                printf("Total beats: %d\n", beat_count);
-                started = 0;
-                break;
-                
-            case SND_SEQ_EVENT_CONTINUE:
-                printf(">>> MIDI CONTINUE received\n");
-                started = 1;
-                break;
-                
-            case SND_SEQ_EVENT_CLOCK:
-                if (!started) {
-                    printf(">>> MIDI CLOCK received (but not started yet)\n");
-                    started = 1;
-                }
-                
-                tick_count++;
-                
-                // Calculate interval from last tick
-                if (last_tick_time.tv_sec != 0) {
-                    long interval_us = (current_time.tv_sec - last_tick_time.tv_sec) * 1000000L +
-                                      (current_time.tv_usec - last_tick_time.tv_usec);
-                    
-                    // Store interval in circular buffer
-                    tick_intervals[interval_index] = (double)interval_us;
-                    interval_index = (interval_index + 1) % SAMPLE_WINDOW;
-                    if (intervals_collected < SAMPLE_WINDOW) {
-                        intervals_collected++;
-                    }
-                    
-                    // Calculate average interval
-                    double avg_interval = 0.0;
-                    for (int i = 0; i < intervals_collected; i++) {
-                        avg_interval += tick_intervals[i];
-                    }
-                    avg_interval /= intervals_collected;
-                    
-                    // Calculate BPM from average interval
-                    double bpm = calculate_bpm(avg_interval);
-                    
-                    // Print status every quarter note (24 ticks)
-                    if (tick_count % PPQN == 0) {
-                        beat_count++;
-                        printf("Beat %4d | Tick %6d | Interval: %7.2f µs | BPM: %6.2f | Avg over %d ticks\n",
-                               beat_count, tick_count, (double)interval_us, bpm, intervals_collected);
-                    }
-                }
-                
-                last_tick_time = current_time;
-                break;
-                
-            default:
-                // Ignore other event types
-                break;
+        sleep(1);
+        int64_t now = monotonic_ns();
+        if ((shard_count > 1 || quiet) && now - last_report >= REPORT_INTERVAL_S * 1000000000LL) {
+            print_report((now - last_report) / 1e9, last_events);
+            last_events = 0;
+            for (int i = 0; i < shard_count; i++) last_events += atomic_load(&shards[i].events);
+            last_report = now;
         }
-        
-        snd_seq_free_event(ev);
     }
     
-    // Cleanup
+    // Cleanup. The reader notices within READER_POLL_MS
     printf("\nCleaning up...\n");
+    pthread_join(reader, NULL);
+    stop_workers();
+    print_report(0.0, 0);
     snd_seq_close(seq_handle);
+    free(shards);
+    if (record_log) fclose(record_log);
     printf("MIDI Clock Analyzer stopped\n");
     
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,359 @@
+#!/usr/bin/env python3
+
+"""Measure how fast a tempo change reaches the MIDI clock output.
+
+Drives a programme of tempo steps and a ramp through the C library, once
+per scheduling mode, while monitor.c receives the clock with kernel arrival
+timestamps (-k) and logs every event (-o). Clocks are paced by the queue's
+occupancy, as clock.py does by default. Build both first, then:
+
+    python3 stepbench.py --json report.json
+
+Scheduling modes:
+
+- now:  midi_set_tempo at the moment of the change
+- time: midi_set_tempo_at_time, --lead-ms ahead of the change
+- link: a synthetic Link session followed through the tempo source
+        arbitration (midi_source_link_update / midi_source_service)
+
+Reported for every change, from the moment it was commanded:
+
+- latency: until the first clock whose interval shows 10% of the step
+  (for "time" also the error against the scheduled moment)
+- rise time: 10% to 90% of the step
+- overshoot: beyond the new tempo, in % of the step
+- settling time: until the tempo stays within the settling band
+- steady-state error over the last quarter of the hold
+
+Rise, overshoot and settling use the tempo averaged over a 16th note
+(6 clocks), latency the single clock intervals. --compare OLD.json prints
+the differences to an earlier report, e.g. of another version.
+"""
+
+import argparse
+import ctypes
+import json
+import os
+import signal
+import statistics
+import subprocess
+import sys
+import tempfile
+import time
+
+PPQN = 24
+SMOOTH_CLOCKS = 6
+SOURCE_SERVICE_CLOCKS = 6  # as in clock.py
+RAMP_UPDATE_CLOCKS = 6
+EFFECT_FRACTION = 0.1
+RISE_LOW, RISE_HIGH = 0.1, 0.9
+SETTLE_FRACTION = 0.02
+SETTLE_MIN_BPM = 0.1
+EVENT_CLOCK = 36
+MODES = ("now", "time", "link")
+QUEUE_TIMERS = {"system": 0, "hrtimer": 1}
+
+
+def load_lib():
+    lib_path = os.path.join(os.path.dirname(os.path.abspath(__file__)), 'liblinkbridge.so')
+    lib = ctypes.CDLL(lib_path)
+    for name in ("midi_init", "midi_send_start", "midi_send_clock", "midi_send_stop", "midi_get_client_id",
+                 "midi_get_port_id", "midi_source_service"):
+        getattr(lib, name).restype = ctypes.c_int
+    lib.midi_cleanup.restype = None
+    lib.midi_set_tempo.argtypes = [ctypes.c_int]
+    lib.midi_set_tempo_at_time.argtypes = [ctypes.c_longlong, ctypes.c_int]
+    lib.midi_set_queue_timer.argtypes = [ctypes.c_int] * 4
+    lib.midi_source_enable.argtypes = [ctypes.c_double, ctypes.c_double]
+    lib.midi_source_link_update.restype = None
+    lib.midi_source_link_update.argtypes = [ctypes.c_double, ctypes.c_double, ctypes.c_longlong, ctypes.c_int]
+    lib.midi_get_tempo.restype = ctypes.c_double
+    lib.midi_occupancy_wait_us.restype = ctypes.c_longlong
+    lib.midi_wait.argtypes = [ctypes.c_longlong]
+    return lib
+
+
+def start_monitor(path, log_path):
+    """Start the monitor with kernel timestamps and return it with its address."""
+    proc = subprocess.Popen([path, "-k", "-q", "-o", log_path], stdout=subprocess.PIPE, text=True)
+    for line in proc.stdout:
+        if line.startswith("Client ID:"):
+            client, port = (int(field.split(":")[1]) for field in line.split(","))
+            return proc, f"{client}:{port}"
+    raise RuntimeError("monitor did not start")
+
+
+def programme(base, hold_s, ramp_s):
+    """(kind, from BPM, to BPM, duration of the change, time held afterwards)."""
+    return [
+        ("step", base, base + 20.0, 0.0, hold_s),
+        ("step", base + 20.0, base - 20.0, 0.0, hold_s),
+        ("step", base - 20.0, base, 0.0, hold_s),
+        ("ramp", base, base + 30.0, ramp_s, hold_s),
+        ("step", base + 30.0, base, 0.0, hold_s),
+    ]
+
+
+class LinkTimeline:
+    """A Link session's beat timeline whose tempo can be changed at any moment."""
+
+    def __init__(self, bpm, start_ns):
+        self.bpm, self.ref_ns, self.ref_beat = bpm, start_ns, 0.0
+
+    def beat(self, now_ns):
+        return self.ref_beat + (now_ns - self.ref_ns) * self.bpm / 60e9
+
+    def set_tempo(self, bpm, now_ns):
+        self.ref_beat, self.ref_ns, self.bpm = self.beat(now_ns), now_ns, bpm
+
+
+def drive(lib, mode, base, changes, settle_s, args):
+    """Play the programme in one mode; returns the commanded changes."""
+    lead_ns = int(args.lead_ms * 1e6)
+    lib.midi_set_tempo(int(round(base * 10)))
+    if mode == "link" and lib.midi_source_enable(args.max_slew, args.max_phase_rate) < 0:
+        raise RuntimeError("cannot enable tempo source arbitration")
+
+    start = time.monotonic_ns()
+    lib.midi_send_start()
+    link = LinkTimeline(base, start)
+    commanded = []
+
+    def command(bpm, now):
+        if mode == "now":
+            lib.midi_set_tempo(int(round(bpm * 10)))
+        elif mode == "time":
+            lib.midi_set_tempo_at_time(now + lead_ns, int(round(bpm * 10)))
+        else:
+            link.set_tempo(bpm, now)
+
+    t = start + int(settle_s * 1e9)
+    schedule = []
+    for kind, from_bpm, to_bpm, duration_s, hold_s in changes:
+        schedule.append((t, kind, from_bpm, to_bpm, int(duration_s * 1e9)))
+        t += int((duration_s + hold_s) * 1e9)
+    end = t
+
+    clocks = 0
+    active = None
+    while time.monotonic_ns() < end:
+        now = time.monotonic_ns()
+        if schedule and now >= schedule[0][0]:
+            _, kind, from_bpm, to_bpm, duration_ns = active = schedule.pop(0)
+            command(to_bpm if kind == "step" else from_bpm, now)
+            commanded.append({"kind": kind, "from_bpm": from_bpm, "to_bpm": to_bpm, "command_ns": now,
+                              "target_ns": now + (lead_ns if mode == "time" else 0),
+                              "duration_ns": duration_ns})
+
+        # pace like clock.py: wait while the queue holds enough clocks, but
+        # wake for the next change on time
+        wait_us = lib.midi_occupancy_wait_us()
+        if wait_us < 0:
+            raise RuntimeError("cannot read the queue position")
+        if wait_us > 0:
+            if schedule:
+                wait_us = min(wait_us, max(1, (schedule[0][0] - now + 999) // 1000))
+            lib.midi_wait(wait_us)
+            continue
+        if lib.midi_send_clock() < 0:
+            raise RuntimeError("failed to send clock")
+        clocks += 1
+        now = time.monotonic_ns()
+
+        if active and active[1] == "ramp" and clocks % RAMP_UPDATE_CLOCKS == 0:
+            _, _, from_bpm, to_bpm, duration_ns = active
+            progress = min(1.0, (now - commanded[-1]["command_ns"]) / duration_ns)
+            command(from_bpm + (to_bpm - from_bpm) * progress, now)
+            if progress >= 1.0:
+                active = None
+
+        if mode == "link" and clocks % SOURCE_SERVICE_CLOCKS == 0:
+            lib.midi_source_link_update(link.bpm, link.beat(now), now, 1)
+            lib.midi_source_service()
+
+    lib.midi_send_stop()
+    time.sleep(0.2)
+    return start, commanded
+
+
+def read_clocks(log_path, start_ns, end_ns):
+    """Arrival times of the clocks of one run, from the monitor's log."""
+    clocks = []
+    with open(log_path) as f:
+        for line in f:
+            fields = line.split()
+            if len(fields) == 4 and int(fields[3]) == EVENT_CLOCK and start_ns <= int(fields[0]) < end_ns:
+                clocks.append(int(fields[0]))
+    return clocks
+
+
+def tempo_series(clocks, span):
+    """(time of the clock closing the window, BPM over the last span intervals).
+
+    Windows without a positive length (clocks stamped alike) are left out."""
+    return [(clocks[i], 60e9 * span / (PPQN * (clocks[i] - clocks[i - span])))
+            for i in range(span, len(clocks)) if clocks[i] > clocks[i - span]]
+
+
+def analyse_change(change, until_ns, single, smooth):
+    from_bpm, to_bpm, cmd = change["from_bpm"], change["to_bpm"], change["command_ns"]
+    delta = to_bpm - from_bpm
+    done = cmd + change["duration_ns"]  # ramps are judged from their end on
+
+    def frac(bpm):
+        return (bpm - from_bpm) / delta
+
+    def first(series, cond, after=cmd):
+        return next((t for t, bpm in series if after <= t < until_ns and cond(bpm)), None)
+
+    effect = first(single, lambda b: frac(b) >= EFFECT_FRACTION)
+    t_low = first(smooth, lambda b: frac(b) >= RISE_LOW)
+    t_high = first(smooth, lambda b: frac(b) >= RISE_HIGH)
+
+    window = [(t, bpm) for t, bpm in smooth if done <= t < until_ns]
+    band = max(SETTLE_FRACTION * abs(delta), SETTLE_MIN_BPM)
+    overshoot = max((frac(bpm) - 1.0 for _, bpm in window), default=0.0)
+    outside = [i for i, (_, bpm) in enumerate(window) if abs(bpm - to_bpm) > band]
+    settled = None
+    if window and (not outside or outside[-1] + 1 < len(window)):
+        settled = window[outside[-1] + 1][0] if outside else window[0][0]
+    tail = [bpm for _, bpm in window[len(window) * 3 // 4:]]
+
+    result = {
+        "kind": change["kind"],
+        "from_bpm": from_bpm,
+        "to_bpm": to_bpm,
+        "latency_ms": (effect - cmd) / 1e6 if effect else None,
+        "rise_ms": (t_high - t_low) / 1e6 if t_low and t_high else None,
+        "overshoot_pct": max(0.0, overshoot) * 100.0,
+        "settling_ms": (settled - done) / 1e6 if settled else None,
+        "steady_error_bpm": statistics.mean(tail) - to_bpm if tail else None,
+    }
+    if change["target_ns"] != cmd:
+        result["target_error_ms"] = (effect - change["target_ns"]) / 1e6 if effect else None
+    return result
+
+
+def summarise(results):
+    def values(key, kind=None):
+        return [r[key] for r in results if r.get(key) is not None and (kind is None or r["kind"] == kind)]
+
+    def mean(v):
+        return statistics.mean(v) if v else None
+
+    latency = values("latency_ms")
+    return {
+        "latency_ms_mean": mean(latency),
+        "latency_ms_max": max(latency) if latency else None,
+        "rise_ms_mean": mean(values("rise_ms", "step")),
+        "overshoot_pct_max": max(values("overshoot_pct"), default=None),
+        "settling_ms_mean": mean(values("settling_ms")),
+        "settling_ms_max": max(values("settling_ms"), default=None),
+        "unsettled": sum(r["settling_ms"] is None for r in results),
+    }
+
+
+def git_version():
+    try:
+        return subprocess.run(["git", "describe", "--always", "--dirty"], capture_output=True, text=True,
+                              cwd=os.path.dirname(os.path.abspath(__file__)), check=True).stdout.strip()
+    except (OSError, subprocess.CalledProcessError):
+        return None
+
+
+def fmt(value, unit=""):
+    return f"{value:.1f}{unit}" if value is not None else "-"
+
+
+def compare(report, path):
+    with open(path) as f:
+        old = json.load(f)
+    print(f"\nAgainst {path} ({old.get('version') or 'unknown version'}):")
+    for mode, data in report["modes"].items():
+        before = old.get("modes", {}).get(mode)
+        if before is None:
+            continue
+        deltas = []
+        for key, value in data["summary"].items():
+            prev = before["summary"].get(key)
+            if value is not None and prev is not None and key != "unsettled":
+                deltas.append(f"{key} {value - prev:+.1f}")
+        print(f"  {mode:5s} " + " | ".join(deltas))
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Tempo step-response benchmark")
+    parser.add_argument("--modes", default=",".join(MODES), help="comma separated, of: " + ", ".join(MODES))
+    parser.add_argument("--bpm", type=float, default=120.0, help="base tempo")
+    parser.add_argument("--hold", type=float, default=6.0, help="seconds each tempo is held")
+    parser.add_argument("--ramp", type=float, default=4.0, help="length of the ramp in seconds")
+    parser.add_argument("--settle", type=float, default=4.0, help="seconds at the base tempo before the first change")
+    parser.add_argument("--lead-ms", type=float, default=100.0, help="how far ahead the time mode schedules")
+    parser.add_argument("--max-slew", type=float, default=5.0, help="link mode slew limit (BPM per second)")
+    parser.add_argument("--max-phase-rate", type=float, default=0.05, help="link mode phase correction (beats/s)")
+    parser.add_argument("--queue-timer", choices=sorted(QUEUE_TIMERS), help="timer driving the queue")
+    parser.add_argument("--monitor", default=os.path.join(os.path.dirname(os.path.abspath(__file__)), "monitor"),
+                        help="path of the built monitor")
+    parser.add_argument("--json", metavar="PATH", help="write the report as JSON")
+    parser.add_argument("--compare", metavar="PATH", help="print differences to an earlier JSON report")
+    args = parser.parse_args()
+    modes = args.modes.split(",")
+    if any(m not in MODES for m in modes):
+        parser.error(f"unknown mode in {args.modes}")
+    # arbitration cannot be turned off again, so the link mode goes last
+    modes.sort(key=MODES.index)
+
+    lib = load_lib()
+    if lib.midi_init() < 0:
+        print("[Python] Error: Failed to initialize MIDI")
+        return 1
+    if args.queue_timer and lib.midi_set_queue_timer(QUEUE_TIMERS[args.queue_timer], -1, 0, 0) < 0:
+        print(f"[Python] Warning: Failed to select the {args.queue_timer} queue timer")
+
+    log_fd, log_path = tempfile.mkstemp(prefix="stepbench-", suffix=".log")
+    os.close(log_fd)
+    monitor, monitor_addr = start_monitor(args.monitor, log_path)
+    runs = {}
+    try:
+        source = f"{lib.midi_get_client_id()}:{lib.midi_get_port_id()}"
+        subprocess.run(["aconnect", source, monitor_addr], check=True)
+        for mode in modes:
+            print(f"[Python] Mode {mode}")
+            changes = programme(args.bpm, args.hold, args.ramp)
+            start, commanded = drive(lib, mode, args.bpm, changes, args.settle, args)
+            runs[mode] = (start, time.monotonic_ns(), commanded)
+    finally:
+        monitor.send_signal(signal.SIGINT)
+        monitor.wait()
+        lib.midi_cleanup()
+
+    report = {"version": git_version(), "settings": vars(args), "modes": {}}
+    for mode, (start, end, commanded) in runs.items():
+        clocks = read_clocks(log_path, start, end)
+        single, smooth = tempo_series(clocks, 1), tempo_series(clocks, SMOOTH_CLOCKS)
+        results = []
+        for i, change in enumerate(commanded):
+            until = commanded[i + 1]["command_ns"] if i + 1 < len(commanded) else end
+            results.append(analyse_change(change, until, single, smooth))
+        report["modes"][mode] = {"clocks": len(clocks), "changes": results, "summary": summarise(results)}
+
+        print(f"\n{mode}: {len(clocks)} clocks")
+        for r in results:
+            target = f" (vs target {fmt(r['target_error_ms'], ' ms')})" if "target_error_ms" in r else ""
+            print(f"  {r['kind']:4s} {r['from_bpm']:6.1f} -> {r['to_bpm']:6.1f} BPM"
+                  f" | latency {fmt(r['latency_ms'], ' ms')}{target}"
+                  f" | rise {fmt(r['rise_ms'], ' ms')} | overshoot {r['overshoot_pct']:.1f}%"
+                  f" | settling {fmt(r['settling_ms'], ' ms')}"
+                  f" | steady error {fmt(r['steady_error_bpm'], ' BPM')}")
+    os.unlink(log_path)
+
+    if args.json:
+        with open(args.json, "w") as f:
+            json.dump(report, f, indent=2)
+    if args.compare:
+        compare(report, args.compare)
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,106 @@
+#!/usr/bin/env python3
+
+"""Compile a JSON setlist into the binary tempo map read by midi_map_load().
+
+Setlist format:
+
+    {"songs": [
+        {"name": "Opener", "auto_next": true,
+         "segments": [
+             {"beats": 32, "bpm": 120, "timesig": "4/4"},
+             {"beats": 16, "bpm": 120, "to_bpm": 140},
+             {"beats": 64, "bpm": 140}],
+         "cues": [
+             {"beat": 32, "type": "mark"},
+             {"beat": 112, "type": "jump", "to": 48, "repeat": 1},
+             {"beat": 112, "type": "stop"}]}
+    ]}
+
+Segments follow each other; "to_bpm" makes a linear ramp over the segment
+(played in steps of an eighth of a beat) and "timesig" carries over until
+changed. Cue types are start, stop, jump and mark; a start cue after the top
+of the song sends its song position and CONTINUE. "repeat" limits how often
+a jump is taken (0 = every time).
+"""
+
+import json
+import struct
+import sys
+
+QUEUE_TEMPO_PPQ = 2880  # must match midi_clock_lib.c
+CLOCK_STEP = QUEUE_TEMPO_PPQ // 24
+
+MAGIC = b"LBTM"
+VERSION = 1
+SONG_AUTO_NEXT = 0x1
+CUE_TYPES = {"start": 1, "stop": 2, "jump": 3, "mark": 4}
+
+HEADER = struct.Struct("<4sHHIIII")
+SONG = struct.Struct("<32sIIIIII")
+SEGMENT = struct.Struct("<IIIIBBH")
+CUE = struct.Struct("<IHHI")
+
+
+def beats_to_ticks(beats, what, on_clock=False):
+    ticks = round(float(beats) * QUEUE_TEMPO_PPQ)
+    if on_clock and ticks % CLOCK_STEP:
+        raise ValueError(f"{what}: beat {beats} is not on a MIDI clock (1/24 beat)")
+    return ticks
+
+
+def us_per_beat(bpm):
+    return int(round(60000000.0 / float(bpm)))
+
+
+def compile_setlist(setlist):
+    songs, segments, cues = [], [], []
+    for song_index, song in enumerate(setlist["songs"]):
+        name = song.get("name", f"song {song_index}")
+        first_segment, first_cue = len(segments), len(cues)
+        tick = 0
+        num, den = 4, 4
+        for seg in song["segments"]:
+            if "timesig" in seg:
+                num, den = (int(x) for x in seg["timesig"].split("/"))
+            length = beats_to_ticks(seg["beats"], name)
+            start_us = us_per_beat(seg["bpm"])
+            end_us = us_per_beat(seg.get("to_bpm", seg["bpm"]))
+            segments.append(SEGMENT.pack(tick, length, start_us, end_us, num, den, 0))
+            tick += length
+        if tick % CLOCK_STEP:
+            raise ValueError(f"{name}: song length is not on a MIDI clock")
+
+        for cue in sorted(song.get("cues", []), key=lambda c: float(c["beat"])):
+            cue_tick = beats_to_ticks(cue["beat"], name, on_clock=True)
+            target = beats_to_ticks(cue.get("to", 0), name, on_clock=True)
+            cues.append(CUE.pack(cue_tick, CUE_TYPES[cue["type"]], int(cue.get("repeat", 0)), target))
+
+        flags = SONG_AUTO_NEXT if song.get("auto_next") else 0
+        songs.append(SONG.pack(name.encode()[:32], first_segment, len(segments) - first_segment,
+                               first_cue, len(cues) - first_cue, tick, flags))
+
+    size = (HEADER.size + len(songs) * SONG.size + len(segments) * SEGMENT.size +
+            len(cues) * CUE.size)
+    header = HEADER.pack(MAGIC, VERSION, 0, len(songs), len(segments), len(cues), size)
+    return header + b"".join(songs) + b"".join(segments) + b"".join(cues)
+
+
+def main():
+    if len(sys.argv) != 3:
+        print(f"Usage: {sys.argv[0]} <setlist.json> <output.lbtm>")
+        return 1
+    with open(sys.argv[1]) as f:
+        setlist = json.load(f)
+    try:
+        data = compile_setlist(setlist)
+    except (KeyError, ValueError) as e:
+        print(f"Error: {e}")
+        return 1
+    with open(sys.argv[2], "wb") as f:
+        f.write(data)
+    print(f"Wrote {len(setlist['songs'])} songs ({len(data)} bytes) to {sys.argv[2]}")
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())